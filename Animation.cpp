@@ -0,0 +1,166 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Animation.h"
+
+#include "Cancellation.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+namespace
+{
+uint8_t mix (uint8_t a, uint8_t b, double weight)
+{
+	return static_cast<uint8_t> (std::lround (a + (b - a) * weight));
+}
+
+// Raised cosine, 0 at the start and end of the period, 1 in the middle
+double breath (double phase)
+{
+	return 0.5 - 0.5 * std::cos (2 * M_PI * phase);
+}
+
+bool sameColor (const Color &a, const Color &b)
+{
+	return a.r == b.r && a.g == b.g && a.b == b.b;
+}
+}
+
+Animation::Animation (CorsairDevice *device, const Settings &settings):
+	_device (device),
+	_settings (settings)
+{
+}
+
+Animation::Stats Animation::run ()
+{
+	Stats stats = {};
+	Clock &clock = _device->clock ();
+	uint64_t interval = std::max (1.0, std::round (1e6 / _settings.fps));
+	uint64_t start = clock.now ();
+	uint64_t end = _settings.duration > 0 ?
+		start + static_cast<uint64_t> (_settings.duration * 1e6) :
+		std::numeric_limits<uint64_t>::max ();
+
+	Color last_color = {};
+	unsigned int last_brightness = 0;
+	bool written = false;
+
+	// SIGINT and SIGTERM end the animation, the shadow state is saved
+	// once it is over
+	struct Release {
+		CorsairDevice *device;
+		~Release ()
+		{
+			device->releaseShadow ();
+		}
+	} release = { _device };
+	Cancellation::Graceful graceful;
+	_device->holdShadow ();
+
+	for (uint64_t frame = 0; !Cancellation::stopRequested (); ) {
+		uint64_t deadline = start + frame * interval;
+		if (deadline >= end)
+			break;
+		double phase = std::fmod ((deadline - start) / (_settings.period * 1e6), 1.0);
+		// The transfer deadline bounds each frame, not the whole run
+		_device->startDeadline ();
+		if (_settings.brightness) {
+			unsigned int value = brightness (phase);
+			if (written && value == last_brightness)
+				++stats.unchanged;
+			else {
+				_device->setBacklightBrightness (value);
+				last_brightness = value;
+				++stats.writes;
+			}
+		}
+		else {
+			Color value = color (_settings, phase);
+			if (written && sameColor (value, last_color))
+				++stats.unchanged;
+			else {
+				_device->setProfileColor (_settings.profile_index, value);
+				last_color = value;
+				++stats.writes;
+			}
+		}
+		written = true;
+		++stats.frames;
+
+		// Drop the frames already late, and wait for the next one
+		uint64_t now = clock.now ();
+		uint64_t next = frame + 1;
+		if (now >= start + next * interval) {
+			uint64_t due = (now - start) / interval + 1;
+			stats.skipped += due - next;
+			next = due;
+		}
+		frame = next;
+		deadline = start + frame * interval;
+		if (deadline >= end)
+			break;
+		clock.sleep (deadline - now);
+	}
+	return stats;
+}
+
+Color Animation::color (const Settings &settings, double phase)
+{
+	switch (settings.effect) {
+	case HueCycle: {
+		double h = phase * 6;
+		int sector = static_cast<int> (h) % 6;
+		uint8_t rise = std::lround (255 * (h - std::floor (h)));
+		uint8_t fall = 255 - rise;
+		switch (sector) {
+		case 0: return { 255, rise, 0 };
+		case 1: return { fall, 255, 0 };
+		case 2: return { 0, 255, rise };
+		case 3: return { 0, fall, 255 };
+		case 4: return { rise, 0, 255 };
+		default: return { 255, 0, fall };
+		}
+	}
+	case Fade: {
+		double weight = phase < 0.5 ? 2 * phase : 2 - 2 * phase;
+		return {
+			mix (settings.from.r, settings.to.r, weight),
+			mix (settings.from.g, settings.to.g, weight),
+			mix (settings.from.b, settings.to.b, weight),
+		};
+	}
+	case Breathe:
+	default: {
+		double weight = breath (phase);
+		return {
+			mix (0, settings.from.r, weight),
+			mix (0, settings.from.g, weight),
+			mix (0, settings.from.b, weight),
+		};
+	}
+	}
+}
+
+unsigned int Animation::brightness (double phase)
+{
+	return std::lround (3 * breath (phase));
+}
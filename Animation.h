@@ -0,0 +1,74 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "CorsairDevice.h"
+
+/*
+ * Color and brightness effects played by the host, one write per frame
+ * through the device setters. Frames are due at absolute deadlines
+ * from the start of the animation on the device clock, so that the
+ * frame rate does not drift with the time taken by the writes. When the
+ * device falls behind, the frames whose deadline has passed are
+ * dropped. Frames that would write the value already on the device are
+ * not written. A stop request (Cancellation::requestStop, made on
+ * SIGINT and SIGTERM) ends the animation.
+ */
+class Animation
+{
+public:
+	enum Effect {
+		HueCycle,	// every hue in turn
+		Fade,		// from one color to the other and back
+		Breathe,	// a color or the brightness fading in and out
+	};
+
+	struct Settings {
+		Effect effect;
+		Color from, to;
+		bool brightness;		// breathe the backlight brightness instead of a color
+		unsigned int profile_index;	// 0 for the current profile
+		double fps;
+		double period;			// seconds per cycle
+		double duration;		// seconds, 0 plays until interrupted
+	};
+
+	struct Stats {
+		unsigned int frames;	// frames played
+		unsigned int writes;
+		unsigned int unchanged;	// frames with the value already written
+		unsigned int skipped;	// frames dropped past their deadline
+	};
+
+	Animation (CorsairDevice *device, const Settings &settings);
+
+	// Throws the errors of the device
+	Stats run ();
+
+	// Frame value at phase, from 0 to 1 over a period
+	static Color color (const Settings &settings, double phase);
+	static unsigned int brightness (double phase);
+
+private:
+	CorsairDevice *_device;
+	Settings _settings;
+};
+
+#endif
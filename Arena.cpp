@@ -0,0 +1,49 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "Arena.h"
+
+#include <algorithm>
+
+Arena::Arena (std::size_t chunk_size):
+	_chunk_size (chunk_size),
+	_pos (nullptr),
+	_end (nullptr)
+{
+}
+
+void *Arena::allocate (std::size_t size, std::size_t align)
+{
+	uintptr_t pos = (reinterpret_cast<uintptr_t> (_pos) + align-1) & ~(align-1);
+	if (!_pos || pos + size > reinterpret_cast<uintptr_t> (_end)) {
+		// Blocks larger than a chunk get a chunk of their own
+		std::size_t chunk_size = std::max (_chunk_size, size + align);
+		_chunks.emplace_back (new uint8_t[chunk_size]);
+		_pos = _chunks.back ().get ();
+		_end = _pos + chunk_size;
+		pos = (reinterpret_cast<uintptr_t> (_pos) + align-1) & ~(align-1);
+	}
+	_pos = reinterpret_cast<uint8_t *> (pos + size);
+	return reinterpret_cast<void *> (pos);
+}
+
+std::size_t Arena::chunkCount () const
+{
+	return _chunks.size ();
+}
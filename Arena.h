@@ -0,0 +1,99 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+/*
+ * Bump allocator: memory is cut from large chunks and only released all
+ * at once when the arena is destroyed. Nothing is constructed or
+ * destroyed, so it only holds trivial types.
+ */
+class Arena
+{
+public:
+	Arena (std::size_t chunk_size = 64*1024);
+
+	void *allocate (std::size_t size, std::size_t align);
+
+	template <typename T>
+	T *allocate (std::size_t count)
+	{
+		static_assert (std::is_trivially_copyable<T>::value &&
+			       std::is_trivially_destructible<T>::value,
+			       "Arena only holds trivial types");
+		return static_cast<T *> (allocate (count * sizeof (T), alignof (T)));
+	}
+
+	std::size_t chunkCount () const;
+
+private:
+	std::size_t _chunk_size;
+	std::vector<std::unique_ptr<uint8_t[]>> _chunks;
+	uint8_t *_pos, *_end;
+};
+
+/*
+ * Growable array in an arena. Growing copies the elements to a twice
+ * larger block and leaves the old one unused, clearing keeps the block.
+ */
+template <typename T>
+class ArenaBuffer
+{
+public:
+	ArenaBuffer (Arena &arena, std::size_t capacity = 16):
+		_arena (arena),
+		_data (arena.allocate<T> (capacity)),
+		_size (0),
+		_capacity (capacity)
+	{
+	}
+
+	void push_back (const T &value)
+	{
+		if (_size == _capacity) {
+			T *data = _arena.allocate<T> (2*_capacity);
+			memcpy (data, _data, _size * sizeof (T));
+			_data = data;
+			_capacity *= 2;
+		}
+		_data[_size++] = value;
+	}
+
+	void clear () { _size = 0; }
+
+	T *begin () { return _data; }
+	T *end () { return _data + _size; }
+	T &operator[] (std::size_t i) { return _data[i]; }
+	std::size_t size () const { return _size; }
+
+private:
+	Arena &_arena;
+	T *_data;
+	std::size_t _size, _capacity;
+};
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Cancellation.h"
+
+#include <csignal>
+#include <cerrno>
+
+extern "C" {
+#include <sys/eventfd.h>
+#include <unistd.h>
+}
+
+static std::atomic<unsigned int> graceful (0);
+static std::atomic<bool> stop_requested (false);
+static std::atomic<int> stop_fd (-1);
+
+Cancellation::Cancellation ():
+	_cancelled (false)
+{
+}
+
+void Cancellation::cancel ()
+{
+	_cancelled = true;
+}
+
+void Cancellation::reset ()
+{
+	_cancelled = false;
+}
+
+bool Cancellation::cancelled () const
+{
+	return _cancelled;
+}
+
+Cancellation &Cancellation::process ()
+{
+	static Cancellation cancellation;
+	return cancellation;
+}
+
+static void interruptProcess (int)
+{
+	Cancellation::requestStop ();
+	if (graceful == 0)
+		Cancellation::process ().cancel ();
+}
+
+void Cancellation::catchSignals ()
+{
+	stopFd ();
+	struct sigaction action = {};
+	action.sa_handler = interruptProcess;
+	action.sa_flags = SA_RESETHAND;
+	sigaction (SIGINT, &action, nullptr);
+	sigaction (SIGTERM, &action, nullptr);
+}
+
+Cancellation::Graceful::Graceful ()
+{
+	++graceful;
+}
+
+Cancellation::Graceful::~Graceful ()
+{
+	--graceful;
+}
+
+void Cancellation::requestStop ()
+{
+	stop_requested = true;
+	int fd = stop_fd;
+	if (fd != -1) {
+		int saved_errno = errno;
+		uint64_t one = 1;
+		while (write (fd, &one, sizeof (one)) == -1 && errno == EINTR)
+			;
+		errno = saved_errno;
+	}
+}
+
+bool Cancellation::stopRequested ()
+{
+	return stop_requested;
+}
+
+int Cancellation::stopFd ()
+{
+	int fd = stop_fd;
+	if (fd == -1) {
+		int expected = -1;
+		fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (!stop_fd.compare_exchange_strong (expected, fd)) {
+			close (fd);
+			fd = expected;
+		}
+	}
+	return fd;
+}
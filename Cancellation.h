@@ -0,0 +1,67 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CANCELLATION_H
+#define CANCELLATION_H
+
+#include <atomic>
+
+/*
+ * Request to abandon the transfers in progress and refuse the next ones.
+ * Cancelling only sets a flag, so it is safe from signal handlers and
+ * other threads; transports check it while they wait.
+ */
+class Cancellation
+{
+public:
+	Cancellation ();
+
+	void cancel ();
+	void reset ();
+	bool cancelled () const;
+
+	// Shared by the transports of the process
+	static Cancellation &process ();
+	// Cancel the process transfers on the first SIGINT or SIGTERM, the
+	// second one gets the default action. Installed once by the main
+	// thread, before any worker starts.
+	static void catchSignals ();
+
+	/*
+	 * Stop requests for the commands running until interrupted (animate,
+	 * ingest). While a Graceful scope is held, the first signal requests
+	 * a stop instead of cancelling the transfers, so the command ends
+	 * after its current frame. stopFd becomes readable once a stop is
+	 * requested.
+	 */
+	class Graceful
+	{
+	public:
+		Graceful ();
+		~Graceful ();
+	};
+	// Safe from signal handlers
+	static void requestStop ();
+	static bool stopRequested ();
+	static int stopFd ();
+
+private:
+	std::atomic<bool> _cancelled;
+};
+
+#endif
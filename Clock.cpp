@@ -0,0 +1,65 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Clock.h"
+
+#include "Trace.h"
+
+#include <chrono>
+
+extern "C" {
+#include <unistd.h>
+}
+
+Clock::~Clock ()
+{
+}
+
+Clock &Clock::system ()
+{
+	static SystemClock clock;
+	return clock;
+}
+
+uint64_t SystemClock::now ()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds> (
+			std::chrono::steady_clock::now ().time_since_epoch ()).count ();
+}
+
+void SystemClock::sleep (unsigned int usec)
+{
+	Trace::Span span ("sleep", "sleep");
+	span.arg ("usec", usec);
+	usleep (usec);
+}
+
+VirtualClock::VirtualClock ():
+	_now (0)
+{
+}
+
+uint64_t VirtualClock::now ()
+{
+	return _now;
+}
+
+void VirtualClock::sleep (unsigned int usec)
+{
+	_now += usec;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <cstdint>
+
+/*
+ * Time source for every delay in the tool. Times are in microseconds
+ * from an arbitrary origin.
+ */
+class Clock
+{
+public:
+	virtual ~Clock ();
+
+	virtual uint64_t now () = 0;
+	virtual void sleep (unsigned int usec) = 0;
+
+	static Clock &system ();
+};
+
+class SystemClock: public Clock
+{
+public:
+	virtual uint64_t now ();
+	virtual void sleep (unsigned int usec);
+};
+
+/*
+ * Simulated time: sleeping only moves the clock forward.
+ */
+class VirtualClock: public Clock
+{
+public:
+	VirtualClock ();
+
+	virtual uint64_t now ();
+	virtual void sleep (unsigned int usec);
+
+private:
+	uint64_t _now;
+};
+
+#endif
@@ -0,0 +1,1015 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Commands.h"
+
+#include "Animation.h"
+#include "CompiledProfile.h"
+#include "FlatProfile.h"
+#include "FrameIngest.h"
+#include "JsonMacros.h"
+#include "K40Device.h"
+#include "K90Device.h"
+#include "KeyUsage.h"
+#include "MacroLedger.h"
+#include "MacroOptimizer.h"
+#include "Trace.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <thread>
+
+#include <json/json.h>
+
+std::string layout;
+
+static const struct {
+	const char *name;
+	bool (*handler) (CommandContext &ctx, const char * const *args);
+} command_table[] = {
+	{ "mode", commandMode },
+	{ "animation", commandAnimation },
+	{ "animate", commandAnimate },
+	{ "ingest", commandIngest },
+	{ "backlight", commandBacklight },
+	{ "current-profile", commandCurrentProfile },
+	{ "profile-color", commandProfileColor },
+	{ "send-macros", commandSendMacros },
+	{ "status", commandStatus },
+	{ "raw-status", commandRawStatus },
+	{ "batch", commandBatch },
+};
+
+bool isDeviceCommand (const std::string &command)
+{
+	for (const auto &entry: command_table) {
+		if (command == entry.name)
+			return true;
+	}
+	return false;
+}
+
+// Deadline of the transfers made by one command
+struct CommandDeadline
+{
+	CommandDeadline (CorsairDevice *device):
+		_device (device)
+	{
+		_device->startDeadline ();
+	}
+
+	~CommandDeadline ()
+	{
+		_device->clearDeadline ();
+	}
+
+	CorsairDevice *_device;
+};
+
+static bool runSingleCommand (CommandContext &ctx, const char * const *args)
+{
+	if (!args[0]) {
+		fprintf (ctx.err, "Missing command.\n");
+		return false;
+	}
+	for (const auto &entry: command_table) {
+		if (strcmp (args[0], entry.name) != 0)
+			continue;
+		Trace::Span span (entry.name, "command");
+		CommandDeadline deadline (ctx.device);
+		try {
+			return entry.handler (ctx, &args[1]);
+		}
+		catch (std::exception &e) {
+			fprintf (ctx.err, "%s\n", e.what ());
+			return false;
+		}
+	}
+	fprintf (ctx.err, "Unknown command: %s\n", args[0]);
+	return false;
+}
+
+static bool runCommandChain (CommandContext &ctx, const char * const *args)
+{
+	std::vector<std::vector<const char *>> chain (1);
+	for (const char * const *arg = args; *arg; ++arg) {
+		if (strcmp (*arg, CommandSeparator) == 0)
+			chain.emplace_back ();
+		else
+			chain.back ().push_back (*arg);
+	}
+	if (chain.size () == 1)
+		return runSingleCommand (ctx, args);
+
+	bool ok = true;
+	for (unsigned int i = 0; i < chain.size (); ++i) {
+		chain[i].push_back (nullptr);
+		bool command_ok = runSingleCommand (ctx, chain[i].data ());
+		fprintf (ctx.err, "%u: %s: %s\n", i+1,
+			 chain[i][0] ? chain[i][0] : "", command_ok ? "ok" : "failed");
+		ok = ok && command_ok;
+	}
+	return ok;
+}
+
+bool runCommand (CommandContext &ctx, const char * const *args)
+{
+	unsigned int saved = ctx.device->savedTransfers ();
+	bool ok = runCommandChain (ctx, args);
+	// Queued writes are not left behind
+	try {
+		CommandDeadline deadline (ctx.device);
+		ctx.device->flush ();
+	}
+	catch (std::exception &e) {
+		fprintf (ctx.err, "%s\n", e.what ());
+		ok = false;
+	}
+	saved = ctx.device->savedTransfers () - saved;
+	if (saved > 0)
+		fprintf (ctx.err, "Write queue: %u transfers saved.\n", saved);
+	return ok;
+}
+
+// Print each line of text to stream, prefixed with label
+static void printPrefixed (FILE *stream, const std::string &label, const char *text, std::size_t size)
+{
+	const char *end = text + size;
+	while (text < end) {
+		const char *eol = static_cast<const char *> (memchr (text, '\n', end - text));
+		std::size_t len = (eol ? eol : end) - text;
+		fprintf (stream, "%s: %.*s\n", label.c_str (), static_cast<int> (len), text);
+		text += len + 1;
+	}
+}
+
+bool runCommandOnDevices (libusb_context *context, const std::vector<CommandTarget> &targets,
+			  const char * const *args, FILE *out, FILE *err)
+{
+	struct Result {
+		char *out_data = nullptr, *err_data = nullptr;
+		std::size_t out_size = 0, err_size = 0;
+		bool ok = false;
+	};
+	std::vector<Result> results (targets.size ());
+	std::vector<std::thread> workers;
+	for (unsigned int i = 0; i < targets.size (); ++i) {
+		workers.emplace_back ([context, &targets, &results, args, i] () {
+			Result &result = results[i];
+			FILE *out = open_memstream (&result.out_data, &result.out_size);
+			FILE *err = open_memstream (&result.err_data, &result.err_size);
+			if (!out || !err) {
+				if (out)
+					fclose (out);
+				if (err)
+					fclose (err);
+				return;
+			}
+			CorsairDevice *cdev = targets[i].device;
+			UsbEventLoop loop (context, cdev->clock ());
+			CommandContext ctx = { cdev, &loop, nullptr, out, err, 0 };
+			result.ok = runCommand (ctx, args);
+			fclose (out);
+			fclose (err);
+		});
+	}
+	bool ok = true;
+	for (unsigned int i = 0; i < targets.size (); ++i) {
+		workers[i].join ();
+		Result &result = results[i];
+		printPrefixed (out, targets[i].label, result.out_data, result.out_size);
+		printPrefixed (err, targets[i].label, result.err_data, result.err_size);
+		if (!result.ok)
+			fprintf (err, "%s: failed\n", targets[i].label.c_str ());
+		free (result.out_data);
+		free (result.err_data);
+		ok = ok && result.ok;
+	}
+	return ok;
+}
+
+bool splitCommandLine (const std::string &line, std::vector<std::string> &words)
+{
+	bool in_word = false;
+	char quote = 0;
+	for (auto it = line.begin (); it != line.end (); ++it) {
+		char c = *it;
+		if (quote) {
+			if (c == quote)
+				quote = 0;
+			else if (c == '\\' && quote == '"' && it+1 != line.end ())
+				words.back ().push_back (*++it);
+			else
+				words.back ().push_back (c);
+			continue;
+		}
+		if (c == ' ' || c == '\t' || c == '\r') {
+			in_word = false;
+			continue;
+		}
+		if (c == '#' && !in_word)
+			break;
+		if (!in_word) {
+			words.emplace_back ();
+			in_word = true;
+		}
+		if (c == '"' || c == '\'')
+			quote = c;
+		else if (c == '\\' && it+1 != line.end ())
+			words.back ().push_back (*++it);
+		else
+			words.back ().push_back (c);
+	}
+	return quote == 0;
+}
+
+const char *animationName (unsigned int mode)
+{
+	switch (mode) {
+	case CorsairDevice::AnimOff:
+		return "Off";
+	case CorsairDevice::AnimPulse:
+		return "Pulse";
+	case CorsairDevice::AnimCycle:
+		return "Cycle";
+	default:
+		return "Unknown";
+	}
+}
+
+bool commandAnimation (CommandContext &ctx, const char * const *args)
+{
+	CorsairDevice *cdev = ctx.device;
+	unsigned int rate = 0;
+	if (!args[0]) {
+		fprintf (ctx.err, "Missing operation.\n");
+		return false;
+	}
+	std::string op = args[0];
+	if (op == "get") {
+		if (!args[1]) {
+			fprintf (ctx.out, "%s\n", animationName (cdev->getAnimationMode ()));
+		}
+		else {
+			std::string op1 = args[1];
+			if (op1 == "rate")
+				{
+					rate = cdev->getAnimationRate();
+					fprintf (ctx.out, "%i\n", rate);
+				}
+			else {
+				fprintf (ctx.err, "Unknown operation: %s.\n", op1.c_str ());
+				return false;
+			}
+		}
+	}
+	else if (op == "set") {
+		if (!args[1]) {
+			fprintf (ctx.err, "Missing animation mode.\n");
+			return false;
+		}
+		if (args[2]) {
+			rate = std::stoul(args[2]);
+			if (rate > 10)
+				{
+				fprintf (ctx.err, "Invalid animation rate. Must be between 1 and 10.\n");
+				return false;	
+				}
+			rate = rate << 8;
+		}
+			
+		std::string mode = args[1];
+		if (mode == "off")
+			cdev->setAnimationMode (CorsairDevice::AnimOff, rate);
+		else if (mode == "pulse")
+			cdev->setAnimationMode (CorsairDevice::AnimPulse, rate);
+		else if (mode == "cycle")
+			cdev->setAnimationMode (CorsairDevice::AnimCycle, rate);
+		else {
+			fprintf (ctx.err, "Unknown mode: %s.\n", mode.c_str ());
+			return false;
+		}
+	}
+	else {
+		fprintf (ctx.err, "Unknown operation: %s.\n", op.c_str ());
+		return false;
+	}
+	return true;
+}
+
+// 24 bits hexadecimal code
+static bool parseColor (const char *text, Color &color)
+{
+	char *end;
+	unsigned long c = strtoul (text, &end, 16);
+	if (*end || end == text || c > 0xFFFFFF)
+		return false;
+	color = {
+		static_cast<uint8_t> ((c >> 16) & 0xFF),
+		static_cast<uint8_t> ((c >> 8) & 0xFF),
+		static_cast<uint8_t> (c & 0xFF)
+	};
+	return true;
+}
+
+// Whether a run of duration seconds (0 until interrupted) is allowed
+static bool checkDuration (CommandContext &ctx, double duration)
+{
+	if (ctx.max_duration > 0 && (duration == 0 || duration > ctx.max_duration)) {
+		fprintf (ctx.err, "Duration must be given and at most %g seconds.\n", ctx.max_duration);
+		return false;
+	}
+	return true;
+}
+
+bool commandAnimate (CommandContext &ctx, const char * const *args)
+{
+	if (!args[0]) {
+		fprintf (ctx.err, "Missing effect.\n");
+		return false;
+	}
+	Animation::Settings settings = {};
+	settings.fps = 30;
+	settings.period = 4;
+	settings.duration = 10;
+	std::string effect = args[0];
+	unsigned int colors;
+	if (effect == "hue") {
+		settings.effect = Animation::HueCycle;
+		colors = 0;
+	}
+	else if (effect == "fade") {
+		settings.effect = Animation::Fade;
+		colors = 2;
+	}
+	else if (effect == "breathe") {
+		settings.effect = Animation::Breathe;
+		colors = 1;
+	}
+	else {
+		fprintf (ctx.err, "Unknown effect: %s.\n", effect.c_str ());
+		return false;
+	}
+	++args;
+
+	// breathe without a color breathes the brightness
+	Color *targets[] = { &settings.from, &settings.to };
+	unsigned int given = 0;
+	for (; args[0] && args[0][0] != '-' && given < colors; ++args, ++given) {
+		if (!parseColor (args[0], *targets[given])) {
+			fprintf (ctx.err, "Invalid color: %s\n", args[0]);
+			return false;
+		}
+	}
+	if (settings.effect == Animation::Breathe && given == 0)
+		settings.brightness = true;
+	else if (given < colors) {
+		fprintf (ctx.err, "Missing color.\n");
+		return false;
+	}
+
+	for (; args[0]; args += 2) {
+		std::string option = args[0];
+		if (option != "--fps" && option != "--period" && option != "--duration" && option != "--profile") {
+			fprintf (ctx.err, "Unknown option: %s\n", args[0]);
+			return false;
+		}
+		if (!args[1]) {
+			fprintf (ctx.err, "Missing value for %s.\n", args[0]);
+			return false;
+		}
+		char *end;
+		double value = strtod (args[1], &end);
+		if (*end || end == args[1] || !(value >= 0)) {
+			fprintf (ctx.err, "Invalid value for %s: %s\n", args[0], args[1]);
+			return false;
+		}
+		if (option == "--fps")
+			settings.fps = value;
+		else if (option == "--period")
+			settings.period = value;
+		else if (option == "--duration")
+			settings.duration = value;
+		else
+			settings.profile_index = value;
+	}
+	if (settings.fps <= 0 || settings.fps > 1000 || settings.period <= 0) {
+		fprintf (ctx.err, "Frame rate and period must be positive.\n");
+		return false;
+	}
+	if (settings.profile_index > 3) {
+		fprintf (ctx.err, "Profile index must be between 0 and 3.\n");
+		return false;
+	}
+	if (!checkDuration (ctx, settings.duration))
+		return false;
+
+	Animation animation (ctx.device, settings);
+	Animation::Stats stats = animation.run ();
+	fprintf (ctx.out, "%u frames: %u written, %u unchanged, %u skipped\n",
+		 stats.frames, stats.writes, stats.unchanged, stats.skipped);
+	return true;
+}
+
+bool commandIngest (CommandContext &ctx, const char * const *args)
+{
+	std::string socket_path = FrameProtocol::defaultSocketPath ();
+	double duration = 0;
+	for (; args[0]; ++args) {
+		if (strcmp (args[0], "--duration") == 0) {
+			char *end;
+			if (!args[1] || !((duration = strtod (args[1], &end)) >= 0) || *end) {
+				fprintf (ctx.err, "Invalid duration.\n");
+				return false;
+			}
+			++args;
+		}
+		else
+			socket_path = args[0];
+	}
+	if (!checkDuration (ctx, duration))
+		return false;
+
+	FrameIngest ingest (ctx.device, socket_path);
+	fprintf (ctx.out, "Listening on %s\n", socket_path.c_str ());
+	fflush (ctx.out);
+	ingest.run (duration, ctx.out);
+	FrameIngest::Stats stats = ingest.stats ();
+	fprintf (ctx.out, "Total: received %llu, applied %llu, dropped %llu, invalid %llu frames\n",
+		 static_cast<unsigned long long> (stats.received),
+		 static_cast<unsigned long long> (stats.applied),
+		 static_cast<unsigned long long> (stats.dropped),
+		 static_cast<unsigned long long> (stats.invalid));
+	return true;
+}
+
+bool commandStatus (CommandContext &ctx, const char * const *args)
+{
+	CorsairDevice *cdev = ctx.device;
+	typedef CorsairDevice::StatusSnapshot Snapshot;
+	bool json = false;
+	if (args[0]) {
+		if (std::string (args[0]) != "json") {
+			fprintf (ctx.err, "Unknown format: %s.\n", args[0]);
+			return false;
+		}
+		json = true;
+	}
+	Snapshot status = cdev->getStatus ();
+	char color[7];
+	snprintf (color, sizeof (color), "%02hhx%02hhx%02hhx",
+		  status.profile_color.r, status.profile_color.g, status.profile_color.b);
+	if (json) {
+		Json::Value root (Json::objectValue);
+		if (status.has (Snapshot::BacklightBrightness))
+			root["backlight"] = status.backlight_brightness;
+		if (status.has (Snapshot::AnimationMode))
+			root["animation"] = animationName (status.animation_mode);
+		if (status.has (Snapshot::AnimationRate))
+			root["animation_rate"] = status.animation_rate;
+		if (status.has (Snapshot::CurrentProfile))
+			root["current_profile"] = status.current_profile;
+		if (status.has (Snapshot::ProfileColor))
+			root["profile_color"] = color;
+		if (status.has (Snapshot::ColorMode))
+			root["color_mode"] = status.color_mode;
+		Json::StreamWriterBuilder builder;
+		builder["indentation"] = "";
+		fprintf (ctx.out, "%s\n", Json::writeString (builder, root).c_str ());
+	}
+	else {
+		if (status.has (Snapshot::BacklightBrightness))
+			fprintf (ctx.out, "Backlight: %u\n", status.backlight_brightness);
+		if (status.has (Snapshot::AnimationMode))
+			fprintf (ctx.out, "Animation: %s\n", animationName (status.animation_mode));
+		if (status.has (Snapshot::AnimationRate))
+			fprintf (ctx.out, "Animation rate: %u\n", status.animation_rate);
+		if (status.has (Snapshot::CurrentProfile))
+			fprintf (ctx.out, "Current profile: %u\n", status.current_profile);
+		if (status.has (Snapshot::ProfileColor))
+			fprintf (ctx.out, "Profile color: %s\n", color);
+		if (status.has (Snapshot::ColorMode))
+			fprintf (ctx.out, "Color mode: %u\n", status.color_mode);
+	}
+	return true;
+}
+
+bool commandMode (CommandContext &ctx, const char * const *args)
+{
+	CorsairDevice *cdev = ctx.device;
+	if (!args[0]) {
+		fprintf (ctx.err, "Missing operation.\n");
+		return false;
+	}
+	std::string op = args[0];
+	if (op == "get") {
+		CorsairDevice::Mode mode = cdev->getMode ();
+		switch (mode) {
+		case CorsairDevice::HardwareMode:
+			fprintf (ctx.out, "HW\n");
+			break;
+
+		case CorsairDevice::SoftwareMode:
+			fprintf (ctx.out, "SW\n");
+			break;
+
+		case CorsairDevice::FirmwareUpdateMode:
+			fprintf (ctx.out, "FW\n");
+			break;
+
+		default:
+			fprintf (ctx.out, "Unknown\n");
+		}
+	}
+	else if (op == "set") {
+		if (!args[1]) {
+			fprintf (ctx.err, "Missing mode.\n");
+			return false;
+		}
+		std::string mode = args[1];
+		if (mode == "HW")
+			cdev->setMode (CorsairDevice::HardwareMode);
+		else if (mode == "SW")
+			cdev->setMode (CorsairDevice::SoftwareMode);
+		else {
+			fprintf (ctx.err, "Unknown mode: %s.\n", mode.c_str ());
+			return false;
+		}
+	}
+	else {
+		fprintf (ctx.err, "Unknown operation: %s.\n", op.c_str ());
+		return false;
+	}
+	return true;
+}
+
+bool commandBacklight (CommandContext &ctx, const char * const *args)
+{
+	CorsairDevice *cdev = ctx.device;
+	if (!args[0]) {
+		fprintf (ctx.err, "Missing operation.\n");
+		return false;
+	}
+	std::string op = args[0];
+	if (op == "get") {
+		fprintf (ctx.out, "%d\n", cdev->getBacklightBrightness ());
+	}
+	else if (op == "set") {
+		if (!args[1]) {
+			fprintf (ctx.err, "Missing backlight brightness.\n");
+			return false;
+		}
+		unsigned int brightness = std::stoul (args[1]);
+		cdev->setBacklightBrightness (brightness);
+	}
+	else {
+		fprintf (ctx.err, "Unknown operation: %s.\n", op.c_str ());
+		return false;
+	}
+	return true;
+}
+
+bool commandCurrentProfile (CommandContext &ctx, const char * const *args)
+{
+	CorsairDevice *cdev = ctx.device;
+	if (!args[0]) {
+		fprintf (ctx.err, "Missing operation.\n");
+		return false;
+	}
+	std::string op = args[0];
+	if (op == "get") {
+		fprintf (ctx.out, "%d\n", cdev->getCurrentProfile ());
+	}
+	else if (op == "set") {
+		if (!args[1]) {
+			fprintf (ctx.err, "Missing profile index.\n");
+			return false;
+		}
+		unsigned int profile_index = std::stoul (args[1]);
+		cdev->setCurrentProfile (profile_index);
+	}
+	else {
+		fprintf (ctx.err, "Unknown operation: %s.\n", op.c_str ());
+		return false;
+	}
+	return true;
+}
+
+// Read the color of any profile, switching to it only if the shadow
+// state does not know it
+static Color readProfileColor (CommandContext &ctx, unsigned int profile_index)
+{
+	CorsairDevice *cdev = ctx.device;
+	Color color;
+	if (cdev->cachedProfileColor (profile_index, color))
+		return color;
+	unsigned int profile_current = cdev->getCurrentProfile ();
+	if (profile_index == profile_current) {
+		CorsairDevice::StatusSnapshot snapshot = cdev->getStatus ();
+		if (!snapshot.has (CorsairDevice::StatusSnapshot::ProfileColor))
+			throw CorsairDevice::FeatureNotSupported ();
+		return snapshot.profile_color;
+	}
+
+	// Switch to the profile only for the time of reading its color
+	cdev->clock ().sleep (50000);
+	auto seq = CommandSequence::create (*ctx.loop);
+	cdev->setCurrentProfile (*seq, profile_index);
+	seq->sleep (50000);
+	cdev->getRawStatus (*seq, [cdev, &color] (std::vector<uint8_t> &status) {
+		CorsairDevice::StatusSnapshot snapshot = cdev->decodeStatus (status);
+		if (!snapshot.has (CorsairDevice::StatusSnapshot::ProfileColor))
+			throw CorsairDevice::FeatureNotSupported ();
+		color = snapshot.profile_color;
+	});
+	seq->sleep (50000);
+	cdev->setCurrentProfile (*seq, profile_current);
+	seq->run ();
+	cdev->recordProfileColor (profile_index, color);
+	return color;
+}
+
+bool commandProfileColor (CommandContext &ctx, const char * const *args)
+{
+	CorsairDevice *cdev = ctx.device;
+	unsigned int profile_index;
+	if (!args[0]) {
+		fprintf (ctx.err, "Missing operation.\n");
+		return false;
+	}
+	std::string op = args[0];
+	if (op == "get" && args[1] && std::string (args[1]) == "all") {
+		for (unsigned int i = 1; i <= 3; ++i) {
+			Color color = readProfileColor (ctx, i);
+			fprintf (ctx.out, "%u: %02hhx%02hhx%02hhx\n", i, color.r, color.g, color.b);
+		}
+		return true;
+	}
+	if (!args[1]) {
+		//fprintf (stderr, "Missing profile index.\n");
+		//return false;
+		profile_index = cdev->getCurrentProfile ();
+	}
+	else
+		profile_index = std::stoul (args[1]);
+	if (op == "get") {
+		Color color = readProfileColor (ctx, profile_index);
+		fprintf (ctx.out, "%02hhx%02hhx%02hhx\n",color.r, color.g, color.b);
+	}
+	else if (op == "set") {
+		if (!args[2]) {
+			fprintf (ctx.err, "Missing color.\n");
+			return false;
+		}
+		unsigned int c = std::stoul (args[2], nullptr, 16);
+		Color color = {
+			static_cast<uint8_t> ((c >> 16) & 0xFF),
+			static_cast<uint8_t> ((c >> 8) & 0xFF),
+			static_cast<uint8_t> (c & 0xFF)
+		};
+//		std::cout << "RGB Values:\n";
+//		printf("%02hhX %02hhX %02hhX\n",color.r, color.g, color.b);
+		cdev->setProfileColor (profile_index, color);
+	}
+	else {
+		fprintf (ctx.err, "Unknown operation: %s._n", op.c_str ());
+		return false;
+	}
+	return true;
+}
+
+// Read a JSON profile from filename, or from in if it is null
+static bool readProfile (const char *filename, std::istream *in,
+			 FlatProfile &profile, FILE *err)
+{
+	std::string text, syntax_error;
+	if (!filename && !in) {
+		fprintf (err, "Missing file.\n");
+		return false;
+	}
+	{
+		Trace::Span span ("read profile", "io");
+		if (filename) {
+			std::ifstream file (filename, std::ifstream::in);
+			text.assign (std::istreambuf_iterator<char> (file), std::istreambuf_iterator<char> ());
+		}
+		else
+			text.assign (std::istreambuf_iterator<char> (*in), std::istreambuf_iterator<char> ());
+		span.arg ("bytes", text.size ());
+	}
+
+	Trace::Span span ("parse", "profile");
+	if (!ParseJsonMacros (text.data (), text.size (), profile, layout, syntax_error)) {
+		if (!syntax_error.empty ())
+			fprintf (err, "Error while parsing JSON:\n"
+			              "%s",
+			         syntax_error.c_str ());
+		else
+			fprintf (err, "Invalid profile structure\n");
+		return false;
+	}
+	return true;
+}
+
+// Macro optimizer options, shared by send-macros and compile
+struct OptimizeOptions {
+	bool enabled = false;
+	double delay_scale = 1.0;
+	unsigned int min_delay = 0;
+};
+
+// Returns 1 if args[0] is an optimizer option, moving args to its value,
+// 0 if it is not, -1 if its value is missing or invalid.
+static int parseOptimizeOption (const char * const *&args, OptimizeOptions &options, FILE *err)
+{
+	std::string option = args[0];
+	if (option == "--optimize") {
+		options.enabled = true;
+		return 1;
+	}
+	if (option != "--scale" && option != "--min-delay")
+		return 0;
+	if (!args[1]) {
+		fprintf (err, "Missing value for %s.\n", args[0]);
+		return -1;
+	}
+	char *end;
+	if (option == "--scale") {
+		options.delay_scale = strtod (args[1], &end);
+		if (*end || !(options.delay_scale >= 0)) {
+			fprintf (err, "Invalid delay scale: %s\n", args[1]);
+			return -1;
+		}
+	}
+	else {
+		options.min_delay = strtoul (args[1], &end, 10);
+		if (*end) {
+			fprintf (err, "Invalid minimum delay: %s\n", args[1]);
+			return -1;
+		}
+	}
+	options.enabled = true;
+	++args;
+	return 1;
+}
+
+// Print what the optimizer saved on each key that changed, and in total
+static void optimizeKeys (FlatProfile &profile, const OptimizeOptions &options, FILE *out)
+{
+	const KeyUsage::Layout *keymap = KeyUsage::findLayout (layout);
+	if (!keymap)
+		keymap = &KeyUsage::base;
+	MacroOptimizer optimizer (options.delay_scale, options.min_delay);
+	std::vector<MacroOptimizer::Savings> key_savings;
+	{
+		Trace::Span span ("optimize", "profile");
+		optimizer.optimize (profile, key_savings);
+	}
+	MacroOptimizer::Savings total = {};
+	for (std::size_t i = 0; i < profile.size (); ++i) {
+		const MacroOptimizer::Savings &savings = key_savings[i];
+		total.bytes_before += savings.bytes_before;
+		total.bytes_after += savings.bytes_after;
+		total.time_before += savings.time_before;
+		total.time_after += savings.time_after;
+		if (savings.bytes_before == savings.bytes_after &&
+		    savings.time_before == savings.time_after)
+			continue;
+		const char *name = keymap->keyName (profile.key_usages[i]);
+		fprintf (out, "%s: %zu -> %zu bytes, %llu -> %llu ms\n",
+			 name ? name : "?",
+			 savings.bytes_before, savings.bytes_after,
+			 static_cast<unsigned long long> (savings.time_before),
+			 static_cast<unsigned long long> (savings.time_after));
+	}
+	fprintf (out, "Optimized macros: %zu -> %zu bytes, %llu -> %llu ms\n",
+		 total.bytes_before, total.bytes_after,
+		 static_cast<unsigned long long> (total.time_before),
+		 static_cast<unsigned long long> (total.time_after));
+}
+
+bool compileProfile (const std::string &model, const char * const *args,
+		     std::istream *in, FILE *out, FILE *err)
+{
+	OptimizeOptions optimize;
+	for (; args[0] && args[0][0] == '-'; ++args) {
+		int ret = parseOptimizeOption (args, optimize, err);
+		if (ret < 0)
+			return false;
+		if (ret == 0) {
+			fprintf (err, "Unknown option: %s\n", args[0]);
+			return false;
+		}
+	}
+	if (!args[0]) {
+		fprintf (err, "Missing output file.\n");
+		return false;
+	}
+	FlatProfile profile;
+	if (!readProfile (args[1], in, profile, err))
+		return false;
+	if (optimize.enabled)
+		optimizeKeys (profile, optimize, out);
+	try {
+		CorsairDevice::MacroImage image;
+		{
+			Trace::Span span ("encode", "profile");
+			image = CorsairDevice::encodeKeys (profile);
+		}
+		CorsairDevice::checkCapacity (model == K40Device::ModelName ? K40Device::Capacity : K90Device::Capacity,
+					      model.c_str (), image.view ());
+		Trace::Span span ("write", "io");
+		CompiledProfile::write (args[0], model, image.view ());
+	}
+	catch (std::exception &e) {
+		fprintf (err, "%s\n", e.what ());
+		return false;
+	}
+	return true;
+}
+
+bool commandSendMacros (CommandContext &ctx, const char * const *args)
+{
+	CorsairDevice *cdev = ctx.device;
+	bool patch = false, force = false;
+	OptimizeOptions optimize;
+	for (; args[0] && args[0][0] == '-'; ++args) {
+		int ret = parseOptimizeOption (args, optimize, ctx.err);
+		if (ret < 0)
+			return false;
+		if (ret > 0)
+			continue;
+		if (strcmp (args[0], "--patch") == 0)
+			patch = true;
+		else if (strcmp (args[0], "--force") == 0)
+			force = true;
+		else {
+			fprintf (ctx.err, "Unknown option: %s\n", args[0]);
+			return false;
+		}
+	}
+	if (!args[0]) {
+		fprintf (ctx.err, "Missing profile index.\n");
+		return false;
+	}
+	unsigned int profile_index = std::stoul (args[0]);
+
+	// A compiled profile is sent as it is mapped, unless it is patched
+	// or optimized
+	FlatProfile profile;
+	std::unique_ptr<CompiledProfile> compiled;
+	if (args[1] && CompiledProfile::isCompiled (args[1])) {
+		compiled.reset (new CompiledProfile (args[1]));
+		if (compiled->model () != cdev->modelName ()) {
+			fprintf (ctx.err, "Profile compiled for %s, not %s.\n",
+				 compiled->model ().c_str (), cdev->modelName ());
+			return false;
+		}
+		if (patch || optimize.enabled)
+			profile = FlatProfile (CorsairDevice::decodeKeys (compiled->image ()));
+	}
+	else if (!readProfile (args[1], ctx.in, profile, ctx.err))
+		return false;
+	if (optimize.enabled)
+		optimizeKeys (profile, optimize, ctx.out);
+
+	// Without an identity, nothing is known about what the device holds
+	MacroLedger ledger;
+	MacroLedger::Entry previous;
+	bool known;
+	{
+		Trace::Span span ("ledger", "io");
+		known = !cdev->identity ().empty () &&
+			ledger.load (cdev->identity (), profile_index, previous);
+	}
+
+	if (patch) {
+		if (!known) {
+			fprintf (ctx.err, "No previous upload to patch, send the whole profile first.\n");
+			return false;
+		}
+		// Replace the settings of the keys present in the new profile
+		// and keep the others.
+		std::vector<CorsairDevice::KeySettings> merged = CorsairDevice::decodeKeys (previous.image.view ());
+		for (const auto &key: profile.keySettings ()) {
+			auto it = std::find_if (merged.begin (), merged.end (),
+				[&key] (const CorsairDevice::KeySettings &k) { return k.key_usage == key.key_usage; });
+			if (it != merged.end ())
+				*it = key;
+			else
+				merged.push_back (key);
+		}
+		profile = FlatProfile (merged);
+	}
+
+	CorsairDevice::MacroImage encoded;
+	CorsairDevice::MacroImageView image;
+	if (compiled && !patch && !optimize.enabled)
+		image = compiled->image ();
+	else {
+		Trace::Span span ("encode", "profile");
+		encoded = CorsairDevice::encodeKeys (profile);
+		image = encoded.view ();
+	}
+	if (known && !force && previous.hash == image.hash () && previous.image.view () == image) {
+		fprintf (ctx.out, "Profile %u is up to date.\n", profile_index);
+		return true;
+	}
+
+	if (cdev->identity ().empty ()) {
+		cdev->sendKeys (profile_index, image);
+		return true;
+	}
+	// What the profile holds is unknown until the upload completes
+	ledger.forget (cdev->identity (), profile_index);
+	cdev->sendKeys (profile_index, image);
+	try {
+		ledger.store (cdev->identity (), profile_index, image);
+	}
+	catch (std::exception &e) {
+		fprintf (ctx.err, "warning: cannot update the upload ledger: %s\n", e.what ());
+	}
+	return true;
+}
+
+
+bool commandRawStatus (CommandContext &ctx, const char * const *)
+{
+	std::vector<uint8_t> status = ctx.device->getRawStatus ();
+	fprintf (ctx.out, "Status:");
+	for (uint8_t byte: status)
+		fprintf (ctx.out, " %02hhx", byte);
+	fprintf (ctx.out, "\n");
+	return true;
+}
+
+bool commandBatch (CommandContext &ctx, const char * const *args)
+{
+	std::ifstream file;
+	std::istream *script;
+	CommandContext line_ctx = ctx;
+	if (args[0]) {
+		file.open (args[0], std::ifstream::in);
+		if (!file) {
+			fprintf (ctx.err, "Cannot open %s.\n", args[0]);
+			return false;
+		}
+		script = &file;
+	}
+	else {
+		if (!ctx.in) {
+			fprintf (ctx.err, "Missing file.\n");
+			return false;
+		}
+		script = ctx.in;
+		// The input is the script, commands cannot read from it
+		line_ctx.in = nullptr;
+	}
+
+	bool ok = true;
+	unsigned int line_number = 0;
+	std::string line;
+	while (std::getline (*script, line)) {
+		++line_number;
+		std::vector<std::string> words;
+		if (!splitCommandLine (line, words)) {
+			fprintf (ctx.err, "line %u: unterminated quote\n", line_number);
+			ok = false;
+			continue;
+		}
+		if (words.empty ())
+			continue;
+		std::vector<const char *> line_args;
+		for (const auto &word: words)
+			line_args.push_back (word.c_str ());
+		line_args.push_back (nullptr);
+		if (words[0] == "batch") {
+			fprintf (ctx.err, "line %u: batch cannot be nested\n", line_number);
+			ok = false;
+			continue;
+		}
+		bool line_ok = runCommandChain (line_ctx, line_args.data ());
+		fprintf (ctx.err, "line %u: %s\n", line_number, line_ok ? "ok" : "failed");
+		ok = ok && line_ok;
+	}
+	return ok;
+}
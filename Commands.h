@@ -0,0 +1,114 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include "CorsairDevice.h"
+#include "UsbEventLoop.h"
+
+#include <cstdio>
+#include <istream>
+#include <string>
+#include <vector>
+
+/*
+ * Everything a device command needs: the device, the event loop for
+ * its asynchronous sequences and the streams it reads and writes. in
+ * may be null when there is no input to read from. max_duration bounds
+ * the commands running until interrupted (animate, ingest) in seconds,
+ * 0 lets them run forever.
+ */
+struct CommandContext
+{
+	CorsairDevice *device;
+	UsbEventLoop *loop;
+	std::istream *in;
+	FILE *out, *err;
+	double max_duration;
+};
+
+// Layout used for converting key names (-l option)
+extern std::string layout;
+
+const char *animationName (unsigned int mode);
+
+/*
+ * Run a device command. args starts with the command name and ends
+ * with a null pointer. Errors, including exceptions thrown by the
+ * device, are reported to ctx.err and make the command fail.
+ *
+ * Several commands can be chained with CommandSeparator arguments, they
+ * are run in order and their status is reported to ctx.err. Writes
+ * still queued on the device are flushed at the end, and the transfers
+ * the queue saved are reported to ctx.err.
+ */
+bool runCommand (CommandContext &ctx, const char * const *args);
+
+/*
+ * A device a command is fanned out to. Its output lines are prefixed
+ * with label.
+ */
+struct CommandTarget
+{
+	std::string label;
+	CorsairDevice *device;
+};
+
+/*
+ * Run the same command on every target concurrently, each device in its
+ * own thread with its own event loop. The output of every device is
+ * gathered and printed once all of them are done, in the order of
+ * targets. The commands have no input stream. Fails if any device fails.
+ */
+bool runCommandOnDevices (libusb_context *context, const std::vector<CommandTarget> &targets,
+			  const char * const *args, FILE *out, FILE *err);
+
+bool isDeviceCommand (const std::string &command);
+
+/*
+ * Compile a JSON profile for model without a device. args are the
+ * optimizer options, the output file and the optional profile file, the
+ * profile is read from in if it is missing. The optimizer report is
+ * printed on out.
+ */
+bool compileProfile (const std::string &model, const char * const *args,
+		     std::istream *in, FILE *out, FILE *err);
+
+constexpr const char *CommandSeparator = ",";
+
+/*
+ * Split a batch line into words. Words are separated by blanks and may
+ * be quoted with ' or ", \ escapes the next character and # starts a
+ * comment. Returns false if a quote is not closed.
+ */
+bool splitCommandLine (const std::string &line, std::vector<std::string> &words);
+
+bool commandMode (CommandContext &ctx, const char * const *args);
+bool commandBacklight (CommandContext &ctx, const char * const *args);
+bool commandCurrentProfile (CommandContext &ctx, const char * const *args);
+bool commandProfileColor (CommandContext &ctx, const char * const *args);
+bool commandSendMacros (CommandContext &ctx, const char * const *args);
+bool commandAnimation (CommandContext &ctx, const char * const *args);
+bool commandAnimate (CommandContext &ctx, const char * const *args);
+bool commandIngest (CommandContext &ctx, const char * const *args);
+bool commandStatus (CommandContext &ctx, const char * const *args);
+bool commandRawStatus (CommandContext &ctx, const char * const *args);
+bool commandBatch (CommandContext &ctx, const char * const *args);
+
+#endif
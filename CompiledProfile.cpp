@@ -0,0 +1,137 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "CompiledProfile.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+static constexpr char Magic[4] = { 'C', 'U', 'P', 'F' };
+static constexpr uint16_t Version = 1;
+
+CompiledProfile::CompiledProfile (const std::string &filename):
+	_map (MAP_FAILED),
+	_size (0)
+{
+	int fd = open (filename.c_str (), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		throw std::system_error (errno, std::system_category (), filename);
+	struct stat st;
+	if (fstat (fd, &st) == -1) {
+		int error = errno;
+		close (fd);
+		throw std::system_error (error, std::system_category (), filename);
+	}
+	_size = st.st_size;
+	if (_size >= sizeof (Header))
+		_map = mmap (nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (_map == MAP_FAILED)
+		throw std::runtime_error ("Invalid compiled profile: " + filename);
+
+	Header header;
+	memcpy (&header, _map, sizeof (header));
+	const uint8_t *blobs = static_cast<const uint8_t *> (_map) + sizeof (header);
+	_image = {
+		{ blobs, header.bindings_size },
+		{ blobs + header.bindings_size, header.data_size },
+		{ blobs + header.bindings_size + header.data_size, header.keys_size }
+	};
+	if (memcmp (header.magic, Magic, sizeof (Magic)) != 0 ||
+	    header.version != Version ||
+	    _size != sizeof (header) + header.bindings_size + header.data_size + header.keys_size ||
+	    header.checksum != _image.hash ()) {
+		munmap (_map, _size);
+		throw std::runtime_error ("Invalid compiled profile: " + filename);
+	}
+	_model.assign (header.model, strnlen (header.model, sizeof (header.model)));
+}
+
+CompiledProfile::~CompiledProfile ()
+{
+	munmap (_map, _size);
+}
+
+bool CompiledProfile::isCompiled (const std::string &filename)
+{
+	int fd = open (filename.c_str (), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+	char magic[sizeof (Magic)];
+	bool compiled = read (fd, magic, sizeof (magic)) == sizeof (magic) &&
+			memcmp (magic, Magic, sizeof (Magic)) == 0;
+	close (fd);
+	return compiled;
+}
+
+void CompiledProfile::write (const std::string &filename, const std::string &model,
+			     const CorsairDevice::MacroImageView &image)
+{
+	Header header = {};
+	memcpy (header.magic, Magic, sizeof (Magic));
+	header.version = Version;
+	if (model.size () > sizeof (header.model))
+		throw std::runtime_error ("Model name too long.");
+	memcpy (header.model, model.data (), model.size ());
+	header.checksum = image.hash ();
+	header.bindings_size = image.bindings.size;
+	header.data_size = image.data.size;
+	header.keys_size = image.keys.size;
+
+	std::vector<uint8_t> content (sizeof (header));
+	memcpy (content.data (), &header, sizeof (header));
+	for (const auto *blob: { &image.bindings, &image.data, &image.keys })
+		content.insert (content.end (), blob->data, blob->data + blob->size);
+
+	int fd = open (filename.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd == -1)
+		throw std::system_error (errno, std::system_category (), filename);
+	std::size_t written = 0;
+	while (written < content.size ()) {
+		ssize_t ret = ::write (fd, content.data () + written, content.size () - written);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			int error = errno;
+			close (fd);
+			throw std::system_error (error, std::system_category (), filename);
+		}
+		written += ret;
+	}
+	close (fd);
+}
+
+const std::string &CompiledProfile::model () const
+{
+	return _model;
+}
+
+const CorsairDevice::MacroImageView &CompiledProfile::image () const
+{
+	return _image;
+}
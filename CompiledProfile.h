@@ -0,0 +1,68 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef COMPILED_PROFILE_H
+#define COMPILED_PROFILE_H
+
+#include "CorsairDevice.h"
+
+#include <string>
+
+/*
+ * Profile compiled ahead of time to the blobs sent by setKeys. The file
+ * is a header followed by the bindings, data and keys blobs, and is
+ * mapped so that the blobs are sent without being copied or parsed.
+ */
+class CompiledProfile
+{
+public:
+	struct Header {
+		char magic[4];		// "CUPF"
+		uint16_t version;
+		char model[6];		// device model name, NUL padded
+		uint64_t checksum;	// MacroImageView::hash of the blobs
+		uint16_t bindings_size;
+		uint16_t data_size;
+		uint16_t keys_size;
+	} __attribute__ ((packed));
+
+	// Throws std::runtime_error if filename is not a valid compiled profile
+	CompiledProfile (const std::string &filename);
+	~CompiledProfile ();
+
+	CompiledProfile (const CompiledProfile &) = delete;
+	CompiledProfile &operator= (const CompiledProfile &) = delete;
+
+	// Check the magic number only
+	static bool isCompiled (const std::string &filename);
+	// Throws std::runtime_error if the file cannot be written
+	static void write (const std::string &filename, const std::string &model,
+			   const CorsairDevice::MacroImageView &image);
+
+	const std::string &model () const;
+	const CorsairDevice::MacroImageView &image () const;
+
+private:
+	void *_map;
+	std::size_t _size;
+	std::string _model;
+	CorsairDevice::MacroImageView _image;
+};
+
+#endif
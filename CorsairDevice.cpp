@@ -18,44 +18,76 @@
 
 #include "CorsairDevice.h"
 
+#include "FlatProfile.h"
+#include "MacroFormat.h"
+#include "Trace.h"
+#include "UsbEventLoop.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
 #include <string>
 #include <tuple>
 
-extern "C" {
-#include <unistd.h>
-}
-
 CorsairDevice::FeatureNotSupported::FeatureNotSupported ()
 {
 }
 
-const char *CorsairDevice::FeatureNotSupported::what () noexcept
+const char *CorsairDevice::FeatureNotSupported::what () const noexcept
 {
 	return "Feature not supported.";
 }
 
-constexpr unsigned int Delay = 200000;
+// Polling of the device state after a macro packet
+constexpr unsigned int PollInterval = 1000;
+constexpr unsigned int MaxPollInterval = 32000;
+// A rejected packet is sent again at a slower pace this many times
+constexpr unsigned int MaxAttempts = 4;
+// Longest time the firmware may stay busy per byte of a macro packet,
+// on top of the maximum gap
+constexpr unsigned int MaxBusyPerByte = 100;
 
-CorsairDevice::CorsairDevice (libusb_device *dev, std::size_t status_size):
-	_status_size (status_size)
+CorsairDevice::CorsairDevice (UsbTransport *transport, std::size_t status_size, Pacing &pacing):
+	_transport (transport),
+	_status_size (status_size),
+	_pacing (pacing),
+	_shadow_holds (0),
+	_shadow_changed (false),
+	_queue ()
 {
-	int err;
-	if (0 != (err = libusb_open (dev, &_dev))) {
-		throw std::runtime_error (libusb_error_name (err));
-	}
 }
 
 CorsairDevice::~CorsairDevice ()
 {
-	libusb_close (_dev);
+}
+
+Clock &CorsairDevice::clock ()
+{
+	return _transport->clock ();
+}
+
+const std::string &CorsairDevice::identity () const
+{
+	return _identity;
+}
+
+void CorsairDevice::setIdentity (const std::string &identity)
+{
+	_identity = identity;
+	if (!identity.empty ()) {
+		std::string name = identity;
+		std::replace (name.begin (), name.end (), '/', '_');
+		_shadow.attach (DeviceShadow::defaultDirectory () + "/" + name + ".state");
+	}
 }
 
 CorsairDevice::Mode CorsairDevice::getMode ()
 {
+	flush ();
 	int ret;
 	uint8_t data[2];
-	ret = libusb_control_transfer (_dev, RequestInType, GetMode,
-				       0, 0, data, sizeof (data), 0);
+	ret = _transport->controlTransfer (RequestInType, GetMode,
+					   0, 0, data, sizeof (data), 0);
 	if (ret < 0) {
 		throw std::runtime_error (libusb_error_name (ret));
 	}
@@ -64,150 +96,861 @@ CorsairDevice::Mode CorsairDevice::getMode ()
 
 void CorsairDevice::setMode (Mode mode)
 {
+	flush ();
 	int ret;
-	ret = libusb_control_transfer (_dev, RequestOutType, SetMode,
-				       mode, 0, nullptr, 0, 0);
+	ret = _transport->controlTransfer (RequestOutType, SetMode,
+					   mode, 0, nullptr, 0, 0);
 	if (ret < 0) {
 		throw std::runtime_error (libusb_error_name (ret));
 	}
 }
 
+void CorsairDevice::setBacklightBrightness (unsigned int brightness)
+{
+	if (brightness > 3)
+		brightness = 3;
+	if (queueWrite (BrightnessRegister))
+		_queue.brightness = brightness;
+	else
+		applyBacklightBrightness (brightness);
+}
+
+void CorsairDevice::applyBacklightBrightness (unsigned int brightness)
+{
+	writeBacklightBrightness (brightness);
+
+	StatusSnapshot snapshot = {};
+	snapshot.fields = StatusSnapshot::BacklightBrightness;
+	snapshot.backlight_brightness = brightness;
+	updateShadow (snapshot);
+}
+
+void CorsairDevice::setAnimationMode (unsigned int mode, unsigned int rate)
+{
+	bool pending = _queue.writes[AnimationRegister] > 0;
+	if (queueWrite (AnimationRegister)) {
+		// A 0 rate keeps the queued one
+		if (rate || !pending)
+			_queue.animation_rate = rate;
+		_queue.animation_mode = mode;
+	}
+	else
+		applyAnimationMode (mode, rate);
+}
+
+void CorsairDevice::applyAnimationMode (unsigned int mode, unsigned int rate)
+{
+	writeAnimationMode (mode, rate);
+
+	// The rate is sent in the high byte, 0 keeps the current one
+	StatusSnapshot snapshot = {};
+	snapshot.fields = StatusSnapshot::AnimationMode;
+	snapshot.animation_mode = mode;
+	if (rate) {
+		snapshot.fields |= StatusSnapshot::AnimationRate;
+		snapshot.animation_rate = rate >> 8;
+	}
+	updateShadow (snapshot);
+}
+
+void CorsairDevice::setProfileColor (unsigned int profile_index, Color color)
+{
+	if (_queue.window && profile_index > 3) {
+		throw std::invalid_argument ("Invalid profile index.");
+	}
+	// Index 0 is the profile that will be current when it is written
+	if (profile_index == 0 && _queue.writes[ProfileRegister] > 0)
+		profile_index = _queue.current_profile;
+	if (queueWrite (static_cast<Register> (ColorRegister + profile_index)))
+		_queue.colors[profile_index] = color;
+	else
+		applyProfileColor (profile_index, color);
+}
+
+void CorsairDevice::applyProfileColor (unsigned int profile_index, Color color)
+{
+	writeProfileColor (profile_index, color);
+
+	// Index 0 is the current profile, which the profile buttons change
+	// without the host knowing: the color it replaced is not known
+	if (profile_index == 0) {
+		_shadow.state ().colors_known = 0;
+		saveShadow ();
+	}
+	else
+		recordProfileColor (profile_index, color);
+}
+
 void CorsairDevice::setCurrentProfile (unsigned int index)
 {
-	int ret;
 	if (index < 1 || index > 3) {
 		throw std::invalid_argument ("Index must be between 1 and 3.");
 	}
-	ret = libusb_control_transfer (_dev, RequestOutType, SetCurrentProfile,
-				       index, 0, nullptr, 0, 0);
+	// The queued color of the current profile is for the profile
+	// current before this one
+	if (_queue.writes[ColorRegister] > 0)
+		flush ();
+	if (queueWrite (ProfileRegister))
+		_queue.current_profile = index;
+	else
+		applyCurrentProfile (index);
+}
+
+void CorsairDevice::applyCurrentProfile (unsigned int index)
+{
+	int ret;
+	ret = _transport->controlTransfer (RequestOutType, SetCurrentProfile,
+					   index, 0, nullptr, 0, 0);
 	if (ret != 0) {
 		throw std::runtime_error (libusb_error_name (ret));
 	}
+
+	StatusSnapshot snapshot = {};
+	snapshot.fields = StatusSnapshot::CurrentProfile;
+	snapshot.current_profile = index;
+	updateShadow (snapshot);
+}
+
+namespace
+{
+// Counts the transfers of the device, for the write queue savings
+class CountingTransport: public UsbTransport
+{
+public:
+	CountingTransport (UsbTransport *transport, unsigned int &count):
+		_transport (transport),
+		_count (count)
+	{
+	}
+
+	virtual ~CountingTransport ()
+	{
+		delete _transport;
+	}
+
+	virtual int controlTransfer (uint8_t request_type, uint8_t request,
+				     uint16_t value, uint16_t index,
+				     uint8_t *data, uint16_t length,
+				     unsigned int timeout)
+	{
+		++_count;
+		return _transport->controlTransfer (request_type, request, value, index,
+						    data, length, timeout);
+	}
+
+	virtual Clock &clock ()
+	{
+		return _transport->clock ();
+	}
+
+	virtual libusb_device_handle *handle ()
+	{
+		return _transport->handle ();
+	}
+
+	virtual void startDeadline ()
+	{
+		_transport->startDeadline ();
+	}
+
+	virtual void clearDeadline ()
+	{
+		_transport->clearDeadline ();
+	}
+
+	virtual int transferTimeout (unsigned int timeout)
+	{
+		return _transport->transferTimeout (timeout);
+	}
+
+private:
+	UsbTransport *_transport;
+	unsigned int &_count;
+};
 }
 
-template <typename T>
-static void append (std::vector<uint8_t> &vec, T value) {
-	// Push bytes in big endian order
-	for (unsigned int i = 0; i < sizeof (T); ++i)
-		vec.push_back ((value >> 8*(sizeof (T)-1 - i)) & 0xFF);
+void CorsairDevice::setWriteWindow (unsigned int window)
+{
+	flush ();
+	if (window && !_queue.window)
+		_transport.reset (new CountingTransport (_transport.release (), _queue.transfers));
+	_queue.window = window;
 }
 
-void CorsairDevice::setKeys (unsigned int profile_index, const std::vector<KeySettings> &keys)
+// Returns true if the value is to be queued for reg
+bool CorsairDevice::queueWrite (Register reg)
 {
-	int ret;
-	if (profile_index < 1 || profile_index > 3) {
-		throw std::invalid_argument ("Profile index must be between 1 and 3.");
+	if (!_queue.window)
+		return false;
+	bool pending = std::any_of (std::begin (_queue.writes), std::end (_queue.writes),
+				    [] (unsigned int writes) { return writes > 0; });
+	uint64_t now = clock ().now ();
+	if (pending && now - _queue.first >= _queue.window) {
+		flush ();
+		pending = false;
+	}
+	if (!pending)
+		_queue.first = now;
+	++_queue.writes[reg];
+	return true;
+}
+
+void CorsairDevice::flush ()
+{
+	// The profile first, the colors of index 0 depend on it
+	static const Register order[] = {
+		ProfileRegister,
+		AnimationRegister,
+		BrightnessRegister,
+		static_cast<Register> (ColorRegister + 1),
+		static_cast<Register> (ColorRegister + 2),
+		static_cast<Register> (ColorRegister + 3),
+		ColorRegister,
+	};
+	for (Register reg: order) {
+		unsigned int writes = _queue.writes[reg];
+		if (writes == 0)
+			continue;
+		// Not written again if it fails
+		_queue.writes[reg] = 0;
+		unsigned int before = _queue.transfers;
+		switch (reg) {
+		case ProfileRegister:
+			applyCurrentProfile (_queue.current_profile);
+			break;
+		case AnimationRegister:
+			applyAnimationMode (_queue.animation_mode, _queue.animation_rate);
+			break;
+		case BrightnessRegister:
+			applyBacklightBrightness (_queue.brightness);
+			break;
+		default:
+			applyProfileColor (reg - ColorRegister, _queue.colors[reg - ColorRegister]);
+		}
+		_queue.saved += (writes - 1) * (_queue.transfers - before);
+	}
+}
+
+unsigned int CorsairDevice::savedTransfers () const
+{
+	return _queue.saved;
+}
+
+void CorsairDevice::startDeadline ()
+{
+	_transport->startDeadline ();
+}
+
+void CorsairDevice::clearDeadline ()
+{
+	_transport->clearDeadline ();
+}
+
+void CorsairDevice::setCurrentProfile (CommandSequence &seq, unsigned int index)
+{
+	if (index < 1 || index > 3) {
+		throw std::invalid_argument ("Index must be between 1 and 3.");
+	}
+	flush ();
+	seq.control (*_transport, RequestOutType, SetCurrentProfile, index, 0);
+}
+
+bool CorsairDevice::MacroImageView::operator== (const MacroImageView &other) const
+{
+	for (auto pair: { std::make_pair (&bindings, &other.bindings),
+			  std::make_pair (&data, &other.data),
+			  std::make_pair (&keys, &other.keys) }) {
+		if (pair.first->size != pair.second->size ||
+		    memcmp (pair.first->data, pair.second->data, pair.first->size) != 0)
+			return false;
+	}
+	return true;
+}
+
+uint64_t CorsairDevice::MacroImageView::hash () const
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	for (const Blob *blob: { &bindings, &data, &keys }) {
+		uint64_t size = blob->size;
+		for (unsigned int i = 0; i < sizeof (size); ++i)
+			h = (h ^ ((size >> 8*i) & 0xFF)) * 0x100000001b3ull;
+		for (std::size_t i = 0; i < blob->size; ++i)
+			h = (h ^ blob->data[i]) * 0x100000001b3ull;
+	}
+	return h;
+}
+
+CorsairDevice::MacroImageView CorsairDevice::MacroImage::view () const
+{
+	return {
+		{ bindings.data (), bindings.size () },
+		{ data.data (), data.size () },
+		{ keys.data (), keys.size () }
+	};
+}
+
+// What the encoder needs of a key, from either profile representation
+struct KeyView {
+	uint8_t key_usage, repeat_mode, bind_type, target_usage;
+	uint16_t repeat_count;
+	const CorsairDevice::MacroItem *macro_begin, *macro_end;
+
+	const CorsairDevice::MacroItem *begin () const { return macro_begin; }
+	const CorsairDevice::MacroItem *end () const { return macro_end; }
+};
+
+static KeyView keyView (const std::vector<CorsairDevice::KeySettings> &keys, std::size_t i)
+{
+	const CorsairDevice::KeySettings &key = keys[i];
+	return {
+		key.key_usage, key.repeat_mode, key.bind_type, key.target_usage,
+		key.repeat_count, key.macro.data (), key.macro.data () + key.macro.size ()
+	};
+}
+
+static KeyView keyView (const FlatProfile &profile, std::size_t i)
+{
+	return {
+		profile.key_usages[i], profile.repeat_modes[i], profile.bind_types[i],
+		profile.target_usages[i], profile.repeat_counts[i],
+		profile.macroBegin (i), profile.macroEnd (i)
+	};
+}
+
+static std::size_t keyDataSize (const KeyView &key)
+{
+	using namespace MacroFormat;
+	switch (key.bind_type) {
+	case CorsairDevice::KeySettings::BindUsage:
+		return UsageData::size;
+
+	case CorsairDevice::KeySettings::BindMacro: {
+		std::size_t size = ItemType::size + EndItem::size;
+		for (const auto &item: key) {
+			size += ItemType::size;
+			if (item.type == CorsairDevice::MacroItem::Key)
+				size += KeyEventItem::size;
+			else if (item.type == CorsairDevice::MacroItem::Delay)
+				size += DelayItem::size;
+		}
+		return size;
+	}
+
+	default:
+		return 0;
+	}
+}
+
+static void writeKeyData (const KeyView &key, uint8_t *pos)
+{
+	using namespace MacroFormat;
+	switch (key.bind_type) {
+	case CorsairDevice::KeySettings::BindUsage:
+		UsageData::write (pos, key.target_usage);
+		break;
+
+	case CorsairDevice::KeySettings::BindMacro:
+		for (const auto &item: key) {
+			ItemType::write (pos, item.type);
+			switch (item.type) {
+			case CorsairDevice::MacroItem::Key:
+				KeyEventItem::write (pos, item.key_event.usage, item.key_event.pressed ? 0x01 : 0x00);
+				break;
+
+			case CorsairDevice::MacroItem::Delay:
+				DelayItem::write (pos, item.delay);
+				break;
+
+			case CorsairDevice::MacroItem::End:
+				// written after this loop, it should not be in this vector
+				break;
+			}
+		}
+		ItemType::write (pos, CorsairDevice::MacroItem::End);
+		EndItem::write (pos, key.repeat_count);
+		break;
+
+	default:
+		break;
 	}
+}
+
+template <typename Profile>
+static CorsairDevice::MacroImageSize imageSize (const Profile &keys)
+{
+	using namespace MacroFormat;
+	CorsairDevice::MacroImageSize size = {
+		BindingsHeader::size + keys.size () * Binding::size,
+		0,
+		KeysHeader::size + keys.size () * KeyRecord::size,
+	};
+	for (std::size_t i = 0; i < keys.size (); ++i)
+		size.data += keyDataSize (keyView (keys, i));
+	return size;
+}
 
-	std::vector<uint8_t> raw_keys, raw_bindings, raw_data;
+template <typename Profile>
+static CorsairDevice::MacroImageView encodeImage (const Profile &keys,
+						  const CorsairDevice::MacroImageStorage &storage)
+{
+	using namespace MacroFormat;
+	constexpr unsigned int MaxKeySettings = CorsairDevice::MaxKeySettings;
+	constexpr std::size_t MaxMacroData = CorsairDevice::MaxMacroData;
+	if (keys.size () > MaxKeySettings)
+		throw std::runtime_error ("Too many keys in the profile (" +
+					  std::to_string (keys.size ()) + ", at most " +
+					  std::to_string (MaxKeySettings) + ").");
 
-	// Build raw data from key usages and macro items
-	std::vector<unsigned int> addresses;
-	for (const auto &key: keys) {
-		addresses.push_back (raw_data.size ());
+	// Bindings only give an address and a length in the raw data, so a
+	// key whose data is the end of another key's data (the same macro, or
+	// its last items with the same repeat count) points into it instead
+	// of being stored again. Longest data is placed first, each key is
+	// written after the stored data and kept only if it is not shared.
+	std::size_t sizes[MaxKeySettings], addresses[MaxKeySettings];
+	unsigned int order[MaxKeySettings];
+	std::pair<std::size_t, std::size_t> stored[MaxKeySettings]; // address and size
+	unsigned int stored_count = 0;
+	for (unsigned int i = 0; i < keys.size (); ++i) {
+		sizes[i] = keyDataSize (keyView (keys, i));
+		addresses[i] = 0;
+		order[i] = i;
+	}
+	std::stable_sort (order, order + keys.size (), [&sizes] (unsigned int a, unsigned int b) {
+		return sizes[a] > sizes[b];
+	});
+	std::size_t data_size = 0;
+	for (unsigned int k = 0; k < keys.size (); ++k) {
+		unsigned int i = order[k];
+		if (sizes[i] == 0)
+			continue;
+		const uint8_t *data = storage.data + data_size;
+		writeKeyData (keyView (keys, i), storage.data + data_size);
+		auto shared = std::find_if (stored, stored + stored_count,
+			[&storage, data, &sizes, i] (const std::pair<std::size_t, std::size_t> &region) {
+				return region.second >= sizes[i] &&
+				       memcmp (data, storage.data + region.first + region.second - sizes[i], sizes[i]) == 0;
+			});
+		if (shared != stored + stored_count) {
+			addresses[i] = shared->first + shared->second - sizes[i];
+			continue;
+		}
+		addresses[i] = data_size;
+		stored[stored_count++] = std::make_pair (data_size, sizes[i]);
+		data_size += sizes[i];
+	}
+	if (data_size > MaxMacroData)
+		throw std::runtime_error ("Macro data too large (" +
+					  std::to_string (data_size) + " bytes, at most " +
+					  std::to_string (MaxMacroData) + ").");
+
+	// Build key and binding data
+	uint8_t *bindings = storage.bindings, *raw_keys = storage.keys;
+	BindingsHeader::write (bindings, keys.size (),
+			       BindingsHeader::size + keys.size () * Binding::size,
+			       data_size);
+	KeysHeader::write (raw_keys, keys.size ());
+	for (unsigned int i = 0; i < keys.size (); ++i) {
+		KeyView key = keyView (keys, i);
+		KeyRecord::write (raw_keys, key.key_usage, key.repeat_mode);
+		Binding::write (bindings, key.bind_type, addresses[i], sizes[i]);
+	}
+
+	return {
+		{ storage.bindings, static_cast<std::size_t> (bindings - storage.bindings) },
+		{ storage.data, data_size },
+		{ storage.keys, static_cast<std::size_t> (raw_keys - storage.keys) }
+	};
+}
+
+template <typename Profile>
+static CorsairDevice::MacroImage encodeImage (const Profile &keys)
+{
+	CorsairDevice::MacroImageSize size = imageSize (keys);
+	CorsairDevice::MacroImage image;
+	image.bindings.resize (size.bindings);
+	image.data.resize (size.data);
+	image.keys.resize (size.keys);
+	CorsairDevice::MacroImageView view = encodeImage (keys, { image.bindings.data (), image.data.data (), image.keys.data () });
+	image.data.resize (view.data.size);
+	return image;
+}
+
+CorsairDevice::MacroImageSize CorsairDevice::encodedSize (const std::vector<KeySettings> &keys)
+{
+	return imageSize (keys);
+}
+
+CorsairDevice::MacroImageSize CorsairDevice::encodedSize (const FlatProfile &profile)
+{
+	return imageSize (profile);
+}
+
+CorsairDevice::MacroImageView CorsairDevice::encodeKeys (const std::vector<KeySettings> &keys,
+							 const MacroImageStorage &storage)
+{
+	return encodeImage (keys, storage);
+}
+
+CorsairDevice::MacroImageView CorsairDevice::encodeKeys (const FlatProfile &profile,
+							 const MacroImageStorage &storage)
+{
+	return encodeImage (profile, storage);
+}
+
+CorsairDevice::MacroImage CorsairDevice::encodeKeys (const std::vector<KeySettings> &keys)
+{
+	return encodeImage (keys);
+}
+
+CorsairDevice::MacroImage CorsairDevice::encodeKeys (const FlatProfile &profile)
+{
+	return encodeImage (profile);
+}
+
+void CorsairDevice::checkCapacity (const MacroCapacity &capacity, const char *model,
+				   const MacroImageView &image)
+{
+	unsigned int key_count = image.keys.size > 0 ? image.keys.data[0] : 0;
+	if (key_count > capacity.keys)
+		throw std::runtime_error ("The profile has " + std::to_string (key_count) +
+					  " keys, the " + model + " uses at most " +
+					  std::to_string (capacity.keys) + ".");
+	if (image.data.size > capacity.addressable_data)
+		throw std::runtime_error ("The macros need " + std::to_string (image.data.size) +
+					  " bytes, the " + model + " bindings address at most " +
+					  std::to_string (capacity.addressable_data) + ".");
+}
+
+// Read a record at pos in blob and move pos past it
+template <typename Record, typename... Values>
+static void readRecord (const CorsairDevice::MacroImageView::Blob &blob, std::size_t &pos,
+			Values &... values)
+{
+	if (pos + Record::size > blob.size)
+		throw std::runtime_error ("Truncated macro image.");
+	const uint8_t *data = blob.data + pos;
+	Record::read (data, values...);
+	pos += Record::size;
+}
+
+std::vector<CorsairDevice::KeySettings> CorsairDevice::decodeKeys (const MacroImageView &image)
+{
+	using namespace MacroFormat;
+	std::size_t key_pos = 0, binding_pos = 0;
+	uint8_t count, binding_count;
+	uint16_t bindings_size, data_size;
+	readRecord<KeysHeader> (image.keys, key_pos, count);
+	readRecord<BindingsHeader> (image.bindings, binding_pos, binding_count, bindings_size, data_size);
+	if (count != binding_count)
+		throw std::runtime_error ("Inconsistent macro image.");
+
+	std::vector<KeySettings> keys (count);
+	for (KeySettings &key: keys) {
+		uint8_t usage, repeat_mode, bind_type;
+		uint16_t address, length;
+		readRecord<KeyRecord> (image.keys, key_pos, usage, repeat_mode);
+		readRecord<Binding> (image.bindings, binding_pos, bind_type, address, length);
+		key.key_usage = usage;
+		key.repeat_mode = static_cast<KeySettings::RepeatMode> (repeat_mode);
+		key.bind_type = static_cast<KeySettings::BindType> (bind_type);
+		key.target_usage = 0;
+		key.repeat_count = 0;
+		std::size_t data_pos = address, data_end = address + length;
 		switch (key.bind_type) {
 		case KeySettings::BindNone:
 			break;
 
 		case KeySettings::BindUsage:
-			append (raw_data, key.target_usage);
+			readRecord<UsageData> (image.data, data_pos, key.target_usage);
 			break;
 
 		case KeySettings::BindMacro:
-			for (const auto &item: key.macro) {
-				append (raw_data, item.type);
+			// Items are at least as large as the end item
+			key.macro.reserve (length / (ItemType::size + EndItem::size));
+			for (;;) {
+				MacroItem item;
+				uint8_t type;
+				readRecord<ItemType> (image.data, data_pos, type);
+				item.type = static_cast<MacroItem::Type> (type);
+				if (item.type == MacroItem::End)
+					break;
 				switch (item.type) {
-				case MacroItem::Key:
-					append (raw_data, item.key_event.usage);
-					append (raw_data, static_cast<uint8_t> (item.key_event.pressed ? 0x01 : 0x00));
+				case MacroItem::Key: {
+					uint8_t pressed;
+					readRecord<KeyEventItem> (image.data, data_pos, item.key_event.usage, pressed);
+					item.key_event.pressed = pressed != 0;
 					break;
+				}
 
 				case MacroItem::Delay:
-					append (raw_data, item.delay);
+					readRecord<DelayItem> (image.data, data_pos, item.delay);
 					break;
 
-				case MacroItem::End:
-					// written after this loop, it should not be in this vector
-					break;
+				default:
+					throw std::runtime_error ("Unknown macro item in image.");
 				}
+				key.macro.push_back (item);
 			}
-			append (raw_data, MacroItem::End);
-			append (raw_data, key.repeat_count);
+			readRecord<EndItem> (image.data, data_pos, key.repeat_count);
 			break;
+
+		default:
+			throw std::runtime_error ("Unknown binding type in image.");
 		}
+		if (key.bind_type != KeySettings::BindNone && data_pos != data_end)
+			throw std::runtime_error ("Inconsistent macro image.");
+	}
+	return keys;
+}
+
+void CorsairDevice::setKeys (unsigned int profile_index, const std::vector<KeySettings> &keys)
+{
+	sendKeys (profile_index, encodeKeys (keys).view ());
+}
+
+void CorsairDevice::sendKeys (unsigned int profile_index, const MacroImageView &image)
+{
+	flush ();
+	if (profile_index < 1 || profile_index > 3) {
+		throw std::invalid_argument ("Profile index must be between 1 and 3.");
 	}
-	addresses.push_back (raw_data.size ());
+	checkCapacity (macroCapacity (), modelName (), image);
 
-	// Build key and binding data
-	append (raw_keys, static_cast<uint8_t> (keys.size ()));
-	append (raw_bindings, static_cast<uint8_t> (keys.size ()));
-	append (raw_bindings, static_cast<uint16_t> (5 + 5*keys.size ())); // size of raw_bindings
-	append (raw_bindings, static_cast<uint16_t> (raw_data.size ()));
-	for (unsigned int i = 0; i < keys.size (); ++i) {
-		append (raw_keys, keys[i].key_usage);
-		append (raw_keys, keys[i].repeat_mode);
-
-		append (raw_bindings, keys[i].bind_type);
-		if (keys[i].bind_type == KeySettings::BindNone)
-			append (raw_bindings, static_cast<uint16_t> (0));
-		else
-			append (raw_bindings, static_cast<uint16_t> (addresses[i]));
-		append (raw_bindings, static_cast<uint16_t> (addresses[i+1] - addresses[i]));
-	}
-
-	// Send data to device
-	for (auto tuple: { std::make_tuple (&raw_bindings, MacroBindings),
-			   std::make_tuple (&raw_data, MacroData),
-			   std::make_tuple (&raw_keys, MacroKeys) }) {
-                std::vector<uint8_t> *packet;
-                uint8_t request;
-                std::tie (packet, request) = tuple;
-
-                if (request == MacroData && packet->size () == 0)
+	Trace::Span span ("upload", "device");
+	span.arg ("bytes", image.bindings.size + image.data.size + image.keys.size);
+	for (auto tuple: { std::make_tuple (&image.bindings, MacroBindings),
+			   std::make_tuple (&image.data, MacroData),
+			   std::make_tuple (&image.keys, MacroKeys) }) {
+		const MacroImageView::Blob *packet;
+		uint8_t request;
+		std::tie (packet, request) = tuple;
+
+		if (request == MacroData && packet->size == 0)
 			continue;
 
-                ret = libusb_control_transfer (_dev, RequestOutType, request,
-                                               0, profile_index,
-					       packet->data (), packet->size (), 0);
+		sendMacroPacket (request, profile_index, *packet);
+	}
+}
 
-                if (ret < 0) {
+void CorsairDevice::sendMacroPacket (uint8_t request, unsigned int profile_index,
+				     const MacroImageView::Blob &packet)
+{
+	int ret;
+	for (unsigned int attempt = 1; ; ++attempt) {
+		// OUT transfers do not write to the buffer
+		ret = _transport->controlTransfer (RequestOutType, request,
+						   0, profile_index,
+						   const_cast<uint8_t *> (packet.data),
+						   packet.size, 0);
+		if (ret < 0) {
 			throw std::runtime_error (libusb_error_name (ret));
-                }
-                else if ((unsigned int) ret != packet->size ()) {
-                        throw std::runtime_error ("Incomplete transfer");
-                }
+		}
+		else if ((unsigned int) ret != packet.size) {
+			throw std::runtime_error ("Incomplete transfer");
+		}
 
-                usleep (Delay);
+		unsigned int gap = _pacing.gap;
+		clock ().sleep (gap);
+
+		unsigned int waited;
+		MacroState state = waitReady (_pacing.max_gap + MaxBusyPerByte * packet.size, waited);
+		if (state == MacroReady) {
+			// Shrink the gap while the first poll succeeds, grow it
+			// by the extra time the firmware needed otherwise.
+			if (waited == 0)
+				_pacing.gap = std::max (_pacing.min_gap, gap - gap/8);
+			else
+				_pacing.gap = std::min (_pacing.max_gap, gap + waited);
+			return;
+		}
+		if (state == MacroBusy) {
+			throw std::runtime_error ("Timeout waiting for the device.");
+		}
 
-		if (!checkErrorState ()) {
+		// The packet was rejected, slow down and send it again.
+		_pacing.gap = std::min (_pacing.max_gap, 2*gap);
+		if (attempt == MaxAttempts) {
 			throw std::runtime_error ("Transfer error (going too fast?).");
 		}
+	}
+}
 
-                usleep (Delay);
-        }
+// Poll the state while the device is busy, for at most timeout
+CorsairDevice::MacroState CorsairDevice::waitReady (unsigned int timeout, unsigned int &waited)
+{
+	uint64_t start = clock ().now ();
+	unsigned int interval = PollInterval;
+	waited = 0;
+	MacroState state;
+	while ((state = macroState ()) == MacroBusy) {
+		waited = clock ().now () - start;
+		if (waited >= timeout)
+			break;
+		clock ().sleep (interval);
+		interval = std::min (2*interval, MaxPollInterval);
+	}
+	return state;
 }
 
 std::vector<uint8_t> CorsairDevice::getRawStatus ()
 {
+	flush ();
 	int ret;
 	std::vector<uint8_t> status (_status_size);
-	ret = libusb_control_transfer (_dev, RequestInType, Status,
-				       0, 0,
-				       status.data (), _status_size, 0);
+	ret = _transport->controlTransfer (RequestInType, Status,
+					   0, 0,
+					   status.data (), _status_size, 0);
 	if (ret < 0) {
 		throw std::runtime_error (libusb_error_name (ret));
 	}
 	return status;
 }
 
-bool CorsairDevice::checkErrorState ()
+CorsairDevice::StatusSnapshot CorsairDevice::getStatus ()
+{
+	StatusSnapshot snapshot = decodeStatus (getRawStatus ());
+	updateShadow (snapshot);
+	return snapshot;
+}
+
+CorsairDevice::StatusSnapshot CorsairDevice::cachedStatus (unsigned int fields)
+{
+	flush ();
+	const DeviceShadow::State &state = _shadow.state ();
+	StatusSnapshot snapshot = {};
+	// The profile buttons change the current profile (and so the
+	// profile color) behind the host, both are always read
+	snapshot.fields = state.fields & ~(StatusSnapshot::ProfileColor | StatusSnapshot::CurrentProfile);
+	snapshot.backlight_brightness = state.backlight_brightness;
+	snapshot.animation_mode = state.animation_mode;
+	snapshot.animation_rate = state.animation_rate;
+	snapshot.color_mode = state.color_mode;
+	if ((snapshot.fields & fields) == fields)
+		return snapshot;
+	return getStatus ();
+}
+
+bool CorsairDevice::cachedProfileColor (unsigned int profile_index, Color &color)
+{
+	flush ();
+	const DeviceShadow::State &state = _shadow.state ();
+	if (profile_index < 1 || profile_index > 3 ||
+	    !(state.colors_known & (1 << (profile_index-1))))
+		return false;
+	color = { state.colors[profile_index-1][0],
+		  state.colors[profile_index-1][1],
+		  state.colors[profile_index-1][2] };
+	return true;
+}
+
+static void setShadowColor (DeviceShadow::State &state, unsigned int profile_index, Color color)
+{
+	if (profile_index < 1 || profile_index > 3)
+		return;
+	state.colors_known |= 1 << (profile_index-1);
+	state.colors[profile_index-1][0] = color.r;
+	state.colors[profile_index-1][1] = color.g;
+	state.colors[profile_index-1][2] = color.b;
+}
+
+void CorsairDevice::recordProfileColor (unsigned int profile_index, Color color)
+{
+	setShadowColor (_shadow.state (), profile_index, color);
+	saveShadow ();
+}
+
+unsigned int CorsairDevice::verifyShadow ()
+{
+	StatusSnapshot shadow = cachedStatus (0);
+	// Never answered from the shadow state, but checked all the same
+	const DeviceShadow::State &state = _shadow.state ();
+	if (state.fields & StatusSnapshot::CurrentProfile) {
+		shadow.fields |= StatusSnapshot::CurrentProfile;
+		shadow.current_profile = state.current_profile;
+		if (cachedProfileColor (shadow.current_profile, shadow.profile_color))
+			shadow.fields |= StatusSnapshot::ProfileColor;
+	}
+	StatusSnapshot device = decodeStatus (getRawStatus ());
+	unsigned int wrong = 0;
+	auto check = [&] (StatusSnapshot::Field field, bool same) {
+		if (shadow.has (field) && device.has (field) && !same)
+			wrong |= field;
+	};
+	check (StatusSnapshot::BacklightBrightness,
+	       shadow.backlight_brightness == device.backlight_brightness);
+	check (StatusSnapshot::AnimationMode, shadow.animation_mode == device.animation_mode);
+	check (StatusSnapshot::AnimationRate, shadow.animation_rate == device.animation_rate);
+	check (StatusSnapshot::CurrentProfile, shadow.current_profile == device.current_profile);
+	// Colors can only be compared for the same profile
+	check (StatusSnapshot::ProfileColor,
+	       shadow.current_profile != device.current_profile ||
+	       (shadow.profile_color.r == device.profile_color.r &&
+		shadow.profile_color.g == device.profile_color.g &&
+		shadow.profile_color.b == device.profile_color.b));
+	check (StatusSnapshot::ColorMode, shadow.color_mode == device.color_mode);
+	updateShadow (device);
+	return wrong;
+}
+
+void CorsairDevice::updateShadow (const StatusSnapshot &snapshot)
+{
+	DeviceShadow::State &state = _shadow.state ();
+	if (snapshot.has (StatusSnapshot::BacklightBrightness))
+		state.backlight_brightness = snapshot.backlight_brightness;
+	if (snapshot.has (StatusSnapshot::AnimationMode))
+		state.animation_mode = snapshot.animation_mode;
+	if (snapshot.has (StatusSnapshot::AnimationRate))
+		state.animation_rate = snapshot.animation_rate;
+	if (snapshot.has (StatusSnapshot::CurrentProfile))
+		state.current_profile = snapshot.current_profile;
+	if (snapshot.has (StatusSnapshot::ColorMode))
+		state.color_mode = snapshot.color_mode;
+	state.fields |= snapshot.fields & ~StatusSnapshot::ProfileColor;
+	// The status only has the color of the current profile
+	if (snapshot.has (StatusSnapshot::ProfileColor) &&
+	    (state.fields & StatusSnapshot::CurrentProfile))
+		setShadowColor (state, state.current_profile, snapshot.profile_color);
+	saveShadow ();
+}
+
+void CorsairDevice::holdShadow ()
+{
+	++_shadow_holds;
+}
+
+void CorsairDevice::releaseShadow ()
+{
+	if (--_shadow_holds == 0 && _shadow_changed) {
+		_shadow_changed = false;
+		_shadow.save ();
+	}
+}
+
+void CorsairDevice::saveShadow ()
+{
+	if (_shadow_holds > 0)
+		_shadow_changed = true;
+	else
+		_shadow.save ();
+}
+
+void CorsairDevice::getRawStatus (CommandSequence &seq,
+				  std::function<void (std::vector<uint8_t> &)> result)
+{
+	flush ();
+	seq.control (*_transport, RequestInType, Status, 0, 0,
+		     std::vector<uint8_t> (_status_size), result);
+}
+
+CorsairDevice::MacroState CorsairDevice::macroState ()
 {
+	flush ();
 	int ret;
 	uint8_t data[2];
-	ret = libusb_control_transfer (_dev, RequestInType, GetMode,
-				       0, 0, data, sizeof (data), 0);
+	ret = _transport->controlTransfer (RequestInType, GetMode,
+					   0, 0, data, sizeof (data), 0);
 	if (ret < 0) {
 		throw std::runtime_error (libusb_error_name (ret));
 	}
-	return data[1] == 0x01;
+	return static_cast<MacroState> (data[1]);
 }
@@ -19,18 +19,24 @@
 #ifndef CORSAIR_DEVICE_H
 #define CORSAIR_DEVICE_H
 
+#include "DeviceShadow.h"
+#include "UsbTransport.h"
+
+#include <atomic>
 #include <cstdint>
+#include <functional>
+#include <memory>
 #include <stdexcept>
+#include <string>
 #include <vector>
 
-extern "C" {
-#include <libusb.h>
-}
-
 struct Color {
 	uint8_t r, g, b;
 };
 
+class CommandSequence;
+class FlatProfile;
+
 class CorsairDevice
 {
 public:
@@ -38,12 +44,38 @@ public:
 	{
 	public:
 		FeatureNotSupported ();
-		virtual const char *what () noexcept;
+		virtual const char *what () const noexcept;
 	};
 
-	CorsairDevice (libusb_device *dev, std::size_t status_size);
+	/*
+	 * Pacing of the macro packets sent by setKeys. After each packet,
+	 * the device state is polled once gap has elapsed. The gap is
+	 * learned from how long the firmware actually takes and is shared
+	 * by every device of the same model, possibly from several threads.
+	 */
+	struct Pacing {
+		std::atomic<unsigned int> gap;	// current gap in microseconds
+		unsigned int min_gap;
+		unsigned int max_gap;
+	};
+
+	// The device takes ownership of transport
+	CorsairDevice (UsbTransport *transport, std::size_t status_size, Pacing &pacing);
 	virtual ~CorsairDevice ();
 
+	Clock &clock ();
+
+	// Short lower case model name, such as "k40"
+	virtual const char *modelName () const = 0;
+
+	/*
+	 * Stable name of the physical device (product and serial number or
+	 * bus address) used to find its saved state, empty if there is none.
+	 * Setting it attaches the shadow state to the file of the device.
+	 */
+	const std::string &identity () const;
+	void setIdentity (const std::string &identity);
+
 	enum Mode: uint8_t {
 		HardwareMode = 0x01,
 		FirmwareUpdateMode = 0x10,
@@ -56,18 +88,87 @@ public:
 	Mode getMode ();
 	void setMode (Mode mode);
 
+	/*
+	 * Getters answer from the shadow state when it knows the value,
+	 * setters write to the device and update the shadow state.
+	 */
 	virtual unsigned int getBacklightBrightness () = 0;
-	virtual void setBacklightBrightness (unsigned int brightness) = 0;
+	void setBacklightBrightness (unsigned int brightness);
 	
-	virtual void setAnimationMode (unsigned int mode, unsigned int rate) = 0;
+	void setAnimationMode (unsigned int mode, unsigned int rate);
 	virtual unsigned int getAnimationMode () = 0;
 	virtual unsigned int getAnimationRate () = 0;
 
 	virtual unsigned int getCurrentProfile () = 0;
-	virtual void setCurrentProfile (unsigned int index);
+	void setCurrentProfile (unsigned int index);
 
 	virtual Color getProfileColor (unsigned int profile_index) = 0;
-	virtual void setProfileColor (unsigned int profile_index, Color color) = 0;
+	void setProfileColor (unsigned int profile_index, Color color);
+
+	/*
+	 * Write queue in front of the setters above. With a window, a
+	 * setter only records its value, one per register (brightness,
+	 * animation mode and rate, current profile, color of each
+	 * profile), the last value wins. The values are written by flush,
+	 * which runs before anything else is read from or sent to the
+	 * device, or by the first setter called once window microseconds
+	 * passed since the oldest queued value. The current profile is
+	 * written before the colors. A 0 window, the default, writes at
+	 * once.
+	 */
+	void setWriteWindow (unsigned int window);
+	void flush ();
+	// Transfers not sent because a queued value was replaced, estimated
+	// from the transfers of the value that was written
+	unsigned int savedTransfers () const;
+
+	// Bound the transfers that follow by the deadline of the transfer
+	// policy, started now, or stop bounding them
+	void startDeadline ();
+	void clearDeadline ();
+
+	/*
+	 * Device state decoded from a single status read. Only the fields
+	 * set in fields are reported by the device model.
+	 */
+	struct StatusSnapshot {
+		enum Field: unsigned int {
+			BacklightBrightness = 1 << 0,
+			AnimationMode = 1 << 1,
+			AnimationRate = 1 << 2,
+			CurrentProfile = 1 << 3,
+			ProfileColor = 1 << 4,
+			ColorMode = 1 << 5,
+		};
+		unsigned int fields;
+		unsigned int backlight_brightness;
+		unsigned int animation_mode;
+		unsigned int animation_rate;
+		unsigned int current_profile;
+		Color profile_color;	// color of the current profile
+		unsigned int color_mode;
+
+		bool has (Field field) const { return fields & field; }
+	};
+
+	// Read the status from the device and update the shadow state
+	StatusSnapshot getStatus ();
+	virtual StatusSnapshot decodeStatus (const std::vector<uint8_t> &raw_status) = 0;
+
+	// Color of any profile from the shadow state, false if unknown
+	bool cachedProfileColor (unsigned int profile_index, Color &color);
+	void recordProfileColor (unsigned int profile_index, Color color);
+	/*
+	 * Read the status once and correct the shadow state from it.
+	 * Returns the fields the shadow state had wrong.
+	 */
+	unsigned int verifyShadow ();
+	/*
+	 * While held, changes to the shadow state are only saved when it
+	 * is released, for commands writing many values in a row.
+	 */
+	void holdShadow ();
+	void releaseShadow ();
 
 	struct MacroItem {
 		enum Type: uint8_t {
@@ -101,10 +202,89 @@ public:
 		std::vector<MacroItem> macro;
 	};
 
+	/*
+	 * The three blobs a profile is uploaded as: the binding table, the
+	 * macro data it points into and the key list. A view borrows them
+	 * from any storage, such as a mapped compiled profile.
+	 */
+	struct MacroImageView {
+		struct Blob {
+			const uint8_t *data;
+			std::size_t size;
+		} bindings, data, keys;
+
+		bool operator== (const MacroImageView &other) const;
+		// FNV-1a over the blobs and their sizes
+		uint64_t hash () const;
+	};
+
+	struct MacroImage {
+		std::vector<uint8_t> bindings, data, keys;
+
+		MacroImageView view () const;
+	};
+
+	// Limits of the image format
+	static constexpr unsigned int MaxKeySettings = 255;
+	static constexpr std::size_t MaxMacroData = 65535;
+
+	struct MacroImageSize {
+		std::size_t bindings, data, keys;
+	};
+	// Caller provided storage for an encoded image
+	struct MacroImageStorage {
+		uint8_t *bindings, *data, *keys;
+	};
+
+	// Storage needed to encode keys, the data of the image is smaller
+	// when keys share it
+	static MacroImageSize encodedSize (const std::vector<KeySettings> &keys);
+	static MacroImageSize encodedSize (const FlatProfile &profile);
+	// Identical data is stored once, throws std::runtime_error if the
+	// keys do not fit in the image format. Nothing is allocated, the
+	// image is written in storage, at least as large as encodedSize.
+	static MacroImageView encodeKeys (const std::vector<KeySettings> &keys,
+					  const MacroImageStorage &storage);
+	static MacroImageView encodeKeys (const FlatProfile &profile,
+					  const MacroImageStorage &storage);
+	static MacroImage encodeKeys (const std::vector<KeySettings> &keys);
+	static MacroImage encodeKeys (const FlatProfile &profile);
+	// Throws std::runtime_error if the image is malformed
+	static std::vector<KeySettings> decodeKeys (const MacroImageView &image);
+
 	void setKeys (unsigned int profile_index, const std::vector<KeySettings> &keys);
+	// Throws std::runtime_error if the image does not fit in the device
+	void sendKeys (unsigned int profile_index, const MacroImageView &image);
+
+	/*
+	 * What a profile of the device can hold. The size of the firmware
+	 * macro memory is not documented, only the amount of data the 16 bit
+	 * binding addresses can reach is checked: a profile within it may
+	 * still be too large for the device.
+	 */
+	struct MacroCapacity {
+		unsigned int keys;		// key settings used by the firmware
+		std::size_t addressable_data;	// bytes of macro data
+	};
+	virtual MacroCapacity macroCapacity () const = 0;
+	// Throws std::runtime_error if image does not fit in capacity
+	static void checkCapacity (const MacroCapacity &capacity, const char *model,
+				   const MacroImageView &image);
 
 	std::vector<uint8_t> getRawStatus ();
-	bool checkErrorState ();
+
+	// Processing state of the last macro packet, from GetMode
+	enum MacroState: uint8_t {
+		MacroBusy = 0x00,
+		MacroReady = 0x01,
+		MacroError = 0x02,
+	};
+	MacroState macroState ();
+
+	// Asynchronous versions, appended as steps to a command sequence
+	void setCurrentProfile (CommandSequence &seq, unsigned int index);
+	void getRawStatus (CommandSequence &seq,
+			   std::function<void (std::vector<uint8_t> &)> result);
 
 protected:
 	enum CorsairRequest: uint8_t {
@@ -122,8 +302,58 @@ protected:
 	static constexpr uint8_t RequestOutType =
 		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
 
-	libusb_device_handle *_dev;
+	// Device specific writes behind the setters
+	virtual void writeBacklightBrightness (unsigned int brightness) = 0;
+	virtual void writeAnimationMode (unsigned int mode, unsigned int rate) = 0;
+	virtual void writeProfileColor (unsigned int profile_index, Color color) = 0;
+
+	// The fields from the shadow state if it knows them all, read otherwise
+	StatusSnapshot cachedStatus (unsigned int fields);
+
+	std::unique_ptr<UsbTransport> _transport;
 	std::size_t _status_size;
+
+private:
+	MacroState waitReady (unsigned int timeout, unsigned int &waited);
+	void sendMacroPacket (uint8_t request, unsigned int profile_index,
+			      const MacroImageView::Blob &packet);
+
+	void updateShadow (const StatusSnapshot &snapshot);
+	void saveShadow ();
+
+	void applyBacklightBrightness (unsigned int brightness);
+	void applyAnimationMode (unsigned int mode, unsigned int rate);
+	void applyProfileColor (unsigned int profile_index, Color color);
+	void applyCurrentProfile (unsigned int index);
+
+	enum Register {
+		BrightnessRegister,
+		AnimationRegister,
+		ProfileRegister,
+		ColorRegister,	// followed by the other profile indexes
+		RegisterCount = ColorRegister + 4,
+	};
+	struct WriteQueue {
+		unsigned int window;
+		uint64_t first;			// when the oldest pending value was queued
+		unsigned int writes[RegisterCount];	// setter calls since the last flush, 0 if nothing is pending
+		unsigned int brightness;
+		unsigned int animation_mode, animation_rate;
+		unsigned int current_profile;
+		Color colors[4];
+		unsigned int transfers;		// sent through the device transport
+		unsigned int saved;
+	};
+	bool queueWrite (Register reg);
+
+	Pacing &_pacing;
+	std::string _identity;
+	DeviceShadow _shadow;
+	unsigned int _shadow_holds;
+	bool _shadow_changed;
+	WriteQueue _queue;
+
+	friend class SimulatedTransport;
 };
 
 #endif
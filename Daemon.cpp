@@ -0,0 +1,266 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Daemon.h"
+
+#include "Cancellation.h"
+#include "Commands.h"
+#include "DaemonProtocol.h"
+#include "UsbEventLoop.h"
+
+#include <algorithm>
+#include <csignal>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <vector>
+
+extern "C" {
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+}
+
+// Longest a client may take to send its request or read the response
+constexpr time_t ClientTimeout = 5;
+// Longest run of the commands otherwise running until interrupted, the
+// other clients wait meanwhile
+constexpr double MaxCommandDuration = 60;
+
+static volatile sig_atomic_t quit = 0;
+
+static void stopDaemon (int)
+{
+	quit = 1;
+	// Ends animate and ingest early
+	Cancellation::requestStop ();
+}
+
+struct OpenDevice
+{
+	std::string address;
+	std::unique_ptr<CorsairDevice> device;
+	std::unique_ptr<UsbEventLoop> loop;
+	// Detached while a command may be using it, closed once it returned
+	bool stale;
+};
+
+static void closeStale (std::map<std::string, OpenDevice> &devices)
+{
+	for (auto it = devices.begin (); it != devices.end (); ) {
+		if (it->second.stale)
+			it = devices.erase (it);
+		else
+			++it;
+	}
+}
+
+static int listenSocket (const std::string &path)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size () >= sizeof (addr.sun_path)) {
+		fprintf (stderr, "Socket path is too long.\n");
+		return -1;
+	}
+	strcpy (addr.sun_path, path.c_str ());
+
+	int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		perror ("socket");
+		return -1;
+	}
+	// Replace a stale socket, but not a running daemon
+	if (0 == connect (fd, reinterpret_cast<sockaddr *> (&addr), sizeof (addr))) {
+		fprintf (stderr, "A daemon is already listening on %s.\n", path.c_str ());
+		close (fd);
+		return -1;
+	}
+	struct stat st;
+	if (lstat (path.c_str (), &st) == 0) {
+		if (!S_ISSOCK (st.st_mode)) {
+			fprintf (stderr, "%s exists and is not a socket.\n", path.c_str ());
+			close (fd);
+			return -1;
+		}
+		unlink (path.c_str ());
+	}
+	mode_t old_mask = umask (0077);
+	int ret = bind (fd, reinterpret_cast<sockaddr *> (&addr), sizeof (addr));
+	umask (old_mask);
+	if (ret == -1 || -1 == listen (fd, 16)) {
+		perror (path.c_str ());
+		close (fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool readRequest (int fd, std::vector<std::string> &fields)
+{
+	DaemonProtocol::RequestHeader header;
+	if (!DaemonProtocol::readFull (fd, &header, sizeof (header)) ||
+	    header.size > DaemonProtocol::MaxRequestSize)
+		return false;
+	std::vector<char> payload (header.size);
+	if (!DaemonProtocol::readFull (fd, payload.data (), payload.size ()))
+		return false;
+	auto begin = payload.begin ();
+	while (begin != payload.end ()) {
+		auto end = std::find (begin, payload.end (), '\0');
+		if (end == payload.end ())
+			return false;
+		fields.emplace_back (begin, end);
+		begin = end + 1;
+	}
+	// working directory, address and command
+	return fields.size () >= 3;
+}
+
+static void serveClient (int fd, libusb_context *context,
+			 const DaemonHandlers &handlers,
+			 std::map<std::string, OpenDevice> &devices)
+{
+	std::vector<std::string> fields;
+	if (!readRequest (fd, fields))
+		return;
+
+	char *out_data = nullptr, *err_data = nullptr;
+	std::size_t out_size = 0, err_size = 0;
+	FILE *out = open_memstream (&out_data, &out_size);
+	FILE *err = open_memstream (&err_data, &err_size);
+
+	std::vector<const char *> args;
+	for (unsigned int i = 2; i < fields.size (); ++i)
+		args.push_back (fields[i].c_str ());
+	args.push_back (nullptr);
+
+	bool ok = false;
+	const std::string &address = fields[1];
+	if (-1 == chdir (fields[0].c_str ())) {
+		fprintf (err, "Cannot use working directory %s: %s\n",
+			 fields[0].c_str (), strerror (errno));
+	}
+	else if (!isDeviceCommand (args[0])) {
+		ok = handlers.other (args.data (), out, err);
+	}
+	else {
+		closeStale (devices);
+		std::string resolved;
+		auto it = devices.end ();
+		if (handlers.resolve (address, resolved, err)) {
+			it = devices.find (resolved);
+			if (it == devices.end ()) {
+				if (CorsairDevice *cdev = handlers.open (resolved, err)) {
+					OpenDevice &dev = devices[resolved];
+					dev.address = resolved;
+					dev.stale = false;
+					dev.device.reset (cdev);
+					dev.loop.reset (new UsbEventLoop (context, cdev->clock ()));
+					it = devices.find (resolved);
+				}
+			}
+		}
+		if (it != devices.end ()) {
+			CommandContext ctx = { it->second.device.get (), it->second.loop.get (),
+					       nullptr, out, err, MaxCommandDuration };
+			ok = runCommand (ctx, args.data ());
+			if (!ok) {
+				// Reopen the device on the next request if it is gone
+				try {
+					ctx.device->getMode ();
+				}
+				catch (std::exception &e) {
+					devices.erase (it);
+				}
+			}
+		}
+	}
+	fclose (out);
+	fclose (err);
+
+	DaemonProtocol::ResponseHeader header = {
+		static_cast<uint8_t> (ok ? 0 : 1),
+		static_cast<uint32_t> (out_size),
+		static_cast<uint32_t> (err_size)
+	};
+	if (DaemonProtocol::writeFull (fd, &header, sizeof (header)) &&
+	    DaemonProtocol::writeFull (fd, out_data, out_size))
+		DaemonProtocol::writeFull (fd, err_data, err_size);
+	free (out_data);
+	free (err_data);
+}
+
+bool runDaemon (libusb_context *context, DeviceRegistry &registry,
+		const std::string &socket_path, const DaemonHandlers &handlers)
+{
+	int listen_fd = listenSocket (socket_path);
+	if (listen_fd == -1)
+		return false;
+
+	struct sigaction action = {};
+	action.sa_handler = stopDaemon;
+	sigaction (SIGINT, &action, nullptr);
+	sigaction (SIGTERM, &action, nullptr);
+
+	std::map<std::string, OpenDevice> devices;
+	unsigned int listener = registry.subscribe ([&devices] (DeviceRegistry::Event event,
+								const DeviceRegistry::Device &device) {
+		if (event != DeviceRegistry::Detached)
+			return;
+		// Events are also handled during the transfers of a command,
+		// the device cannot be closed from here
+		for (auto &entry: devices) {
+			if (entry.second.address == device.address)
+				entry.second.stale = true;
+		}
+	});
+
+	// Hotplug events are delivered while handling libusb events
+	UsbEventLoop usb_events (context);
+	bool ok = true;
+	while (!quit) {
+		std::vector<pollfd> fds = usb_events.pollFds ();
+		fds.push_back ({ listen_fd, POLLIN, 0 });
+		if (-1 == poll (fds.data (), fds.size (), usb_events.timeout ())) {
+			if (errno == EINTR)
+				continue;
+			perror ("poll");
+			ok = false;
+			break;
+		}
+		usb_events.dispatch ();
+		closeStale (devices);
+		if (!(fds.back ().revents & POLLIN))
+			continue;
+		int fd = accept4 (listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		if (fd == -1)
+			continue;
+		// A stalled client must not block the others
+		timeval timeout = { ClientTimeout, 0 };
+		setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+		setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+		serveClient (fd, context, handlers, devices);
+		close (fd);
+		closeStale (devices);
+	}
+	registry.unsubscribe (listener);
+	close (listen_fd);
+	unlink (socket_path.c_str ());
+	return ok;
+}
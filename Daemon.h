@@ -0,0 +1,56 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "CorsairDevice.h"
+#include "DeviceRegistry.h"
+
+#include <cstdio>
+#include <functional>
+#include <string>
+
+extern "C" {
+#include <libusb.h>
+}
+
+struct DaemonHandlers
+{
+	// Set resolved to the registry address of the device at address
+	// (empty for the default one) without opening it, or return false
+	// after printing why to err. Every address of a device resolves to
+	// the same string.
+	std::function<bool (const std::string &address, std::string &resolved,
+			    FILE *err)> resolve;
+	// Open the device at a resolved address, or return nullptr after
+	// printing why to err.
+	std::function<CorsairDevice *(const std::string &resolved, FILE *err)> open;
+	// Run a command that does not use a device (e.g. list).
+	std::function<bool (const char * const *args, FILE *out, FILE *err)> other;
+};
+
+/*
+ * Serve commands on a Unix socket until SIGINT or SIGTERM. Devices are
+ * opened on their first request and kept open until they are detached,
+ * requests naming the same device by different addresses share it.
+ */
+bool runDaemon (libusb_context *context, DeviceRegistry &registry,
+		const std::string &socket_path, const DaemonHandlers &handlers);
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DAEMON_PROTOCOL_H
+#define DAEMON_PROTOCOL_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+extern "C" {
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+/*
+ * Framing used on the daemon Unix socket, in host byte order.
+ *
+ * A request is a RequestHeader followed by size bytes of NUL terminated
+ * strings: the client working directory, the device address (empty for
+ * the default device), then the command and its arguments.
+ *
+ * A response is a ResponseHeader followed by the command standard
+ * output and error output.
+ */
+namespace DaemonProtocol
+{
+struct RequestHeader {
+	uint32_t size;
+} __attribute__ ((packed));
+
+struct ResponseHeader {
+	uint8_t status;		// 0 on success
+	uint32_t out_size;
+	uint32_t err_size;
+} __attribute__ ((packed));
+
+constexpr uint32_t MaxRequestSize = 1 << 16;
+
+inline std::string defaultSocketPath ()
+{
+	const char *runtime_dir = getenv ("XDG_RUNTIME_DIR");
+	if (runtime_dir && *runtime_dir)
+		return std::string (runtime_dir) + "/corsair-usb-config.sock";
+	return "/tmp/corsair-usb-config-" + std::to_string (getuid ()) + ".sock";
+}
+
+inline bool readFull (int fd, void *data, std::size_t size)
+{
+	uint8_t *bytes = static_cast<uint8_t *> (data);
+	while (size > 0) {
+		ssize_t ret = read (fd, bytes, size);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		bytes += ret;
+		size -= ret;
+	}
+	return true;
+}
+
+inline bool writeFull (int fd, const void *data, std::size_t size)
+{
+	const uint8_t *bytes = static_cast<const uint8_t *> (data);
+	while (size > 0) {
+		ssize_t ret = send (fd, bytes, size, MSG_NOSIGNAL);
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		bytes += ret;
+		size -= ret;
+	}
+	return true;
+}
+}
+
+#endif
@@ -0,0 +1,225 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DeviceRegistry.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+DeviceRegistry::DeviceRegistry (libusb_context *context, uint16_t vendor_id,
+				const std::set<uint16_t> &products):
+	_context (context),
+	_vendor_id (vendor_id),
+	_products (products),
+	_hotplug (false),
+	_next_listener (0)
+{
+	if (libusb_has_capability (LIBUSB_CAP_HAS_HOTPLUG)) {
+		// Already attached devices are enumerated during registration
+		int ret = libusb_hotplug_register_callback (
+				_context,
+				static_cast<libusb_hotplug_event> (LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+								   LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT),
+				LIBUSB_HOTPLUG_ENUMERATE,
+				_vendor_id, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+				&DeviceRegistry::hotplugCallback, this, &_callback);
+		_hotplug = (ret == LIBUSB_SUCCESS);
+	}
+	if (!_hotplug)
+		rescan ();
+}
+
+DeviceRegistry::~DeviceRegistry ()
+{
+	if (_hotplug)
+		libusb_hotplug_deregister_callback (_context, _callback);
+	for (const auto &pair: _by_address)
+		libusb_unref_device (pair.second.device);
+}
+
+const DeviceRegistry::Device *DeviceRegistry::find (const std::string &address) const
+{
+	auto it = _by_address.find (address);
+	if (it == _by_address.end ())
+		return nullptr;
+	return &it->second;
+}
+
+const DeviceRegistry::Device *DeviceRegistry::find (uint16_t product_id) const
+{
+	auto it = _by_product.find (product_id);
+	if (it == _by_product.end () || it->second.empty ())
+		return nullptr;
+	return find (it->second.front ());
+}
+
+const DeviceRegistry::Device *DeviceRegistry::first () const
+{
+	if (_order.empty ())
+		return nullptr;
+	return find (_order.front ());
+}
+
+std::vector<const DeviceRegistry::Device *> DeviceRegistry::devices () const
+{
+	std::vector<const Device *> list;
+	for (const auto &address: _order)
+		list.push_back (find (address));
+	return list;
+}
+
+unsigned int DeviceRegistry::subscribe (Listener listener)
+{
+	_listeners.emplace (_next_listener, listener);
+	return _next_listener++;
+}
+
+void DeviceRegistry::unsubscribe (unsigned int id)
+{
+	_listeners.erase (id);
+}
+
+libusb_context *DeviceRegistry::context () const
+{
+	return _context;
+}
+
+bool DeviceRegistry::hotplug () const
+{
+	return _hotplug;
+}
+
+void DeviceRegistry::rescan ()
+{
+	libusb_device **list;
+	ssize_t count;
+	if (0 > (count = libusb_get_device_list (_context, &list)))
+		throw std::runtime_error (libusb_error_name (count));
+	std::set<libusb_device *> present;
+	for (ssize_t i = 0; i < count; ++i) {
+		libusb_device_descriptor desc;
+		libusb_get_device_descriptor (list[i], &desc);
+		if (desc.idVendor != _vendor_id)
+			continue;
+		present.insert (list[i]);
+		if (_by_device.find (list[i]) == _by_device.end ())
+			attach (list[i]);
+	}
+	std::vector<libusb_device *> gone;
+	for (const auto &pair: _by_device) {
+		if (present.find (pair.first) == present.end ())
+			gone.push_back (pair.first);
+	}
+	for (libusb_device *dev: gone)
+		detach (dev);
+	libusb_free_device_list (list, count);
+}
+
+std::string DeviceRegistry::address (libusb_device *dev)
+{
+	uint8_t ports[7];
+	int port_count = libusb_get_port_numbers (dev, ports, sizeof (ports));
+	if (port_count <= 0) {
+		ports[0] = 0;
+		port_count = 1;
+	}
+	std::string address = std::to_string (libusb_get_bus_number (dev)) + "-" +
+			      std::to_string (ports[0]);
+	for (int i = 1; i < port_count; ++i)
+		address += "." + std::to_string (ports[i]);
+	return address;
+}
+
+std::string DeviceRegistry::normalizeAddress (const std::string &address)
+{
+	std::size_t del = address.find ('-');
+	if (del == std::string::npos)
+		return std::string ();
+	std::string normalized;
+	try {
+		std::size_t end;
+		normalized = std::to_string (std::stoul (address.substr (0, del), &end)) + "-";
+		if (end != del)
+			return std::string ();
+		std::size_t begin = del + 1;
+		int port_count = 0;
+		do {
+			del = address.find ('.', begin);
+			std::string port = address.substr (begin, del == std::string::npos ? del : del - begin);
+			normalized += (port_count ? "." : "") + std::to_string (std::stoul (port, &end));
+			if (end != port.size () || ++port_count > 7)
+				return std::string ();
+			begin = del + 1;
+		} while (del != std::string::npos);
+	}
+	catch (std::logic_error &e) {
+		return std::string ();
+	}
+	return normalized;
+}
+
+int DeviceRegistry::hotplugCallback (libusb_context *, libusb_device *dev,
+				     libusb_hotplug_event event, void *user_data)
+{
+	DeviceRegistry *registry = static_cast<DeviceRegistry *> (user_data);
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		registry->attach (dev);
+	else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+		registry->detach (dev);
+	return 0;
+}
+
+void DeviceRegistry::attach (libusb_device *dev)
+{
+	libusb_device_descriptor desc;
+	libusb_get_device_descriptor (dev, &desc);
+	if (_products.find (desc.idProduct) == _products.end ())
+		return;
+	std::string address = DeviceRegistry::address (dev);
+	if (_by_address.find (address) != _by_address.end ())
+		detach (_by_address[address].device);
+	Device &device = _by_address[address];
+	device = { libusb_ref_device (dev), address, desc.idProduct };
+	_by_device[dev] = address;
+	_by_product[desc.idProduct].push_back (address);
+	_order.push_back (address);
+	notify (Attached, device);
+}
+
+void DeviceRegistry::detach (libusb_device *dev)
+{
+	auto it = _by_device.find (dev);
+	if (it == _by_device.end ())
+		return;
+	std::string address = it->second;
+	_by_device.erase (it);
+	Device device = _by_address[address];
+	_by_address.erase (address);
+	auto &same_product = _by_product[device.product_id];
+	same_product.erase (std::remove (same_product.begin (), same_product.end (), address),
+			    same_product.end ());
+	_order.erase (std::remove (_order.begin (), _order.end (), address), _order.end ());
+	notify (Detached, device);
+	libusb_unref_device (device.device);
+}
+
+void DeviceRegistry::notify (Event event, const Device &device)
+{
+	for (const auto &pair: _listeners)
+		pair.second (event, device);
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef DEVICE_REGISTRY_H
+#define DEVICE_REGISTRY_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+extern "C" {
+#include <libusb.h>
+}
+
+/*
+ * Index of the attached supported devices, by address ("bus-port.port")
+ * and by product ID. It is kept up to date by libusb hotplug events,
+ * which are delivered while libusb events are handled. Without hotplug
+ * support, the bus is scanned once and on rescan.
+ */
+class DeviceRegistry
+{
+public:
+	struct Device {
+		libusb_device *device;
+		std::string address;
+		uint16_t product_id;
+	};
+
+	enum Event {
+		Attached,
+		Detached,
+	};
+	typedef std::function<void (Event event, const Device &device)> Listener;
+
+	DeviceRegistry (libusb_context *context, uint16_t vendor_id,
+			const std::set<uint16_t> &products);
+	~DeviceRegistry ();
+
+	const Device *find (const std::string &address) const;
+	const Device *find (uint16_t product_id) const;
+	const Device *first () const;
+	// Devices in attach order
+	std::vector<const Device *> devices () const;
+
+	unsigned int subscribe (Listener listener);
+	void unsubscribe (unsigned int id);
+
+	libusb_context *context () const;
+	bool hotplug () const;
+	void rescan ();
+
+	static std::string address (libusb_device *dev);
+	// Canonical form of a user given address, empty if it is invalid
+	static std::string normalizeAddress (const std::string &address);
+
+private:
+	static int LIBUSB_CALL hotplugCallback (libusb_context *context,
+						libusb_device *dev,
+						libusb_hotplug_event event,
+						void *user_data);
+	void attach (libusb_device *dev);
+	void detach (libusb_device *dev);
+	void notify (Event event, const Device &device);
+
+	libusb_context *_context;
+	uint16_t _vendor_id;
+	std::set<uint16_t> _products;
+	bool _hotplug;
+	libusb_hotplug_callback_handle _callback;
+
+	std::unordered_map<std::string, Device> _by_address;
+	std::unordered_map<libusb_device *, std::string> _by_device;
+	std::unordered_map<uint16_t, std::vector<std::string>> _by_product;
+	std::vector<std::string> _order;
+
+	unsigned int _next_listener;
+	std::map<unsigned int, Listener> _listeners;
+};
+
+#endif
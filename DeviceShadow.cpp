@@ -0,0 +1,127 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "DeviceShadow.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+static constexpr char Magic[3] = { 'C', 'D', 'S' };
+static constexpr uint8_t Version = 1;
+
+struct ShadowFile {
+	char magic[3];		// "CDS"
+	uint8_t version;
+	DeviceShadow::State state;
+} __attribute__ ((packed));
+
+DeviceShadow::DeviceShadow ():
+	_state (),
+	_mtime ()
+{
+}
+
+std::string DeviceShadow::defaultDirectory ()
+{
+	const char *runtime_dir = getenv ("XDG_RUNTIME_DIR");
+	if (runtime_dir && *runtime_dir)
+		return std::string (runtime_dir) + "/corsair-usb-config";
+	return "/tmp/corsair-usb-config-" + std::to_string (getuid ());
+}
+
+void DeviceShadow::attach (const std::string &filename)
+{
+	_filename = filename;
+	_state = State ();
+	_mtime = timespec ();
+	load ();
+}
+
+DeviceShadow::State &DeviceShadow::state ()
+{
+	if (changed ())
+		load ();
+	return _state;
+}
+
+bool DeviceShadow::save ()
+{
+	if (_filename.empty ())
+		return true;
+
+	std::string directory = _filename.substr (0, _filename.rfind ('/'));
+	if (mkdir (directory.c_str (), 0700) == -1 && errno != EEXIST)
+		return false;
+
+	ShadowFile file;
+	memcpy (file.magic, Magic, sizeof (Magic));
+	file.version = Version;
+	file.state = _state;
+
+	// Replace the file at once, a reader never sees a partial state
+	std::string tmp_filename = _filename + "." + std::to_string (getpid ());
+	int fd = open (tmp_filename.c_str (), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd == -1)
+		return false;
+	ssize_t ret = write (fd, &file, sizeof (file));
+	close (fd);
+	if (ret != sizeof (file) || rename (tmp_filename.c_str (), _filename.c_str ()) == -1) {
+		unlink (tmp_filename.c_str ());
+		return false;
+	}
+
+	struct stat st;
+	if (stat (_filename.c_str (), &st) == 0)
+		_mtime = st.st_mtim;
+	return true;
+}
+
+bool DeviceShadow::changed ()
+{
+	if (_filename.empty ())
+		return false;
+	struct stat st;
+	if (stat (_filename.c_str (), &st) == -1)
+		return false;
+	return st.st_mtim.tv_sec != _mtime.tv_sec || st.st_mtim.tv_nsec != _mtime.tv_nsec;
+}
+
+void DeviceShadow::load ()
+{
+	int fd = open (_filename.c_str (), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return;
+	ShadowFile file;
+	struct stat st;
+	if (fstat (fd, &st) == 0 &&
+	    read (fd, &file, sizeof (file)) == sizeof (file) &&
+	    memcmp (file.magic, Magic, sizeof (Magic)) == 0 &&
+	    file.version == Version) {
+		_state = file.state;
+		_mtime = st.st_mtim;
+	}
+	close (fd);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef DEVICE_SHADOW_H
+#define DEVICE_SHADOW_H
+
+#include <cstdint>
+#include <string>
+
+extern "C" {
+#include <time.h>
+}
+
+/*
+ * Last known state of a device, as read from or written to it. When
+ * attached to a file, the state is kept there so that other runs on the
+ * same device can use it, and reloaded when another run changed it.
+ */
+class DeviceShadow
+{
+public:
+	struct State {
+		uint32_t fields;	// CorsairDevice::StatusSnapshot fields that are known
+		uint8_t backlight_brightness;
+		uint8_t animation_mode;
+		uint8_t animation_rate;
+		uint8_t current_profile;
+		uint8_t color_mode;
+		uint8_t colors_known;	// one bit per profile
+		uint8_t colors[3][3];	// r, g, b of each profile
+	} __attribute__ ((packed));
+
+	DeviceShadow ();
+
+	// $XDG_RUNTIME_DIR/corsair-usb-config or a per user directory in /tmp
+	static std::string defaultDirectory ();
+
+	// Load the state from filename and save it there from now on
+	void attach (const std::string &filename);
+
+	// Reload the state if the file changed since it was last read
+	State &state ();
+	// Returns false if the state cannot be written to the file
+	bool save ();
+
+private:
+	bool changed ();
+	void load ();
+
+	std::string _filename;
+	State _state;
+	struct timespec _mtime;
+};
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "FlatProfile.h"
+
+FlatProfile::FlatProfile ()
+{
+}
+
+FlatProfile::FlatProfile (const std::vector<CorsairDevice::KeySettings> &keys)
+{
+	std::size_t item_count = 0;
+	for (const auto &key: keys)
+		item_count += key.macro.size ();
+	reserve (keys.size (), item_count);
+	for (const auto &key: keys) {
+		items.insert (items.end (), key.macro.begin (), key.macro.end ());
+		addKey (key.key_usage, key.repeat_mode, key.bind_type,
+			key.target_usage, key.repeat_count);
+	}
+}
+
+std::size_t FlatProfile::size () const
+{
+	return key_usages.size ();
+}
+
+void FlatProfile::clear ()
+{
+	key_usages.clear ();
+	repeat_modes.clear ();
+	bind_types.clear ();
+	target_usages.clear ();
+	repeat_counts.clear ();
+	macros.clear ();
+	items.clear ();
+}
+
+void FlatProfile::reserve (std::size_t keys, std::size_t item_count)
+{
+	key_usages.reserve (keys);
+	repeat_modes.reserve (keys);
+	bind_types.reserve (keys);
+	target_usages.reserve (keys);
+	repeat_counts.reserve (keys);
+	macros.reserve (keys);
+	items.reserve (item_count);
+}
+
+void FlatProfile::addKey (uint8_t key_usage,
+			  CorsairDevice::KeySettings::RepeatMode repeat_mode,
+			  CorsairDevice::KeySettings::BindType bind_type,
+			  uint8_t target_usage, uint16_t repeat_count)
+{
+	uint32_t offset = macros.empty () ? 0 : macros.back ().offset + macros.back ().length;
+	key_usages.push_back (key_usage);
+	repeat_modes.push_back (repeat_mode);
+	bind_types.push_back (bind_type);
+	target_usages.push_back (target_usage);
+	repeat_counts.push_back (repeat_count);
+	macros.push_back ({ offset, static_cast<uint32_t> (items.size () - offset) });
+}
+
+const CorsairDevice::MacroItem *FlatProfile::macroBegin (std::size_t key) const
+{
+	return items.data () + macros[key].offset;
+}
+
+const CorsairDevice::MacroItem *FlatProfile::macroEnd (std::size_t key) const
+{
+	return items.data () + macros[key].offset + macros[key].length;
+}
+
+std::vector<CorsairDevice::KeySettings> FlatProfile::keySettings () const
+{
+	std::vector<CorsairDevice::KeySettings> keys (size ());
+	for (std::size_t i = 0; i < size (); ++i) {
+		keys[i].key_usage = key_usages[i];
+		keys[i].repeat_mode = repeat_modes[i];
+		keys[i].bind_type = bind_types[i];
+		keys[i].target_usage = target_usages[i];
+		keys[i].repeat_count = repeat_counts[i];
+		keys[i].macro.assign (macroBegin (i), macroEnd (i));
+	}
+	return keys;
+}
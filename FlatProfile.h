@@ -0,0 +1,69 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FLAT_PROFILE_H
+#define FLAT_PROFILE_H
+
+#include "CorsairDevice.h"
+
+#include <vector>
+
+/*
+ * Profile stored as parallel arrays: one entry per key in each array,
+ * and the macro items of every key in a single buffer, each key holding
+ * a span of it. Building or walking a profile costs a few allocations
+ * whatever the number of keys, instead of one vector per key.
+ */
+class FlatProfile
+{
+public:
+	struct Span {
+		uint32_t offset, length;
+	};
+
+	std::vector<uint8_t> key_usages;
+	std::vector<CorsairDevice::KeySettings::RepeatMode> repeat_modes;
+	std::vector<CorsairDevice::KeySettings::BindType> bind_types;
+	std::vector<uint8_t> target_usages;
+	std::vector<uint16_t> repeat_counts;
+	std::vector<Span> macros;
+	std::vector<CorsairDevice::MacroItem> items;
+
+	FlatProfile ();
+	explicit FlatProfile (const std::vector<CorsairDevice::KeySettings> &keys);
+
+	std::size_t size () const;
+	void clear ();
+	void reserve (std::size_t keys, std::size_t items);
+
+	/*
+	 * Add a key whose macro is made of the items appended since the
+	 * previous key was added.
+	 */
+	void addKey (uint8_t key_usage,
+		     CorsairDevice::KeySettings::RepeatMode repeat_mode,
+		     CorsairDevice::KeySettings::BindType bind_type,
+		     uint8_t target_usage, uint16_t repeat_count);
+
+	const CorsairDevice::MacroItem *macroBegin (std::size_t key) const;
+	const CorsairDevice::MacroItem *macroEnd (std::size_t key) const;
+
+	std::vector<CorsairDevice::KeySettings> keySettings () const;
+};
+
+#endif
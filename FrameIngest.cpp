@@ -0,0 +1,268 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "FrameIngest.h"
+
+#include "Cancellation.h"
+#include "Clock.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <limits>
+#include <system_error>
+
+extern "C" {
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+}
+
+using FrameProtocol::Frame;
+
+FrameMailbox::FrameMailbox ():
+	_slot (0)
+{
+}
+
+bool FrameMailbox::put (const Frame &frame)
+{
+	static_assert (sizeof (Frame) < sizeof (uint64_t), "Frame does not fit the slot");
+	uint64_t word = 0;
+	memcpy (&word, &frame, sizeof (frame));
+	return _slot.exchange (word | Full, std::memory_order_acq_rel) & Full;
+}
+
+bool FrameMailbox::take (Frame &frame)
+{
+	uint64_t word = _slot.exchange (0, std::memory_order_acq_rel);
+	if (!(word & Full))
+		return false;
+	memcpy (&frame, &word, sizeof (frame));
+	return true;
+}
+
+namespace
+{
+void signalEvent (int fd)
+{
+	uint64_t one = 1;
+	while (write (fd, &one, sizeof (one)) == -1 && errno == EINTR)
+		;
+}
+
+void clearEvent (int fd)
+{
+	uint64_t count;
+	while (read (fd, &count, sizeof (count)) == -1 && errno == EINTR)
+		;
+}
+}
+
+FrameIngest::FrameIngest (CorsairDevice *device, const std::string &socket_path):
+	_device (device),
+	_path (socket_path),
+	_bound (false),
+	_bound_dev (0),
+	_bound_ino (0),
+	_fd (-1),
+	_wake (-1),
+	_quit (-1),
+	_received (0),
+	_dropped (0),
+	_invalid (0),
+	_applied (0)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (_path.size () >= sizeof (addr.sun_path))
+		throw std::system_error (ENAMETOOLONG, std::system_category (), _path);
+	strcpy (addr.sun_path, _path.c_str ());
+
+	_fd = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	_wake = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+	_quit = eventfd (0, EFD_CLOEXEC);
+	if (_fd == -1 || _wake == -1 || _quit == -1) {
+		int error = errno;
+		closeAll ();
+		throw std::system_error (error, std::system_category ());
+	}
+	// A socket left by a previous run is replaced, anything else is kept
+	struct stat st;
+	if (lstat (_path.c_str (), &st) == 0) {
+		if (!S_ISSOCK (st.st_mode)) {
+			closeAll ();
+			throw std::system_error (EEXIST, std::system_category (), socket_path);
+		}
+		unlink (_path.c_str ());
+	}
+	mode_t old_mask = umask (0077);
+	int ret = bind (_fd, reinterpret_cast<sockaddr *> (&addr), sizeof (addr));
+	umask (old_mask);
+	if (ret == -1) {
+		int error = errno;
+		closeAll ();
+		throw std::system_error (error, std::system_category (), socket_path);
+	}
+	if (lstat (_path.c_str (), &st) == 0) {
+		_bound = true;
+		_bound_dev = st.st_dev;
+		_bound_ino = st.st_ino;
+	}
+
+	// Signals are left to the writer
+	sigset_t signals, old_signals;
+	sigemptyset (&signals);
+	sigaddset (&signals, SIGINT);
+	sigaddset (&signals, SIGTERM);
+	pthread_sigmask (SIG_BLOCK, &signals, &old_signals);
+	_receiver = std::thread (&FrameIngest::receive, this);
+	pthread_sigmask (SIG_SETMASK, &old_signals, nullptr);
+}
+
+FrameIngest::~FrameIngest ()
+{
+	if (_receiver.joinable ()) {
+		signalEvent (_quit);
+		_receiver.join ();
+	}
+	if (boundSocket ())
+		unlink (_path.c_str ());
+	closeAll ();
+}
+
+// Whether the path still names the socket bound by the constructor
+bool FrameIngest::boundSocket () const
+{
+	struct stat st;
+	return _bound && lstat (_path.c_str (), &st) == 0 && S_ISSOCK (st.st_mode) &&
+	       st.st_dev == _bound_dev && st.st_ino == _bound_ino;
+}
+
+void FrameIngest::closeAll ()
+{
+	for (int fd: { _fd, _wake, _quit })
+		if (fd != -1)
+			close (fd);
+}
+
+void FrameIngest::receive ()
+{
+	pollfd fds[] = {
+		{ _fd, POLLIN, 0 },
+		{ _quit, POLLIN, 0 },
+	};
+	for (;;) {
+		if (poll (fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		if (fds[1].revents)
+			return;
+		// One more byte than a frame to catch longer datagrams
+		uint8_t buffer[sizeof (Frame) + 1];
+		ssize_t size;
+		while ((size = recv (_fd, buffer, sizeof (buffer), MSG_DONTWAIT)) != -1) {
+			Frame frame;
+			memcpy (&frame, buffer, sizeof (frame));
+			if (size != sizeof (Frame) || !FrameProtocol::valid (frame)) {
+				++_invalid;
+				continue;
+			}
+			++_received;
+			if (_mailbox.put (frame))
+				++_dropped;
+			else
+				signalEvent (_wake);
+		}
+	}
+}
+
+void FrameIngest::apply (const Frame &frame)
+{
+	// The transfer deadline bounds each frame, not the whole run
+	_device->startDeadline ();
+	if (frame.fields & FrameProtocol::ColorField)
+		_device->setProfileColor (frame.profile_index, { frame.r, frame.g, frame.b });
+	if (frame.fields & FrameProtocol::BrightnessField)
+		_device->setBacklightBrightness (frame.brightness);
+	++_applied;
+}
+
+void FrameIngest::run (double duration, FILE *out)
+{
+	// Real time, even with a simulated device
+	Clock &clock = Clock::system ();
+	uint64_t start = clock.now ();
+	uint64_t end = duration > 0 ?
+		start + static_cast<uint64_t> (duration * 1e6) :
+		std::numeric_limits<uint64_t>::max ();
+	uint64_t next_report = start + 1000000;
+	Stats last = stats ();
+
+	struct Release {
+		CorsairDevice *device;
+		~Release ()
+		{
+			device->releaseShadow ();
+		}
+	} release = { _device };
+	Cancellation::Graceful graceful;
+	_device->holdShadow ();
+
+	pollfd fds[] = {
+		{ _wake, POLLIN, 0 },
+		{ Cancellation::stopFd (), POLLIN, 0 },
+	};
+	while (!Cancellation::stopRequested ()) {
+		uint64_t now = clock.now ();
+		if (now >= end)
+			break;
+		if (now >= next_report) {
+			Stats current = stats ();
+			if (current.received != last.received || current.invalid != last.invalid) {
+				fprintf (out, "received %llu, applied %llu, dropped %llu, invalid %llu frames/s\n",
+					 static_cast<unsigned long long> (current.received - last.received),
+					 static_cast<unsigned long long> (current.applied - last.applied),
+					 static_cast<unsigned long long> (current.dropped - last.dropped),
+					 static_cast<unsigned long long> (current.invalid - last.invalid));
+				fflush (out);
+			}
+			last = current;
+			next_report += 1000000 * ((now - next_report) / 1000000 + 1);
+		}
+		int timeout = (std::min (next_report, end) - now + 999) / 1000;
+		if (poll (fds, 2, timeout) <= 0 || !(fds[0].revents & POLLIN))
+			continue;
+		clearEvent (_wake);
+		Frame frame;
+		while (!Cancellation::stopRequested () && _mailbox.take (frame))
+			apply (frame);
+	}
+}
+
+FrameIngest::Stats FrameIngest::stats () const
+{
+	return { _received, _applied, _dropped, _invalid };
+}
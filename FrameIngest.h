@@ -0,0 +1,102 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FRAME_INGEST_H
+#define FRAME_INGEST_H
+
+#include "CorsairDevice.h"
+#include "FrameProtocol.h"
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+
+/*
+ * Single slot holding the newest frame, shared by one producer and one
+ * consumer without locks: the frame is packed in a 64 bits word that is
+ * exchanged as a whole. Putting a frame in a full slot replaces the one
+ * there, frames are never queued.
+ */
+class FrameMailbox
+{
+public:
+	FrameMailbox ();
+
+	// Returns true if an older frame was replaced
+	bool put (const FrameProtocol::Frame &frame);
+	// Returns false if the slot is empty
+	bool take (FrameProtocol::Frame &frame);
+
+private:
+	static constexpr uint64_t Full = uint64_t (1) << 63;
+	std::atomic<uint64_t> _slot;
+};
+
+/*
+ * Frames received on a Unix datagram socket and applied to a device. A
+ * receiver thread reads the socket into a mailbox, the writer (the
+ * thread calling run) applies only the newest frame each time the
+ * device is ready, frames replaced in the mailbox meanwhile are
+ * dropped.
+ */
+class FrameIngest
+{
+public:
+	struct Stats {
+		uint64_t received;	// valid frames
+		uint64_t applied;
+		uint64_t dropped;	// replaced by a newer frame before being applied
+		uint64_t invalid;	// datagrams that are not frames
+	};
+
+	// Throws std::system_error if the socket cannot be bound, or if
+	// socket_path exists and is not a socket
+	FrameIngest (CorsairDevice *device, const std::string &socket_path);
+	~FrameIngest ();
+
+	/*
+	 * Apply frames for duration seconds, or if it is 0 until a stop is
+	 * requested (Cancellation::requestStop, made on SIGINT or SIGTERM). Every second with frames, the counts for that second are
+	 * printed to out. Throws the errors of the device.
+	 */
+	void run (double duration, FILE *out);
+
+	Stats stats () const;
+
+private:
+	void receive ();
+	void apply (const FrameProtocol::Frame &frame);
+	void closeAll ();
+	bool boundSocket () const;
+
+	CorsairDevice *_device;
+	std::string _path;
+	// Socket file created by bind, the only one removed at exit
+	bool _bound;
+	uint64_t _bound_dev, _bound_ino;
+	int _fd;
+	int _wake;	// eventfd, written when a frame is put in the empty mailbox
+	int _quit;	// eventfd, stops the receiver
+	FrameMailbox _mailbox;
+	std::atomic<uint64_t> _received, _dropped, _invalid;
+	uint64_t _applied;
+	std::thread _receiver;
+};
+
+#endif
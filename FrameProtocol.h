@@ -0,0 +1,64 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef FRAME_PROTOCOL_H
+#define FRAME_PROTOCOL_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+extern "C" {
+#include <unistd.h>
+}
+
+/*
+ * Color and brightness frames sent to the ingest socket, one Frame per
+ * datagram. Only the values whose bit is set in fields are applied.
+ */
+namespace FrameProtocol
+{
+enum Field: uint8_t {
+	ColorField = 1 << 0,
+	BrightnessField = 1 << 1,
+};
+
+struct Frame {
+	uint8_t fields;
+	uint8_t profile_index;	// 0 for the current profile
+	uint8_t r, g, b;
+	uint8_t brightness;	// 0 to 3
+} __attribute__ ((packed));
+
+inline bool valid (const Frame &frame)
+{
+	return frame.fields != 0 &&
+	       (frame.fields & ~(ColorField | BrightnessField)) == 0 &&
+	       frame.profile_index <= 3 && frame.brightness <= 3;
+}
+
+inline std::string defaultSocketPath ()
+{
+	const char *runtime_dir = getenv ("XDG_RUNTIME_DIR");
+	if (runtime_dir && *runtime_dir)
+		return std::string (runtime_dir) + "/corsair-usb-config-frames.sock";
+	return "/tmp/corsair-usb-config-frames-" + std::to_string (getuid ()) + ".sock";
+}
+}
+
+#endif
@@ -18,37 +18,29 @@
 
 #include "JsonMacros.h"
 
+#include "JsonSax.h"
 #include "KeyUsage.h"
-#include <list>
+#include <cstdlib>
 #include <iostream>
 
-static uint8_t findKeyUsage (const std::list<const std::map<std::string, uint8_t> *> &maps,
-			     std::string key_name)
+static const KeyUsage::Layout *findKeymap (const std::string &layout)
 {
-	for (const auto &map: maps) {
-		auto it = map->find (key_name);
-		if (it != map->end ())
-			return it->second;
+	if (!layout.empty ()) {
+		const KeyUsage::Layout *found = KeyUsage::findLayout (layout);
+		if (found)
+			return found;
+		std::cerr << "warning: layout " << layout << "not found" << std::endl;
 	}
-	return 0;
+	return &KeyUsage::base;
 }
 
 bool JsonToMacros (const Json::Value &profile,
 		   std::vector<CorsairDevice::KeySettings> &keys,
 		   const std::string &layout)
 {
-	std::list<const std::map<std::string, uint8_t> *> keymaps = { &KeyUsage::keymap };
+	const KeyUsage::Layout *keymap = findKeymap (layout);
 	std::string key_str;
 
-	if (!layout.empty ()) {
-		auto it = KeyUsage::layouts.find (layout);
-		if (it != KeyUsage::layouts.end ()) {
-			keymaps.push_front (&it->second);
-		}
-		else
-			std::cerr << "warning: layout " << layout << "not found" << std::endl;
-	}
-
 	if (!profile.isArray ()) {
 		std::cerr << "profile is not an array" << std::endl;
 		return false;
@@ -61,7 +53,7 @@ bool JsonToMacros (const Json::Value &profile,
 			return false;
 		}
 		key_str = profile[i]["key"].asString ();
-		keys[i].key_usage = findKeyUsage (keymaps, key_str);
+		keys[i].key_usage = keymap->find (key_str);
 		if (keys[i].key_usage == 0) {
 			std::cerr << "Unknown key: " << key_str << std::endl;
 			return false;
@@ -109,7 +101,7 @@ bool JsonToMacros (const Json::Value &profile,
 				return false;
 			}
 			key_str = profile[i]["new_key"].asString ();
-			keys[i].target_usage = findKeyUsage (keymaps, key_str);
+			keys[i].target_usage = keymap->find (key_str);
 			if (keys[i].target_usage == 0) {
 				std::cerr << "Unknown key: " << key_str << std::endl;
 				return false;
@@ -137,7 +129,7 @@ bool JsonToMacros (const Json::Value &profile,
 				if (macro[j].isMember ("key")) {
 					keys[i].macro[j].type = CorsairDevice::MacroItem::Key;
 					key_str = macro[j]["key"].asString ();
-					keys[i].macro[j].key_event.usage = findKeyUsage (keymaps, key_str);
+					keys[i].macro[j].key_event.usage = keymap->find (key_str);
 					if (keys[i].macro[j].key_event.usage == 0) {
 						std::cerr << "Unknown key: " << key_str << std::endl;
 						return false;
@@ -163,3 +155,417 @@ bool JsonToMacros (const Json::Value &profile,
 
 	return true;
 }
+
+namespace
+{
+typedef CorsairDevice::KeySettings KeySettings;
+typedef CorsairDevice::MacroItem MacroItem;
+
+// Member value as read, converted when its object ends
+struct RawValue {
+	enum Type: uint8_t {
+		Missing,
+		String,
+		Number,
+		Boolean,
+		Null,
+		Container,
+	} type;
+	bool boolean;
+	JsonSax::String text;	// string value or number text
+};
+
+struct RawItem {
+	RawValue key, pressed, delay;
+};
+
+/*
+ * Collects the members of each key object, then checks and converts
+ * them in the order JsonToMacros does, with the same messages. Messages
+ * are only printed once the whole text is known to be valid JSON.
+ */
+class MacroHandler: public JsonSax::Handler
+{
+public:
+	MacroHandler (Arena &arena, const KeyUsage::Layout &keymap, FlatProfile &profile):
+		_keymap (keymap),
+		_profile (profile),
+		_depth (0),
+		_skip (0),
+		_key_index (0),
+		_member (Other),
+		_items (arena),
+		_failed (false)
+	{
+		_profile.clear ();
+		resetKey ();
+	}
+
+	virtual void startObject () { startContainer (true); }
+	virtual void endObject () { endContainer (); }
+	virtual void startArray () { startContainer (false); }
+	virtual void endArray () { endContainer (); }
+
+	virtual void key (JsonSax::String name)
+	{
+		if (_skip)
+			return;
+		if (_depth == 2) {
+			if (name == "key")
+				_member = Key;
+			else if (name == "repeat_mode")
+				_member = RepeatMode;
+			else if (name == "type")
+				_member = Type;
+			else if (name == "new_key")
+				_member = NewKey;
+			else if (name == "repeat_count")
+				_member = RepeatCount;
+			else if (name == "macro")
+				_member = Macro;
+			else
+				_member = Other;
+		}
+		else if (_depth == 4) {
+			if (name == "key")
+				_member = ItemKey;
+			else if (name == "pressed")
+				_member = ItemPressed;
+			else if (name == "delay")
+				_member = ItemDelay;
+			else
+				_member = Other;
+		}
+	}
+
+	virtual void string (JsonSax::String value) { scalar ({ RawValue::String, false, value }); }
+	virtual void number (JsonSax::String text) { scalar ({ RawValue::Number, false, text }); }
+	virtual void boolean (bool value) { scalar ({ RawValue::Boolean, value, {} }); }
+	virtual void null () { scalar ({ RawValue::Null, false, {} }); }
+
+	bool failed () const { return _failed; }
+	const std::string &messages () const { return _messages; }
+
+private:
+	enum Member {
+		Other,
+		Key,
+		RepeatMode,
+		Type,
+		NewKey,
+		RepeatCount,
+		Macro,
+		ItemKey,
+		ItemPressed,
+		ItemDelay,
+	};
+
+	enum MacroState {
+		MacroMissing,
+		MacroArray,
+		MacroNotArray,
+	};
+
+	void startContainer (bool object)
+	{
+		if (!_skip) {
+			RawValue container = { RawValue::Container, false, {} };
+			if (_depth == 0 && !object) {
+				++_depth;
+				return;
+			}
+			if (_depth == 1 && object) {
+				resetKey ();
+				++_depth;
+				return;
+			}
+			if (_depth == 2 && _member == Macro && !object) {
+				_macro = MacroArray;
+				_items.clear ();
+				++_depth;
+				return;
+			}
+			if (_depth == 3 && object) {
+				_items.push_back ({});
+				++_depth;
+				return;
+			}
+			// Any other container is only a member value
+			scalar (container);
+			_skip = _depth + 1;
+		}
+		++_depth;
+	}
+
+	void endContainer ()
+	{
+		--_depth;
+		if (_skip) {
+			if (_depth < _skip)
+				_skip = 0;
+			return;
+		}
+		if (_depth == 1)
+			finishKey ();
+	}
+
+	void scalar (const RawValue &value)
+	{
+		if (_skip)
+			return;
+		switch (_depth) {
+		case 0:
+			error ("profile is not an array");
+			break;
+
+		case 1:
+			error ("Missing \"key\" member in key " + std::to_string (_key_index++));
+			break;
+
+		case 2:
+			switch (_member) {
+			case Key: _key = value; break;
+			case RepeatMode: _repeat_mode = value; break;
+			case Type: _type = value; break;
+			case NewKey: _new_key = value; break;
+			case RepeatCount: _repeat_count = value; break;
+			case Macro: _macro = MacroNotArray; break;
+			default: break;
+			}
+			break;
+
+		case 3:
+			_items.push_back ({});
+			break;
+
+		case 4:
+			switch (_member) {
+			case ItemKey: _items[_items.size ()-1].key = value; break;
+			case ItemPressed: _items[_items.size ()-1].pressed = value; break;
+			case ItemDelay: _items[_items.size ()-1].delay = value; break;
+			default: break;
+			}
+			break;
+		}
+	}
+
+	void resetKey ()
+	{
+		_key = _repeat_mode = _type = _new_key = _repeat_count = RawValue ();
+		_macro = MacroMissing;
+		_items.clear ();
+	}
+
+	void error (const std::string &message)
+	{
+		if (!_failed)
+			_messages += message + "\n";
+		_failed = true;
+	}
+
+	bool asString (const RawValue &value, std::string &result)
+	{
+		switch (value.type) {
+		case RawValue::String:
+		case RawValue::Number:
+			result.assign (value.text.data, value.text.size);
+			return true;
+		case RawValue::Boolean:
+			result = value.boolean ? "true" : "false";
+			return true;
+		case RawValue::Container:
+			error ("Type is not convertible to string");
+			return false;
+		default:
+			result.clear ();
+			return true;
+		}
+	}
+
+	bool asUInt (const RawValue &value, unsigned int &result)
+	{
+		switch (value.type) {
+		case RawValue::Number: {
+			std::string text (value.text.data, value.text.size);
+			double number = strtod (text.c_str (), nullptr);
+			if (number < 0 || number > 4294967295.0) {
+				error ("double out of UInt range");
+				return false;
+			}
+			result = number;
+			return true;
+		}
+		case RawValue::Boolean:
+			result = value.boolean;
+			return true;
+		case RawValue::Null:
+		case RawValue::Missing:
+			result = 0;
+			return true;
+		default:
+			error ("Value is not convertible to UInt.");
+			return false;
+		}
+	}
+
+	bool asBool (const RawValue &value, bool &result)
+	{
+		switch (value.type) {
+		case RawValue::Boolean:
+			result = value.boolean;
+			return true;
+		case RawValue::Number:
+			result = strtod (std::string (value.text.data, value.text.size).c_str (), nullptr) != 0;
+			return true;
+		case RawValue::Null:
+		case RawValue::Missing:
+			result = false;
+			return true;
+		default:
+			error ("Value is not convertible to bool.");
+			return false;
+		}
+	}
+
+	uint8_t findKey (const RawValue &value)
+	{
+		std::string key_str;
+		if (!asString (value, key_str))
+			return 0;
+		uint8_t usage = _keymap.find (key_str);
+		if (usage == 0)
+			error ("Unknown key: " + key_str);
+		return usage;
+	}
+
+	void finishKey ()
+	{
+		unsigned int index = _key_index++;
+		if (_failed)
+			return;
+		KeySettings key = {};
+		if (_key.type == RawValue::Missing) {
+			error ("Missing \"key\" member in key " + std::to_string (index));
+			return;
+		}
+		if (!(key.key_usage = findKey (_key)))
+			return;
+
+		std::string str;
+		key.repeat_mode = KeySettings::RepeatFixed;
+		if (_repeat_mode.type != RawValue::Missing) {
+			if (!asString (_repeat_mode, str))
+				return;
+			if (str == "fixed")
+				key.repeat_mode = KeySettings::RepeatFixed;
+			else if (str == "hold")
+				key.repeat_mode = KeySettings::RepeatHold;
+			else if (str == "toggle")
+				key.repeat_mode = KeySettings::RepeatToggle;
+			else
+				return error ("Unknown repeat mode: " + str);
+		}
+
+		key.bind_type = KeySettings::BindMacro;
+		if (_type.type != RawValue::Missing) {
+			if (!asString (_type, str))
+				return;
+			if (str == "none")
+				key.bind_type = KeySettings::BindNone;
+			else if (str == "key")
+				key.bind_type = KeySettings::BindUsage;
+			else if (str == "macro")
+				key.bind_type = KeySettings::BindMacro;
+			else
+				return error ("Unknown type: " + str);
+		}
+
+		switch (key.bind_type) {
+		case KeySettings::BindNone:
+			break;
+
+		case KeySettings::BindUsage:
+			if (_new_key.type == RawValue::Missing)
+				return error ("Missing \"new_key\" member for type \"key\"");
+			if (!(key.target_usage = findKey (_new_key)))
+				return;
+			break;
+
+		case KeySettings::BindMacro: {
+			unsigned int repeat_count = 1;
+			if (_repeat_count.type != RawValue::Missing && !asUInt (_repeat_count, repeat_count))
+				return;
+			key.repeat_count = repeat_count;
+
+			if (_macro == MacroMissing)
+				return error ("Missing \"macro\" member");
+			if (_macro == MacroNotArray)
+				return error ("\"macro\" must be an array");
+			for (const RawItem &raw: _items) {
+				MacroItem item = {};
+				if (raw.key.type != RawValue::Missing) {
+					item.type = MacroItem::Key;
+					if (!(item.key_event.usage = findKey (raw.key)))
+						return;
+					if (raw.pressed.type == RawValue::Missing)
+						return error ("Missing \"pressed\" member in macro item");
+					if (!asBool (raw.pressed, item.key_event.pressed))
+						return;
+				}
+				else if (raw.delay.type != RawValue::Missing) {
+					unsigned int delay;
+					item.type = MacroItem::Delay;
+					if (!asUInt (raw.delay, delay))
+						return;
+					item.delay = delay;
+				}
+				else
+					// Reported but not fatal, like JsonToMacros
+					_messages += "Invalid macro item\n";
+				_profile.items.push_back (item);
+			}
+			break;
+		}
+		}
+		_profile.addKey (key.key_usage, key.repeat_mode, key.bind_type,
+				 key.target_usage, key.repeat_count);
+	}
+
+	const KeyUsage::Layout &_keymap;
+	FlatProfile &_profile;
+	unsigned int _depth, _skip;
+	unsigned int _key_index;
+	Member _member;
+	RawValue _key, _repeat_mode, _type, _new_key, _repeat_count;
+	MacroState _macro;
+	ArenaBuffer<RawItem> _items;
+	std::string _messages;
+	bool _failed;
+};
+}
+
+bool ParseJsonMacros (const char *text, std::size_t size, FlatProfile &profile,
+		      const std::string &layout, std::string &syntax_error)
+{
+	Arena arena;
+	JsonSax reader (arena);
+	MacroHandler handler (arena, *findKeymap (layout), profile);
+	if (!reader.parse (text, size, handler)) {
+		syntax_error = reader.error ();
+		return false;
+	}
+	syntax_error.clear ();
+	std::cerr << handler.messages ();
+	return !handler.failed ();
+}
+
+bool ParseJsonMacros (const char *text, std::size_t size,
+		      std::vector<CorsairDevice::KeySettings> &keys,
+		      const std::string &layout, std::string &syntax_error)
+{
+	FlatProfile profile;
+	if (!ParseJsonMacros (text, size, profile, layout, syntax_error))
+		return false;
+	keys = profile.keySettings ();
+	return true;
+}
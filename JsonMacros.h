@@ -21,9 +21,23 @@
 
 #include <json/json.h>
 #include "CorsairDevice.h"
+#include "FlatProfile.h"
 
 bool JsonToMacros (const Json::Value &profile,
 		   std::vector<CorsairDevice::KeySettings> &keys,
 		   const std::string &layout = std::string ());
 
+/*
+ * Same as JsonToMacros, reading the JSON text in a single pass instead
+ * of building a document first. Returns false with syntax_error set if
+ * the text is not valid JSON, profile errors are reported like
+ * JsonToMacros does.
+ */
+bool ParseJsonMacros (const char *text, std::size_t size,
+		      std::vector<CorsairDevice::KeySettings> &keys,
+		      const std::string &layout, std::string &syntax_error);
+// Same, without any allocation per key
+bool ParseJsonMacros (const char *text, std::size_t size, FlatProfile &profile,
+		      const std::string &layout, std::string &syntax_error);
+
 #endif
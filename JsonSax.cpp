@@ -0,0 +1,364 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "JsonSax.h"
+
+#include <cstring>
+
+// Deeper documents are rejected instead of overflowing the stack
+static constexpr unsigned int MaxDepth = 256;
+
+bool JsonSax::String::operator== (const char *other) const
+{
+	return strlen (other) == size && memcmp (data, other, size) == 0;
+}
+
+JsonSax::Handler::~Handler ()
+{
+}
+
+JsonSax::JsonSax (Arena &arena):
+	_arena (arena),
+	_handler (nullptr),
+	_begin (nullptr),
+	_pos (nullptr),
+	_end (nullptr)
+{
+}
+
+bool JsonSax::parse (const char *text, std::size_t size, Handler &handler)
+{
+	_handler = &handler;
+	_begin = _pos = text;
+	_end = text + size;
+	_error.clear ();
+	if (!skipBlanks ())
+		return false;
+	if (_pos == _end)
+		return fail ("Syntax error: value, object or array expected.");
+	if (!value (0) || !skipBlanks ())
+		return false;
+	if (_pos != _end)
+		return fail ("Extra non-whitespace after JSON value.");
+	return true;
+}
+
+const std::string &JsonSax::error () const
+{
+	return _error;
+}
+
+bool JsonSax::value (unsigned int depth)
+{
+	if (depth > MaxDepth)
+		return fail ("Exceeded stackLimit in readValue().");
+	if (_pos == _end)
+		return fail ("Syntax error: value, object or array expected.");
+	switch (*_pos) {
+	case '{':
+		++_pos;
+		_handler->startObject ();
+		if (!skipBlanks ())
+			return false;
+		if (_pos != _end && *_pos == '}') {
+			++_pos;
+			_handler->endObject ();
+			return true;
+		}
+		for (;;) {
+			String name;
+			if (_pos == _end || *_pos != '"')
+				return fail ("Missing '}' or object member name");
+			if (!string (name) || !skipBlanks ())
+				return false;
+			if (_pos == _end || *_pos != ':')
+				return fail ("Missing ':' after object member name");
+			++_pos;
+			_handler->key (name);
+			if (!skipBlanks () || !value (depth+1) || !skipBlanks ())
+				return false;
+			if (_pos != _end && *_pos == ',') {
+				++_pos;
+				if (!skipBlanks ())
+					return false;
+			}
+			else if (_pos != _end && *_pos == '}') {
+				++_pos;
+				_handler->endObject ();
+				return true;
+			}
+			else
+				return fail ("Missing ',' or '}' in object declaration");
+		}
+
+	case '[':
+		++_pos;
+		_handler->startArray ();
+		if (!skipBlanks ())
+			return false;
+		if (_pos != _end && *_pos == ']') {
+			++_pos;
+			_handler->endArray ();
+			return true;
+		}
+		for (;;) {
+			if (!value (depth+1) || !skipBlanks ())
+				return false;
+			if (_pos != _end && *_pos == ',') {
+				++_pos;
+				if (!skipBlanks ())
+					return false;
+			}
+			else if (_pos != _end && *_pos == ']') {
+				++_pos;
+				_handler->endArray ();
+				return true;
+			}
+			else
+				return fail ("Missing ',' or ']' in array declaration");
+		}
+
+	case '"': {
+		String s;
+		if (!string (s))
+			return false;
+		_handler->string (s);
+		return true;
+	}
+
+	case 't':
+		if (!literal ("true"))
+			return false;
+		_handler->boolean (true);
+		return true;
+
+	case 'f':
+		if (!literal ("false"))
+			return false;
+		_handler->boolean (false);
+		return true;
+
+	case 'n':
+		if (!literal ("null"))
+			return false;
+		_handler->null ();
+		return true;
+
+	default:
+		return number ();
+	}
+}
+
+static void appendUtf8 (char *&out, uint32_t code)
+{
+	if (code < 0x80)
+		*out++ = code;
+	else if (code < 0x800) {
+		*out++ = 0xC0 | (code >> 6);
+		*out++ = 0x80 | (code & 0x3F);
+	}
+	else if (code < 0x10000) {
+		*out++ = 0xE0 | (code >> 12);
+		*out++ = 0x80 | ((code >> 6) & 0x3F);
+		*out++ = 0x80 | (code & 0x3F);
+	}
+	else {
+		*out++ = 0xF0 | (code >> 18);
+		*out++ = 0x80 | ((code >> 12) & 0x3F);
+		*out++ = 0x80 | ((code >> 6) & 0x3F);
+		*out++ = 0x80 | (code & 0x3F);
+	}
+}
+
+static bool hexCode (const char *&pos, const char *end, uint32_t &code)
+{
+	if (end - pos < 4)
+		return false;
+	code = 0;
+	for (int i = 0; i < 4; ++i, ++pos) {
+		char c = *pos;
+		code <<= 4;
+		if (c >= '0' && c <= '9')
+			code |= c - '0';
+		else if (c >= 'a' && c <= 'f')
+			code |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			code |= c - 'A' + 10;
+		else
+			return false;
+	}
+	return true;
+}
+
+bool JsonSax::string (String &result)
+{
+	const char *start = ++_pos;
+	const char *pos = start;
+	while (pos != _end && *pos != '"' && *pos != '\\')
+		++pos;
+	if (pos == _end) {
+		_pos = start - 1;
+		return fail ("Missing '\"' to close string");
+	}
+	if (*pos == '"') {
+		// No escape, the text is the value
+		result = { start, static_cast<std::size_t> (pos - start) };
+		_pos = pos + 1;
+		return true;
+	}
+
+	// Decoded strings are never longer than their text
+	const char *close = pos;
+	while (close < _end && *close != '"')
+		close += *close == '\\' ? 2 : 1;
+	if (close >= _end) {
+		_pos = start - 1;
+		return fail ("Missing '\"' to close string");
+	}
+	char *out = _arena.allocate<char> (close - start);
+	result.data = out;
+	for (pos = start; pos != close; ) {
+		if (*pos != '\\') {
+			*out++ = *pos++;
+			continue;
+		}
+		++pos;
+		switch (*pos++) {
+		case '"': *out++ = '"'; break;
+		case '/': *out++ = '/'; break;
+		case '\\': *out++ = '\\'; break;
+		case 'b': *out++ = '\b'; break;
+		case 'f': *out++ = '\f'; break;
+		case 'n': *out++ = '\n'; break;
+		case 'r': *out++ = '\r'; break;
+		case 't': *out++ = '\t'; break;
+		case 'u': {
+			uint32_t code;
+			if (!hexCode (pos, close, code)) {
+				_pos = pos;
+				return fail ("Bad unicode escape sequence in string: four digits expected.");
+			}
+			if (code >= 0xD800 && code <= 0xDBFF) {
+				uint32_t low;
+				if (close - pos < 2 || pos[0] != '\\' || pos[1] != 'u' ||
+				    !hexCode (pos += 2, close, low) || low < 0xDC00 || low > 0xDFFF) {
+					_pos = pos;
+					return fail ("expecting another \\u token to begin the second half of a unicode surrogate pair");
+				}
+				code = 0x10000 + ((code & 0x3FF) << 10) + (low & 0x3FF);
+			}
+			appendUtf8 (out, code);
+			break;
+		}
+		default:
+			_pos = pos - 2;
+			return fail ("Bad escape sequence in string");
+		}
+	}
+	result.size = out - result.data;
+	_pos = close + 1;
+	return true;
+}
+
+bool JsonSax::number ()
+{
+	const char *start = _pos;
+	if (_pos != _end && *_pos == '-')
+		++_pos;
+	if (_pos == _end || *_pos < '0' || *_pos > '9') {
+		_pos = start;
+		return fail ("Syntax error: value, object or array expected.");
+	}
+	auto digits = [this] () {
+		const char *first = _pos;
+		while (_pos != _end && *_pos >= '0' && *_pos <= '9')
+			++_pos;
+		return _pos != first;
+	};
+	digits ();
+	if (_pos != _end && *_pos == '.') {
+		++_pos;
+		if (!digits ()) {
+			_pos = start;
+			return fail ("Syntax error: value, object or array expected.");
+		}
+	}
+	if (_pos != _end && (*_pos == 'e' || *_pos == 'E')) {
+		++_pos;
+		if (_pos != _end && (*_pos == '+' || *_pos == '-'))
+			++_pos;
+		if (!digits ()) {
+			_pos = start;
+			return fail ("Syntax error: value, object or array expected.");
+		}
+	}
+	_handler->number ({ start, static_cast<std::size_t> (_pos - start) });
+	return true;
+}
+
+bool JsonSax::literal (const char *word)
+{
+	std::size_t length = strlen (word);
+	if (static_cast<std::size_t> (_end - _pos) < length || memcmp (_pos, word, length) != 0)
+		return fail ("Syntax error: value, object or array expected.");
+	_pos += length;
+	return true;
+}
+
+bool JsonSax::skipBlanks ()
+{
+	while (_pos != _end) {
+		char c = *_pos;
+		if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+			++_pos;
+		else if (c == '/' && _end - _pos >= 2 && _pos[1] == '/') {
+			while (_pos != _end && *_pos != '\n')
+				++_pos;
+		}
+		else if (c == '/' && _end - _pos >= 2 && _pos[1] == '*') {
+			const char *start = _pos;
+			for (_pos += 2; _end - _pos >= 2 && !(_pos[0] == '*' && _pos[1] == '/'); ++_pos)
+				;
+			if (_end - _pos < 2) {
+				_pos = start;
+				return fail ("Missing '*/' to close comment");
+			}
+			_pos += 2;
+		}
+		else
+			break;
+	}
+	return true;
+}
+
+bool JsonSax::fail (const char *message)
+{
+	unsigned int line = 1;
+	const char *line_start = _begin;
+	for (const char *p = _begin; p != _pos; ++p) {
+		if (*p == '\n') {
+			++line;
+			line_start = p + 1;
+		}
+	}
+	_error = "* Line " + std::to_string (line) +
+		 ", Column " + std::to_string (_pos - line_start + 1) + "\n" +
+		 "  " + message + "\n";
+	return false;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef JSON_SAX_H
+#define JSON_SAX_H
+
+#include "Arena.h"
+
+#include <string>
+
+/*
+ * Streaming JSON reader calling a handler for each value as it is read,
+ * without building a document. Strings without escapes point into the
+ * text, the others are decoded in the arena. Comments are accepted like
+ * jsoncpp does.
+ */
+class JsonSax
+{
+public:
+	struct String {
+		const char *data;
+		std::size_t size;
+
+		bool operator== (const char *other) const;
+	};
+
+	class Handler
+	{
+	public:
+		virtual ~Handler ();
+
+		virtual void startObject () = 0;
+		virtual void endObject () = 0;
+		virtual void startArray () = 0;
+		virtual void endArray () = 0;
+		// Member name, followed by its value
+		virtual void key (String name) = 0;
+		virtual void string (String value) = 0;
+		// Numbers are passed as their text, already checked
+		virtual void number (String text) = 0;
+		virtual void boolean (bool value) = 0;
+		virtual void null () = 0;
+	};
+
+	JsonSax (Arena &arena);
+
+	// Returns false on syntax errors
+	bool parse (const char *text, std::size_t size, Handler &handler);
+	// Error location and message, formatted like jsoncpp
+	const std::string &error () const;
+
+private:
+	bool value (unsigned int depth);
+	bool string (String &result);
+	bool number ();
+	bool literal (const char *word);
+	bool skipBlanks ();
+	bool fail (const char *message);
+
+	Arena &_arena;
+	Handler *_handler;
+	const char *_begin, *_pos, *_end;
+	std::string _error;
+};
+
+#endif
@@ -18,22 +18,37 @@
 
 #include "K40Device.h"
 
-K40Device::K40Device (libusb_device *dev):
-	CorsairDevice (dev, sizeof (K40Status))
+constexpr CorsairDevice::MacroCapacity K40Device::Capacity;
+
+// Learned by all K40 devices, starting from a conservative gap
+static CorsairDevice::Pacing K40Pacing = { { 10000 }, 2000, 400000 };
+
+K40Device::K40Device (UsbTransport *transport):
+	CorsairDevice (transport, sizeof (K40Status), K40Pacing)
+{
+}
+
+const char *K40Device::modelName () const
 {
+	return ModelName;
 }
 
-void K40Device::setAnimationMode (unsigned int mode, unsigned int rate)
+CorsairDevice::MacroCapacity K40Device::macroCapacity () const
+{
+	return Capacity;
+}
+
+void K40Device::writeAnimationMode (unsigned int mode, unsigned int rate)
 {
 	int ret;
-	ret = libusb_control_transfer (_dev, RequestOutType,
+	ret = _transport->controlTransfer (RequestOutType,
 						       SetBacklightAnimation, 0, mode,
 						       nullptr, 0, 0);
 	if (ret < 0) {
 		throw std::runtime_error (libusb_error_name (ret));
 	}
 	if (rate) {
-		ret = libusb_control_transfer (_dev, RequestOutType,
+		ret = _transport->controlTransfer (RequestOutType,
 						       SetAnimationRate, rate, 0,
 						       nullptr, 0, 0);
 		if (ret < 0) {
@@ -43,31 +58,23 @@ void K40Device::setAnimationMode (unsigned int mode, unsigned int rate)
 }
 unsigned int K40Device::getAnimationMode ()
 {
-	std::vector<uint8_t> raw_status = getRawStatus ();
-	K40Status *status = reinterpret_cast<K40Status *> (raw_status.data ());
-	return status->animation_mode;
+	return cachedStatus (StatusSnapshot::AnimationMode).animation_mode;
 }
 unsigned int K40Device::getAnimationRate ()
 {
-	std::vector<uint8_t> raw_status = getRawStatus ();
-	K40Status *status = reinterpret_cast<K40Status *> (raw_status.data ());
-	return status->animation_rate;
+	return cachedStatus (StatusSnapshot::AnimationRate).animation_rate;
 }
 
 unsigned int K40Device::getBacklightBrightness ()
 {
-	std::vector<uint8_t> raw_status = getRawStatus ();
-	K40Status *status = reinterpret_cast<K40Status *> (raw_status.data ());
-	return status->backlight_brightness;
+	return cachedStatus (StatusSnapshot::BacklightBrightness).backlight_brightness;
 }
 
-void K40Device::setBacklightBrightness (unsigned int brightness)
+void K40Device::writeBacklightBrightness (unsigned int brightness)
 {
 	int ret;
-	if (brightness > 3)
-		brightness = 3;
-	ret = libusb_control_transfer (_dev, RequestOutType, SetBacklightBrightness,
-				       brightness << 8, 0, nullptr, 0, 0);
+	ret = _transport->controlTransfer (RequestOutType, SetBacklightBrightness,
+					   brightness << 8, 0, nullptr, 0, 0);
 	if (ret < 0) {
 		throw std::runtime_error (libusb_error_name (ret));
 	}
@@ -75,29 +82,47 @@ void K40Device::setBacklightBrightness (unsigned int brightness)
 
 unsigned int K40Device::getCurrentProfile ()
 {
-	std::vector<uint8_t> raw_status = getRawStatus ();
-	K40Status *status = reinterpret_cast<K40Status *> (raw_status.data ());
-	return status->current_profile;
+	return cachedStatus (StatusSnapshot::CurrentProfile).current_profile;
 }
 
 Color K40Device::getProfileColor (unsigned int profile_index)
 {
-	std::vector<uint8_t> raw_status = getRawStatus ();
-	K40Status *status = reinterpret_cast<K40Status *> (raw_status.data ());
-	return status->color;
+	Color color;
+	if (cachedProfileColor (profile_index, color))
+		return color;
+	return getStatus ().profile_color;
 }
 
-void K40Device::setProfileColor (unsigned int profile_index, Color color)
+void K40Device::writeProfileColor (unsigned int profile_index, Color color)
 {
 	int ret;
 	if (profile_index > 3) {
 		throw std::invalid_argument ("Invalid profile index.");
 	}
-	ret = libusb_control_transfer (_dev, RequestOutType, SetBacklightColor,
-				       color.r | color.g << 8, color.b | profile_index << 8,
-				       nullptr, 0, 0);
+	ret = _transport->controlTransfer (RequestOutType, SetBacklightColor,
+					   color.r | color.g << 8, color.b | profile_index << 8,
+					   nullptr, 0, 0);
 	if (ret < 0) {
 		throw std::runtime_error (libusb_error_name (ret));
 	}
 }
 
+
+CorsairDevice::StatusSnapshot K40Device::decodeStatus (const std::vector<uint8_t> &raw_status)
+{
+	const K40Status *status = reinterpret_cast<const K40Status *> (raw_status.data ());
+	StatusSnapshot snapshot = {};
+	snapshot.fields = StatusSnapshot::BacklightBrightness |
+			  StatusSnapshot::AnimationMode |
+			  StatusSnapshot::AnimationRate |
+			  StatusSnapshot::CurrentProfile |
+			  StatusSnapshot::ProfileColor |
+			  StatusSnapshot::ColorMode;
+	snapshot.backlight_brightness = status->backlight_brightness;
+	snapshot.animation_mode = status->animation_mode;
+	snapshot.animation_rate = status->animation_rate;
+	snapshot.current_profile = status->current_profile;
+	snapshot.profile_color = status->color;
+	snapshot.color_mode = status->color_mode;
+	return snapshot;
+}
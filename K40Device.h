@@ -24,18 +24,26 @@
 class K40Device: public CorsairDevice
 {
 public:
-	K40Device (libusb_device *dev);
+	K40Device (UsbTransport *transport);
+
+	static constexpr const char *ModelName = "k40";
+	virtual const char *modelName () const;
+	static constexpr MacroCapacity Capacity = { 6, MaxMacroData };
+	virtual MacroCapacity macroCapacity () const;
 
 	virtual unsigned int getBacklightBrightness ();
-	virtual void setBacklightBrightness (unsigned int brightness);
-	virtual void setAnimationMode (unsigned int mode, unsigned int rate);
 	virtual unsigned int getAnimationMode ();
 	virtual unsigned int getAnimationRate ();
 
 	virtual unsigned int getCurrentProfile ();
 
 	virtual Color getProfileColor (unsigned int profile_index);
-	virtual void setProfileColor (unsigned int profile_index, Color color);
+	virtual StatusSnapshot decodeStatus (const std::vector<uint8_t> &raw_status);
+
+protected:
+	virtual void writeBacklightBrightness (unsigned int brightness);
+	virtual void writeAnimationMode (unsigned int mode, unsigned int rate);
+	virtual void writeProfileColor (unsigned int profile_index, Color color);
 
 private:
 	enum K40Request: uint8_t {
@@ -57,6 +65,8 @@ private:
 		uint8_t unk3;
 		uint8_t color_mode;
 	} __attribute__ ((packed));
+
+	friend class SimulatedTransport;
 };
 
 #endif
@@ -18,11 +18,27 @@
 
 #include "K90Device.h"
 
-K90Device::K90Device (libusb_device *dev):
-	CorsairDevice (dev, sizeof (K90Status))
+constexpr CorsairDevice::MacroCapacity K90Device::Capacity;
+
+// Learned by all K90 devices, starting from a conservative gap
+static CorsairDevice::Pacing K90Pacing = { { 20000 }, 5000, 400000 };
+
+K90Device::K90Device (UsbTransport *transport):
+	CorsairDevice (transport, sizeof (K90Status), K90Pacing)
+{
+}
+
+const char *K90Device::modelName () const
+{
+	return ModelName;
+}
+
+CorsairDevice::MacroCapacity K90Device::macroCapacity () const
 {
+	return Capacity;
 }
-void K90Device::setAnimationMode (unsigned int mode, unsigned int rate)
+
+void K90Device::writeAnimationMode (unsigned int, unsigned int)
 {
 	printf ("Animation not implemented for the K90\n"); 
 }
@@ -38,18 +54,14 @@ unsigned int K90Device::getAnimationRate ()
 }
 unsigned int K90Device::getBacklightBrightness ()
 {
-	std::vector<uint8_t> raw_status = getRawStatus ();
-	K90Status *status = reinterpret_cast<K90Status *> (raw_status.data ());
-	return status->backlight_brightness;
+	return cachedStatus (StatusSnapshot::BacklightBrightness).backlight_brightness;
 }
 
-void K90Device::setBacklightBrightness (unsigned int brightness)
+void K90Device::writeBacklightBrightness (unsigned int brightness)
 {
 	int ret;
-	if (brightness > 3)
-		brightness = 3;
-	ret = libusb_control_transfer (_dev, RequestOutType, SetBacklightBrightness,
-				       brightness, 0, nullptr, 0, 0);
+	ret = _transport->controlTransfer (RequestOutType, SetBacklightBrightness,
+					   brightness, 0, nullptr, 0, 0);
 	if (ret < 0) {
 		throw std::runtime_error (libusb_error_name (ret));
 	}
@@ -57,18 +69,27 @@ void K90Device::setBacklightBrightness (unsigned int brightness)
 
 unsigned int K90Device::getCurrentProfile ()
 {
-	std::vector<uint8_t> raw_status = getRawStatus ();
-	K90Status *status = reinterpret_cast<K90Status *> (raw_status.data ());
-	return status->current_profile;
+	return cachedStatus (StatusSnapshot::CurrentProfile).current_profile;
 }
 
-Color K90Device::getProfileColor (unsigned int profile_index)
+Color K90Device::getProfileColor (unsigned int)
 {
 	throw FeatureNotSupported ();
 }
 
-void K90Device::setProfileColor (unsigned int profile_index, Color color)
+void K90Device::writeProfileColor (unsigned int, Color)
 {
 	throw FeatureNotSupported ();
 }
 
+
+CorsairDevice::StatusSnapshot K90Device::decodeStatus (const std::vector<uint8_t> &raw_status)
+{
+	const K90Status *status = reinterpret_cast<const K90Status *> (raw_status.data ());
+	StatusSnapshot snapshot = {};
+	snapshot.fields = StatusSnapshot::BacklightBrightness |
+			  StatusSnapshot::CurrentProfile;
+	snapshot.backlight_brightness = status->backlight_brightness;
+	snapshot.current_profile = status->current_profile;
+	return snapshot;
+}
@@ -24,17 +24,25 @@
 class K90Device: public CorsairDevice
 {
 public:
-	K90Device (libusb_device *dev);
+	K90Device (UsbTransport *transport);
+
+	static constexpr const char *ModelName = "k90";
+	virtual const char *modelName () const;
+	static constexpr MacroCapacity Capacity = { 18, MaxMacroData };
+	virtual MacroCapacity macroCapacity () const;
 
 	virtual unsigned int getBacklightBrightness ();
-	virtual void setBacklightBrightness (unsigned int brightness);
-	virtual void setAnimationMode (unsigned int mode, unsigned int rate);
 	virtual unsigned int getAnimationMode ();
 	virtual unsigned int getAnimationRate ();
 	virtual unsigned int getCurrentProfile ();
 
 	virtual Color getProfileColor (unsigned int profile_index);
-	virtual void setProfileColor (unsigned int profile_index, Color color);
+	virtual StatusSnapshot decodeStatus (const std::vector<uint8_t> &raw_status);
+
+protected:
+	virtual void writeBacklightBrightness (unsigned int brightness);
+	virtual void writeAnimationMode (unsigned int mode, unsigned int rate);
+	virtual void writeProfileColor (unsigned int profile_index, Color color);
 
 private:
 	enum K90Request: uint8_t {
@@ -47,6 +55,8 @@ private:
 		uint8_t unk2[2];
 		uint8_t current_profile;
 	} __attribute__ ((packed));
+
+	friend class SimulatedTransport;
 };
 
 #endif
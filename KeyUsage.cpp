@@ -1,5 +1,5 @@
 /*
- * Copyright 2015 Clément Vuchener
+ * Copyright 2016 Clément Vuchener
  *
  * This program is free software: you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -16,9 +16,22 @@
  *
  */
 
+
 #include "KeyUsage.h"
 
-const std::map<std::string, uint8_t> KeyUsage::keymap = {
+#include "LayoutIndex.h"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+using KeyUsage::Entry;
+using KeyUsage::hashName;
+using KeyUsage::slotOf;
+using KeyUsage::slotCount;
+
+constexpr Entry BaseNames[] = {
 	{ "A", 0x04 },
 	{ "B", 0x05 },
 	{ "C", 0x06 },
@@ -166,33 +179,139 @@ const std::map<std::string, uint8_t> KeyUsage::keymap = {
 	{ "RightMeta", 0xe7 },
 };
 
-const std::map<std::string, std::map<std::string, uint8_t>> KeyUsage::layouts = {
-	{ "AZERTY-Fr", {
-		{ "A", 0x14 },
-		{ "Z", 0x1a },
-		{ "Q", 0x04 },
-		{ "M", 0x33 },
-		{ "W", 0x1d },
-		{ "Square", 0x35 },
-		{ "Ampersand", 0x1e },
-		{ "EAcute", 0x1f },
-		{ "Quotes", 0x20 },
-		{ "Apostrophe", 0x21 },
-		{ "LeftParenthesis", 0x22 },
-		{ "Minus", 0x23 },
-		{ "EGrave", 0x24 },
-		{ "Underscore", 0x25 },
-		{ "CCedilla", 0x26 },
-		{ "AGrave", 0x27 },
-		{ "RightParenthesis", 0x2d },
-		{ "Circumflex", 0x2f },
-		{ "Dollar", 0x30 },
-		{ "UGrave", 0x34 },
-		{ "Asterisk", 0x32 },
-		{ "Comma", 0x10 },
-		{ "SemiColon", 0x36 },
-		{ "Colon", 0x37 },
-		{ "Exclamation", 0x38 },
-		{ "LessThan", 0x64 },
-	}},
+constexpr std::size_t nameLength (const char *name)
+{
+	std::size_t length = 0;
+	while (name[length])
+		++length;
+	return length;
+}
+
+template <std::size_t N>
+struct EntryArray {
+	Entry entries[N];
+};
+
+template <std::size_t N>
+constexpr EntryArray<N> copyEntries (const Entry (&names)[N])
+{
+	EntryArray<N> array = {};
+	for (std::size_t i = 0; i < N; ++i)
+		array.entries[i] = names[i];
+	return array;
+}
+
+template <std::size_t N>
+struct Table {
+	static constexpr std::size_t Slots = slotCount (N);
+	Entry entries[N];
+	uint16_t displacements[N];
+	uint8_t slots[Slots];
+	uint8_t names[256];
 };
+
+template <std::size_t N>
+constexpr Table<N> buildTable (const EntryArray<N> &array)
+{
+	static_assert (N < 256, "Too many key names for 8 bits indices");
+	constexpr std::size_t SlotMask = Table<N>::Slots - 1;
+	Table<N> table = {};
+	uint32_t hashes[N] = {};
+	std::size_t bucket_sizes[N] = {};
+	std::size_t max_size = 0;
+	for (std::size_t i = 0; i < N; ++i) {
+		table.entries[i] = array.entries[i];
+		hashes[i] = hashName (array.entries[i].name, nameLength (array.entries[i].name));
+		std::size_t size = ++bucket_sizes[hashes[i] % N];
+		if (size > max_size)
+			max_size = size;
+	}
+
+	// Place the largest buckets first, trying displacements until all
+	// the names of the bucket fall in free slots.
+	for (std::size_t size = max_size; size > 0; --size) {
+		for (std::size_t bucket = 0; bucket < N; ++bucket) {
+			if (bucket_sizes[bucket] != size)
+				continue;
+			for (uint32_t displacement = 0; ; ++displacement) {
+				if (displacement > 0xFFFF)
+					throw std::logic_error ("No perfect hash for the key names.");
+				std::size_t placed[N] = {};
+				std::size_t placed_count = 0;
+				bool fits = true;
+				for (std::size_t i = 0; i < N && fits; ++i) {
+					if (hashes[i] % N != bucket)
+						continue;
+					std::size_t slot = slotOf (hashes[i], displacement, SlotMask);
+					if (table.slots[slot] != 0)
+						fits = false;
+					else {
+						table.slots[slot] = i + 1;
+						placed[placed_count++] = slot;
+					}
+				}
+				if (fits) {
+					table.displacements[bucket] = displacement;
+					break;
+				}
+				for (std::size_t i = 0; i < placed_count; ++i)
+					table.slots[placed[i]] = 0;
+			}
+		}
+	}
+
+	for (std::size_t i = 0; i < N; ++i) {
+		if (table.names[table.entries[i].usage] == 0)
+			table.names[table.entries[i].usage] = i + 1;
+	}
+	return table;
+}
+
+template <std::size_t N>
+constexpr KeyUsage::Layout makeLayout (const char *name, const Table<N> &table)
+{
+	return {
+		name, table.entries, N, table.displacements,
+		table.slots, Table<N>::Slots - 1, table.names
+	};
+}
+
+constexpr auto BaseTable = buildTable (copyEntries (BaseNames));
+
+constexpr KeyUsage::Layout BaseLayout = makeLayout ("", BaseTable);
+}
+
+const KeyUsage::Layout &KeyUsage::base = BaseLayout;
+
+const KeyUsage::Layout *KeyUsage::findLayout (const std::string &name)
+{
+	return LayoutIndex::instance ().find (name);
+}
+
+std::vector<std::string> KeyUsage::layoutNames ()
+{
+	return LayoutIndex::instance ().names ();
+}
+
+uint8_t KeyUsage::Layout::find (const char *key_name, std::size_t length) const
+{
+	uint32_t hash = hashName (key_name, length);
+	uint8_t index = slots[slotOf (hash, displacements[hash % entry_count], slot_mask)];
+	if (index == 0)
+		return 0;
+	const Entry &entry = entries[index-1];
+	if (strlen (entry.name) != length || memcmp (entry.name, key_name, length) != 0)
+		return 0;
+	return entry.usage;
+}
+
+uint8_t KeyUsage::Layout::find (const std::string &key_name) const
+{
+	return find (key_name.data (), key_name.size ());
+}
+
+const char *KeyUsage::Layout::keyName (uint8_t usage) const
+{
+	uint8_t index = names[usage];
+	return index ? entries[index-1].name : nullptr;
+}
@@ -1,5 +1,5 @@
 /*
- * Copyright 2015 Clément Vuchener
+ * Copyright 2016 Clément Vuchener
  *
  * This program is free software: you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -16,17 +16,80 @@
  *
  */
 
+
 #ifndef KEY_USAGE_H
 #define KEY_USAGE_H
 
-#include <map>
-#include <string>
+#include <cstddef>
 #include <cstdint>
+#include <string>
+#include <vector>
 
 namespace KeyUsage
 {
-extern const std::map<std::string, uint8_t> keymap;
-extern const std::map<std::string, std::map<std::string, uint8_t>> layouts;
+struct Entry {
+	const char *name;
+	uint8_t usage;
+};
+
+/*
+ * Key names of a layout: the base names with the layout names overlaid,
+ * flattened at compile time. Names are found in constant time with a
+ * perfect hash (hash and displace): the name hash selects a bucket whose
+ * displacement gives the slot of the entry. Each usage also maps back to
+ * its first name.
+ */
+struct Layout {
+	const char *name;
+	const Entry *entries;
+	std::size_t entry_count;
+	const uint16_t *displacements;	// one per bucket, there are entry_count buckets
+	const uint8_t *slots;		// entry index + 1, 0 for empty slots
+	std::size_t slot_mask;		// slot count - 1, a power of two - 1
+	const uint8_t *names;		// 256 entries, entry index + 1 or 0 for usages without a name
+
+	// Returns 0 for unknown names
+	uint8_t find (const char *key_name, std::size_t length) const;
+	uint8_t find (const std::string &key_name) const;
+	// Returns nullptr for usages without a name
+	const char *keyName (uint8_t usage) const;
+};
+
+// Base key names, without any layout
+extern const Layout &base;
+
+// Layouts are read from layout files through LayoutIndex.
+// Returns nullptr for unknown layouts
+const Layout *findLayout (const std::string &name);
+std::vector<std::string> layoutNames ();
+
+// FNV-1a
+constexpr uint32_t hashName (const char *name, std::size_t length)
+{
+	uint32_t h = 2166136261u;
+	for (std::size_t i = 0; i < length; ++i)
+		h = (h ^ static_cast<uint8_t> (name[i])) * 16777619u;
+	return h;
+}
+
+// Slot of a name for the displacement of its bucket
+constexpr std::size_t slotOf (uint32_t hash, uint16_t displacement, std::size_t slot_mask)
+{
+	uint32_t h = hash ^ (displacement * 0x9e3779b9u);
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	return h & slot_mask;
+}
+
+// Power of two at least twice the entry count
+constexpr std::size_t slotCount (std::size_t entry_count)
+{
+	std::size_t count = 1;
+	while (count < 2*entry_count)
+		count *= 2;
+	return count;
+}
 }
 
 #endif
@@ -0,0 +1,549 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "LayoutIndex.h"
+
+#include "MacroLedger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+extern "C" {
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#ifndef LAYOUT_DIR
+#define LAYOUT_DIR "/usr/share/corsair-usb-config/layouts"
+#endif
+
+static constexpr char Magic[3] = { 'C', 'L', 'I' };
+static constexpr uint8_t Version = 1;
+static constexpr const char *Extension = ".layout";
+
+/*
+ * Index file, values in host byte order, offsets from the start of the
+ * index. The header is followed by the name buckets of the layouts, then
+ * the layout records, then the tables and names they point to.
+ */
+struct IndexHeader {
+	char magic[3];		// "CLI"
+	uint8_t version;
+	uint64_t stamp;		// of the layout files the index was built from
+	uint32_t size;		// of the whole index
+	uint32_t layout_count;
+	uint32_t bucket_count;	// power of two, layout index + 1 or 0, linear probing
+} __attribute__ ((packed));
+
+struct LayoutRecord {
+	uint32_t name;		// NUL terminated
+	uint32_t entry_count;
+	uint32_t entries;	// EntryRecord[entry_count]
+	uint32_t displacements;	// uint16_t[entry_count]
+	uint32_t slots;		// uint8_t[slot_count]
+	uint32_t slot_count;
+	uint32_t names;		// uint8_t[256]
+} __attribute__ ((packed));
+
+struct EntryRecord {
+	uint32_t name;		// NUL terminated
+	uint8_t usage;
+} __attribute__ ((packed));
+
+LayoutIndex::LayoutIndex (const std::vector<std::string> &directories, const std::string &index_file):
+	_directories (directories),
+	_index_file (index_file),
+	_loaded (false),
+	_stamp (0),
+	_map (MAP_FAILED),
+	_map_size (0),
+	_data (nullptr),
+	_size (0)
+{
+}
+
+LayoutIndex::~LayoutIndex ()
+{
+	if (_map != MAP_FAILED)
+		munmap (_map, _map_size);
+	for (const auto &map: _old_maps)
+		munmap (map.first, map.second);
+}
+
+std::vector<std::string> LayoutIndex::defaultDirectories ()
+{
+	std::string user_dir;
+	const char *data_dir = getenv ("XDG_DATA_HOME");
+	if (data_dir && *data_dir)
+		user_dir = std::string (data_dir) + "/corsair-usb-config/layouts";
+	else {
+		const char *home = getenv ("HOME");
+		user_dir = std::string (home ? home : ".") + "/.local/share/corsair-usb-config/layouts";
+	}
+	return { user_dir, LAYOUT_DIR };
+}
+
+std::string LayoutIndex::defaultIndexFile ()
+{
+	return MacroLedger::defaultDirectory () + "/layouts.index";
+}
+
+LayoutIndex &LayoutIndex::instance ()
+{
+	static LayoutIndex index (defaultDirectories (), defaultIndexFile ());
+	return index;
+}
+
+static uint64_t stampBytes (uint64_t h, const void *data, std::size_t size)
+{
+	// FNV-1a
+	for (std::size_t i = 0; i < size; ++i)
+		h = (h ^ static_cast<const uint8_t *> (data)[i]) * 0x100000001b3ull;
+	return h;
+}
+
+std::vector<LayoutIndex::Source> LayoutIndex::listSources (uint64_t &stamp) const
+{
+	std::vector<Source> sources;
+	std::size_t extension_length = strlen (Extension);
+	for (const std::string &directory: _directories) {
+		DIR *dir = opendir (directory.c_str ());
+		if (!dir)
+			continue;
+		while (struct dirent *entry = readdir (dir)) {
+			std::size_t length = strlen (entry->d_name);
+			if (length <= extension_length ||
+			    strcmp (entry->d_name + length - extension_length, Extension) != 0)
+				continue;
+			std::string name (entry->d_name, length - extension_length);
+			auto same_name = [&name] (const Source &source) { return source.name == name; };
+			if (std::find_if (sources.begin (), sources.end (), same_name) != sources.end ())
+				continue;
+			sources.push_back ({ name, directory + "/" + entry->d_name });
+		}
+		closedir (dir);
+	}
+	std::sort (sources.begin (), sources.end (), [] (const Source &a, const Source &b) {
+		return a.name < b.name;
+	});
+
+	// Any change of the files, their names or times changes the stamp
+	stamp = 0xcbf29ce484222325ull;
+	for (const Source &source: sources) {
+		struct stat st;
+		if (stat (source.path.c_str (), &st) == -1)
+			continue;
+		int64_t values[] = { st.st_mtim.tv_sec, st.st_mtim.tv_nsec, st.st_size, static_cast<int64_t> (st.st_ino) };
+		stamp = stampBytes (stamp, source.path.c_str (), source.path.size () + 1);
+		stamp = stampBytes (stamp, values, sizeof (values));
+	}
+	return sources;
+}
+
+bool LayoutIndex::mapIndex (uint64_t stamp)
+{
+	int fd = open (_index_file.c_str (), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return false;
+	struct stat st;
+	if (fstat (fd, &st) == -1 || static_cast<std::size_t> (st.st_size) < sizeof (IndexHeader)) {
+		close (fd);
+		return false;
+	}
+	void *map = mmap (nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	IndexHeader header;
+	memcpy (&header, map, sizeof (header));
+	std::size_t tables_end = sizeof (header) + header.bucket_count * sizeof (uint32_t) +
+				 header.layout_count * sizeof (LayoutRecord);
+	if (memcmp (header.magic, Magic, sizeof (Magic)) != 0 || header.version != Version ||
+	    header.stamp != stamp || header.size != static_cast<std::size_t> (st.st_size) ||
+	    header.bucket_count == 0 || (header.bucket_count & (header.bucket_count - 1)) != 0 ||
+	    header.layout_count >= header.bucket_count || tables_end > header.size) {
+		munmap (map, st.st_size);
+		return false;
+	}
+	_map = map;
+	_map_size = st.st_size;
+	_data = static_cast<const uint8_t *> (map);
+	_size = _map_size;
+	return true;
+}
+
+static void makeDirectories (const std::string &directory)
+{
+	for (std::size_t pos = directory.find ('/', 1); ; pos = directory.find ('/', pos+1)) {
+		std::string dir = directory.substr (0, pos);
+		if (mkdir (dir.c_str (), 0700) == -1 && errno != EEXIST)
+			return;
+		if (pos == std::string::npos)
+			break;
+	}
+}
+
+// Base names with the names of the layout file replacing or added to them
+static bool readLayoutFile (const std::string &path, std::vector<std::pair<std::string, uint8_t>> &entries)
+{
+	std::ifstream file (path);
+	if (!file)
+		return false;
+	for (std::size_t i = 0; i < KeyUsage::base.entry_count; ++i)
+		entries.emplace_back (KeyUsage::base.entries[i].name, KeyUsage::base.entries[i].usage);
+	std::string line;
+	unsigned int line_number = 0;
+	while (std::getline (file, line)) {
+		++line_number;
+		std::size_t comment = line.find ('#');
+		if (comment != std::string::npos)
+			line.erase (comment);
+		std::istringstream words (line);
+		std::string name, usage, extra;
+		if (!(words >> name))
+			continue;
+		char *end = nullptr;
+		unsigned long value = 0;
+		if (words >> usage)
+			value = strtoul (usage.c_str (), &end, 0);
+		if (!end || *end || value == 0 || value > 0xFF || words >> extra) {
+			std::cerr << "warning: " << path << ":" << line_number
+				  << ": invalid layout entry" << std::endl;
+			continue;
+		}
+		auto it = std::find_if (entries.begin (), entries.end (),
+			[&name] (const std::pair<std::string, uint8_t> &entry) { return entry.first == name; });
+		if (it != entries.end ())
+			it->second = value;
+		else
+			entries.emplace_back (name, value);
+	}
+	return true;
+}
+
+// Same hash and displace tables as the ones built at compile time
+static bool buildTables (const std::vector<std::pair<std::string, uint8_t>> &entries,
+			 std::vector<uint16_t> &displacements, std::vector<uint8_t> &slots,
+			 std::vector<uint8_t> &names)
+{
+	std::size_t n = entries.size ();
+	if (n == 0 || n >= 256)
+		return false;
+	std::size_t slot_mask = KeyUsage::slotCount (n) - 1;
+	displacements.assign (n, 0);
+	slots.assign (slot_mask + 1, 0);
+	names.assign (256, 0);
+	std::vector<uint32_t> hashes (n);
+	std::vector<std::vector<std::size_t>> buckets (n);
+	for (std::size_t i = 0; i < n; ++i) {
+		hashes[i] = KeyUsage::hashName (entries[i].first.data (), entries[i].first.size ());
+		buckets[hashes[i] % n].push_back (i);
+	}
+	std::vector<std::size_t> order (n);
+	for (std::size_t i = 0; i < n; ++i)
+		order[i] = i;
+	std::stable_sort (order.begin (), order.end (), [&buckets] (std::size_t a, std::size_t b) {
+		return buckets[a].size () > buckets[b].size ();
+	});
+	for (std::size_t bucket: order) {
+		if (buckets[bucket].empty ())
+			break;
+		for (uint32_t displacement = 0; ; ++displacement) {
+			if (displacement > 0xFFFF)
+				return false;
+			std::vector<std::size_t> placed;
+			for (std::size_t i: buckets[bucket]) {
+				std::size_t slot = KeyUsage::slotOf (hashes[i], displacement, slot_mask);
+				if (slots[slot] != 0)
+					break;
+				slots[slot] = i + 1;
+				placed.push_back (slot);
+			}
+			if (placed.size () == buckets[bucket].size ()) {
+				displacements[bucket] = displacement;
+				break;
+			}
+			for (std::size_t slot: placed)
+				slots[slot] = 0;
+		}
+	}
+	for (std::size_t i = 0; i < n; ++i) {
+		if (names[entries[i].second] == 0)
+			names[entries[i].second] = i + 1;
+	}
+	return true;
+}
+
+template <typename T>
+static uint32_t appendArray (std::vector<uint8_t> &index, const T *data, std::size_t count)
+{
+	// Tables are read in place, keep them aligned
+	index.resize ((index.size () + alignof (T) - 1) / alignof (T) * alignof (T));
+	uint32_t offset = index.size ();
+	const uint8_t *bytes = reinterpret_cast<const uint8_t *> (data);
+	index.insert (index.end (), bytes, bytes + count * sizeof (T));
+	return offset;
+}
+
+static uint32_t appendString (std::vector<uint8_t> &index, const std::string &str)
+{
+	return appendArray (index, str.c_str (), str.size () + 1);
+}
+
+void LayoutIndex::buildIndex (const std::vector<Source> &sources, uint64_t stamp)
+{
+	std::vector<LayoutRecord> records;
+	std::vector<std::string> layout_names;
+	std::vector<uint8_t> tables;
+	// Tables are built after the header, the buckets and the records,
+	// whose size depends on the number of valid layouts: offsets are
+	// made absolute once it is known.
+	for (const Source &source: sources) {
+		std::vector<std::pair<std::string, uint8_t>> entries;
+		std::vector<uint16_t> displacements;
+		std::vector<uint8_t> slots, names;
+		if (!readLayoutFile (source.path, entries))
+			continue;
+		if (!buildTables (entries, displacements, slots, names)) {
+			std::cerr << "warning: cannot index layout " << source.path << std::endl;
+			continue;
+		}
+		LayoutRecord record;
+		std::vector<EntryRecord> entry_records (entries.size ());
+		for (std::size_t i = 0; i < entries.size (); ++i) {
+			entry_records[i].name = appendString (tables, entries[i].first);
+			entry_records[i].usage = entries[i].second;
+		}
+		record.name = appendString (tables, source.name);
+		record.entry_count = entries.size ();
+		record.entries = appendArray (tables, entry_records.data (), entry_records.size ());
+		record.displacements = appendArray (tables, displacements.data (), displacements.size ());
+		record.slots = appendArray (tables, slots.data (), slots.size ());
+		record.slot_count = slots.size ();
+		record.names = appendArray (tables, names.data (), names.size ());
+		records.push_back (record);
+		layout_names.push_back (source.name);
+	}
+
+	IndexHeader header;
+	memcpy (header.magic, Magic, sizeof (Magic));
+	header.version = Version;
+	header.stamp = stamp;
+	header.layout_count = records.size ();
+	header.bucket_count = KeyUsage::slotCount (records.size () + 1);
+	std::vector<uint32_t> buckets (header.bucket_count, 0);
+	for (std::size_t i = 0; i < records.size (); ++i) {
+		const std::string &name = layout_names[i];
+		uint32_t bucket = KeyUsage::hashName (name.data (), name.size ());
+		while (buckets[bucket & (header.bucket_count - 1)] != 0)
+			++bucket;
+		buckets[bucket & (header.bucket_count - 1)] = i + 1;
+	}
+
+	// Tables start aligned for any of their arrays
+	std::size_t tables_offset = sizeof (header) + buckets.size () * sizeof (uint32_t) +
+				    records.size () * sizeof (LayoutRecord);
+	tables_offset = (tables_offset + 7) / 8 * 8;
+	for (LayoutRecord &record: records) {
+		record.name += tables_offset;
+		record.entries += tables_offset;
+		record.displacements += tables_offset;
+		record.slots += tables_offset;
+		record.names += tables_offset;
+		const EntryRecord *entry_records = reinterpret_cast<const EntryRecord *> (
+			tables.data () + record.entries - tables_offset);
+		for (std::size_t i = 0; i < record.entry_count; ++i) {
+			EntryRecord entry;
+			memcpy (&entry, &entry_records[i], sizeof (entry));
+			entry.name += tables_offset;
+			memcpy (tables.data () + record.entries - tables_offset + i * sizeof (entry), &entry, sizeof (entry));
+		}
+	}
+	header.size = tables_offset + tables.size ();
+
+	_built.clear ();
+	_built.reserve (header.size);
+	appendArray (_built, reinterpret_cast<const uint8_t *> (&header), sizeof (header));
+	appendArray (_built, buckets.data (), buckets.size ());
+	appendArray (_built, reinterpret_cast<const uint8_t *> (records.data ()), records.size () * sizeof (LayoutRecord));
+	_built.resize (tables_offset);
+	_built.insert (_built.end (), tables.begin (), tables.end ());
+	_data = _built.data ();
+	_size = _built.size ();
+
+	// The next runs map the index, it is only used from memory if it
+	// cannot be written.
+	std::size_t slash = _index_file.rfind ('/');
+	if (slash != std::string::npos)
+		makeDirectories (_index_file.substr (0, slash));
+	std::string tmp_filename = _index_file + ".tmp";
+	{
+		std::ofstream file (tmp_filename, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+		file.write (reinterpret_cast<const char *> (_built.data ()), _built.size ());
+		if (!file) {
+			unlink (tmp_filename.c_str ());
+			return;
+		}
+	}
+	if (rename (tmp_filename.c_str (), _index_file.c_str ()) == -1)
+		unlink (tmp_filename.c_str ());
+}
+
+// False when the index was already loaded
+bool LayoutIndex::load ()
+{
+	if (_loaded)
+		return false;
+	_loaded = true;
+	std::vector<Source> sources = listSources (_stamp);
+	if (!mapIndex (_stamp))
+		buildIndex (sources, _stamp);
+	return true;
+}
+
+// False when no layout file changed since the index was loaded
+bool LayoutIndex::reload ()
+{
+	uint64_t stamp;
+	std::vector<Source> sources = listSources (stamp);
+	if (stamp == _stamp)
+		return false;
+	if (_map != MAP_FAILED) {
+		_old_maps.emplace_back (_map, _map_size);
+		_map = MAP_FAILED;
+	}
+	else
+		_old_built.push_back (std::move (_built));
+	for (auto &loaded: _layouts)
+		_old_layouts.push_back (std::move (loaded));
+	_layouts.clear ();
+	_built.clear ();
+	_stamp = stamp;
+	if (!mapIndex (stamp))
+		buildIndex (sources, stamp);
+	return true;
+}
+
+const char *LayoutIndex::string (uint32_t offset) const
+{
+	if (offset >= _size || !memchr (_data + offset, '\0', _size - offset))
+		return nullptr;
+	return reinterpret_cast<const char *> (_data + offset);
+}
+
+const KeyUsage::Layout *LayoutIndex::find (const std::string &name)
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	load ();
+	const KeyUsage::Layout *layout = findIndexed (name);
+	if (!layout && reload ())
+		layout = findIndexed (name);
+	return layout;
+}
+
+const KeyUsage::Layout *LayoutIndex::findIndexed (const std::string &name)
+{
+	IndexHeader header;
+	memcpy (&header, _data, sizeof (header));
+	const uint8_t *buckets = _data + sizeof (header);
+	const uint8_t *records = buckets + header.bucket_count * sizeof (uint32_t);
+	uint32_t bucket = KeyUsage::hashName (name.data (), name.size ());
+	for (;; ++bucket) {
+		uint32_t index;
+		memcpy (&index, buckets + (bucket & (header.bucket_count - 1)) * sizeof (uint32_t), sizeof (index));
+		if (index == 0 || index > header.layout_count)
+			return nullptr;
+		LayoutRecord record;
+		memcpy (&record, records + (index - 1) * sizeof (record), sizeof (record));
+		const char *record_name = string (record.name);
+		if (!record_name || name != record_name)
+			continue;
+
+		for (const auto &loaded: _layouts) {
+			if (loaded->index == index)
+				return &loaded->layout;
+		}
+		// Check the tables are in the index before pointing to them
+		if (record.entry_count == 0 || record.entry_count >= 256 ||
+		    record.slot_count == 0 || (record.slot_count & (record.slot_count - 1)) != 0 ||
+		    record.displacements % alignof (uint16_t) != 0)
+			return nullptr;
+		typedef std::pair<std::size_t, std::size_t> Table;
+		for (auto table: { Table (std::size_t (record.entries), record.entry_count * sizeof (EntryRecord)),
+				   Table (std::size_t (record.displacements), record.entry_count * sizeof (uint16_t)),
+				   Table (std::size_t (record.slots), std::size_t (record.slot_count)),
+				   Table (std::size_t (record.names), 256) }) {
+			if (table.first > _size || table.second > _size - table.first)
+				return nullptr;
+		}
+		for (std::size_t i = 0; i < record.slot_count; ++i)
+			if (_data[record.slots + i] > record.entry_count)
+				return nullptr;
+		for (std::size_t i = 0; i < 256; ++i)
+			if (_data[record.names + i] > record.entry_count)
+				return nullptr;
+		std::unique_ptr<LoadedLayout> loaded (new LoadedLayout);
+		loaded->index = index;
+		loaded->entries.resize (record.entry_count);
+		for (std::size_t i = 0; i < record.entry_count; ++i) {
+			EntryRecord entry;
+			memcpy (&entry, _data + record.entries + i * sizeof (entry), sizeof (entry));
+			if (!(loaded->entries[i].name = string (entry.name)))
+				return nullptr;
+			loaded->entries[i].usage = entry.usage;
+		}
+		loaded->layout = {
+			record_name,
+			loaded->entries.data (),
+			loaded->entries.size (),
+			reinterpret_cast<const uint16_t *> (_data + record.displacements),
+			_data + record.slots,
+			record.slot_count - 1,
+			_data + record.names
+		};
+		_layouts.push_back (std::move (loaded));
+		return &_layouts.back ()->layout;
+	}
+}
+
+std::vector<std::string> LayoutIndex::names ()
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	if (!load ())
+		reload ();
+	IndexHeader header;
+	memcpy (&header, _data, sizeof (header));
+	const uint8_t *records = _data + sizeof (header) + header.bucket_count * sizeof (uint32_t);
+	std::vector<std::string> result;
+	for (std::size_t i = 0; i < header.layout_count; ++i) {
+		LayoutRecord record;
+		memcpy (&record, records + i * sizeof (record), sizeof (record));
+		if (const char *name = string (record.name))
+			result.push_back (name);
+	}
+	return result;
+}
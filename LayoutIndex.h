@@ -0,0 +1,98 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef LAYOUT_INDEX_H
+#define LAYOUT_INDEX_H
+
+#include "KeyUsage.h"
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Keyboard layouts read from the layout files (NAME.layout) of a list of
+ * directories, the first directory having a layout wins. The files are
+ * compiled to a single binary index holding the hash tables of every
+ * layout, stored in a cache file and rebuilt only when a layout file
+ * changes. The index is mapped on the first lookup, and a layout is only
+ * set up when it is looked up, by its name hash. The files are checked
+ * again when a lookup misses or the names are listed; the layouts already
+ * returned stay valid.
+ */
+class LayoutIndex
+{
+public:
+	LayoutIndex (const std::vector<std::string> &directories, const std::string &index_file);
+	~LayoutIndex ();
+
+	LayoutIndex (const LayoutIndex &) = delete;
+	LayoutIndex &operator= (const LayoutIndex &) = delete;
+
+	// $XDG_DATA_HOME/corsair-usb-config/layouts (or
+	// ~/.local/share/corsair-usb-config/layouts), then the layouts
+	// directory given at build time
+	static std::vector<std::string> defaultDirectories ();
+	// layouts.index in the cache directory
+	static std::string defaultIndexFile ();
+	// Index of the default directories, shared by every thread
+	static LayoutIndex &instance ();
+
+	// Returns nullptr for unknown layouts
+	const KeyUsage::Layout *find (const std::string &name);
+	// Read from the index, the layout files are not parsed
+	std::vector<std::string> names ();
+
+private:
+	struct Source {
+		std::string name, path;
+	};
+	struct LoadedLayout {
+		uint32_t index;
+		std::vector<KeyUsage::Entry> entries;
+		KeyUsage::Layout layout;
+	};
+
+	bool load ();
+	bool reload ();
+	const KeyUsage::Layout *findIndexed (const std::string &name);
+	std::vector<Source> listSources (uint64_t &stamp) const;
+	bool mapIndex (uint64_t stamp);
+	void buildIndex (const std::vector<Source> &sources, uint64_t stamp);
+	const char *string (uint32_t offset) const;
+
+	std::mutex _mutex;
+	std::vector<std::string> _directories;
+	std::string _index_file;
+	bool _loaded;
+	uint64_t _stamp;
+	void *_map;
+	std::size_t _map_size;
+	std::vector<uint8_t> _built;	// used when the index cannot be mapped
+	const uint8_t *_data;
+	std::size_t _size;
+	std::vector<std::unique_ptr<LoadedLayout>> _layouts;
+	// Previous indexes, still used by the layouts returned from them
+	std::vector<std::pair<void *, std::size_t>> _old_maps;
+	std::vector<std::vector<uint8_t>> _old_built;
+	std::vector<std::unique_ptr<LoadedLayout>> _old_layouts;
+};
+
+#endif
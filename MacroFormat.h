@@ -0,0 +1,91 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MACRO_FORMAT_H
+#define MACRO_FORMAT_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * Layouts of the records found in the macro packets, described once as
+ * lists of big endian fields. Each record knows its size at compile time
+ * and how to write or read itself at a position that is then moved past
+ * it. Reading and writing do not check bounds, callers check that size
+ * bytes are available first.
+ */
+namespace MacroFormat
+{
+
+template <typename... Fields>
+struct Record;
+
+template <>
+struct Record<>
+{
+	static constexpr std::size_t size = 0;
+
+	static void write (uint8_t *&) { }
+	static void read (const uint8_t *&) { }
+};
+
+template <typename Field, typename... Fields>
+struct Record<Field, Fields...>
+{
+	static constexpr std::size_t size = sizeof (Field) + Record<Fields...>::size;
+
+	static void write (uint8_t *&pos, Field value, Fields... values)
+	{
+		for (unsigned int i = 0; i < sizeof (Field); ++i)
+			*pos++ = (value >> 8*(sizeof (Field)-1 - i)) & 0xFF;
+		Record<Fields...>::write (pos, values...);
+	}
+
+	static void read (const uint8_t *&pos, Field &value, Fields &... values)
+	{
+		value = 0;
+		for (unsigned int i = 0; i < sizeof (Field); ++i)
+			value = (value << 8) | *pos++;
+		Record<Fields...>::read (pos, values...);
+	}
+};
+
+// Bindings packet: key count, size of the packet, size of the data
+typedef Record<uint8_t, uint16_t, uint16_t> BindingsHeader;
+// then for each key: binding type, data address, data length
+typedef Record<uint8_t, uint16_t, uint16_t> Binding;
+
+// Keys packet: key count
+typedef Record<uint8_t> KeysHeader;
+// then for each key: key usage, repeat mode
+typedef Record<uint8_t, uint8_t> KeyRecord;
+
+// Data of a key bound to another key: the target usage
+typedef Record<uint8_t> UsageData;
+// Data of a key bound to a macro: items, each starting with its type
+typedef Record<uint8_t> ItemType;
+// key usage, pressed
+typedef Record<uint8_t, uint8_t> KeyEventItem;
+// delay in milliseconds
+typedef Record<uint16_t> DelayItem;
+// repeat count, after the End item type
+typedef Record<uint16_t> EndItem;
+
+}
+
+#endif
@@ -0,0 +1,141 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#include "MacroLedger.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <system_error>
+
+extern "C" {
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+static constexpr char Magic[3] = { 'C', 'M', 'L' };
+static constexpr uint8_t Version = 1;
+
+// Entry file header, values in host byte order, followed by the blobs
+struct LedgerHeader {
+	char magic[3];		// "CML"
+	uint8_t version;
+	uint64_t hash;
+	uint16_t bindings_size;
+	uint16_t data_size;
+	uint16_t keys_size;
+} __attribute__ ((packed));
+
+MacroLedger::MacroLedger (const std::string &directory):
+	_directory (directory)
+{
+}
+
+std::string MacroLedger::defaultDirectory ()
+{
+	const char *cache_dir = getenv ("XDG_CACHE_HOME");
+	if (cache_dir && *cache_dir)
+		return std::string (cache_dir) + "/corsair-usb-config";
+	const char *home = getenv ("HOME");
+	return std::string (home ? home : ".") + "/.cache/corsair-usb-config";
+}
+
+bool MacroLedger::load (const std::string &identity, unsigned int profile_index, Entry &entry) const
+{
+	std::ifstream file (path (identity, profile_index), std::ifstream::in | std::ifstream::binary);
+	if (!file)
+		return false;
+	std::vector<uint8_t> content ((std::istreambuf_iterator<char> (file)),
+				      std::istreambuf_iterator<char> ());
+
+	LedgerHeader header;
+	if (content.size () < sizeof (header))
+		return false;
+	memcpy (&header, content.data (), sizeof (header));
+	if (memcmp (header.magic, Magic, sizeof (Magic)) != 0 || header.version != Version ||
+	    content.size () != sizeof (header) + header.bindings_size + header.data_size + header.keys_size)
+		return false;
+
+	auto it = content.begin () + sizeof (header);
+	entry.image.bindings.assign (it, it + header.bindings_size);
+	it += header.bindings_size;
+	entry.image.data.assign (it, it + header.data_size);
+	it += header.data_size;
+	entry.image.keys.assign (it, it + header.keys_size);
+	entry.hash = header.hash;
+	// A corrupted entry is as good as none
+	return entry.hash == entry.image.view ().hash ();
+}
+
+static void makeDirectories (const std::string &directory)
+{
+	for (std::size_t pos = directory.find ('/', 1); ; pos = directory.find ('/', pos+1)) {
+		std::string dir = directory.substr (0, pos);
+		if (mkdir (dir.c_str (), 0700) == -1 && errno != EEXIST)
+			throw std::system_error (errno, std::system_category (), dir);
+		if (pos == std::string::npos)
+			break;
+	}
+}
+
+void MacroLedger::store (const std::string &identity, unsigned int profile_index,
+			 const CorsairDevice::MacroImageView &image) const
+{
+	makeDirectories (_directory);
+
+	LedgerHeader header;
+	memcpy (header.magic, Magic, sizeof (Magic));
+	header.version = Version;
+	header.hash = image.hash ();
+	header.bindings_size = image.bindings.size;
+	header.data_size = image.data.size;
+	header.keys_size = image.keys.size;
+
+	// Write a temporary file and rename it so that readers never see
+	// a partial entry.
+	std::string filename = path (identity, profile_index);
+	std::string tmp_filename = filename + ".tmp";
+	{
+		std::ofstream file (tmp_filename, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+		file.write (reinterpret_cast<const char *> (&header), sizeof (header));
+		for (const auto *blob: { &image.bindings, &image.data, &image.keys })
+			file.write (reinterpret_cast<const char *> (blob->data), blob->size);
+		if (!file)
+			throw std::system_error (EIO, std::system_category (), tmp_filename);
+	}
+	if (rename (tmp_filename.c_str (), filename.c_str ()) == -1)
+		throw std::system_error (errno, std::system_category (), filename);
+}
+
+void MacroLedger::forget (const std::string &identity, unsigned int profile_index) const
+{
+	unlink (path (identity, profile_index).c_str ());
+}
+
+std::string MacroLedger::path (const std::string &identity, unsigned int profile_index) const
+{
+	std::string name = identity;
+	for (char &c: name) {
+		if (c == '/')
+			c = '_';
+	}
+	return _directory + "/" + name + "-" + std::to_string (profile_index) + ".macros";
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+#ifndef MACRO_LEDGER_H
+#define MACRO_LEDGER_H
+
+#include "CorsairDevice.h"
+
+#include <string>
+
+/*
+ * Host side record of the last macro image uploaded to each profile of
+ * each device, so that an identical upload can be skipped and a partial
+ * one merged into what the device already holds. There is one file per
+ * device identity and profile in the ledger directory.
+ */
+class MacroLedger
+{
+public:
+	struct Entry {
+		uint64_t hash;
+		CorsairDevice::MacroImage image;
+	};
+
+	MacroLedger (const std::string &directory = defaultDirectory ());
+
+	// $XDG_CACHE_HOME/corsair-usb-config or ~/.cache/corsair-usb-config
+	static std::string defaultDirectory ();
+
+	// Returns false if there is no valid entry
+	bool load (const std::string &identity, unsigned int profile_index, Entry &entry) const;
+	// Throws std::system_error if the entry cannot be written
+	void store (const std::string &identity, unsigned int profile_index,
+		    const CorsairDevice::MacroImageView &image) const;
+	void forget (const std::string &identity, unsigned int profile_index) const;
+
+private:
+	std::string path (const std::string &identity, unsigned int profile_index) const;
+
+	std::string _directory;
+};
+
+#endif
@@ -0,0 +1,172 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "MacroOptimizer.h"
+
+#include <cmath>
+#include <limits>
+
+typedef CorsairDevice::KeySettings KeySettings;
+typedef CorsairDevice::MacroItem MacroItem;
+
+static constexpr unsigned int MaxDelay = std::numeric_limits<uint16_t>::max ();
+// Item type and its two bytes of payload
+static constexpr std::size_t ItemSize = 3;
+
+MacroOptimizer::MacroOptimizer (double delay_scale, unsigned int min_delay):
+	_delay_scale (delay_scale),
+	_min_delay (min_delay)
+{
+}
+
+static std::size_t encodedSize (KeySettings::BindType bind_type, std::size_t item_count)
+{
+	switch (bind_type) {
+	case KeySettings::BindNone:
+		return 0;
+	case KeySettings::BindUsage:
+		return 1;
+	case KeySettings::BindMacro:
+		// The items and the end item with the repeat count
+		return ItemSize * (item_count + 1);
+	}
+	return 0;
+}
+
+static uint64_t playbackTime (KeySettings::BindType bind_type,
+			      const MacroItem *begin, const MacroItem *end)
+{
+	uint64_t time = 0;
+	if (bind_type == KeySettings::BindMacro)
+		for (const MacroItem *item = begin; item != end; ++item)
+			if (item->type == MacroItem::Delay)
+				time += item->delay;
+	return time;
+}
+
+std::size_t MacroOptimizer::encodedSize (const KeySettings &key)
+{
+	return ::encodedSize (key.bind_type, key.macro.size ());
+}
+
+uint64_t MacroOptimizer::playbackTime (const KeySettings &key)
+{
+	return ::playbackTime (key.bind_type, key.macro.data (), key.macro.data () + key.macro.size ());
+}
+
+MacroOptimizer::Savings MacroOptimizer::optimize (KeySettings &key) const
+{
+	Savings savings;
+	savings.bytes_before = encodedSize (key);
+	savings.time_before = playbackTime (key);
+	if (key.bind_type == KeySettings::BindMacro) {
+		std::vector<MacroItem> macro;
+		macro.reserve (key.macro.size ());
+		optimize (key.repeat_mode, key.repeat_count,
+			  key.macro.data (), key.macro.data () + key.macro.size (), macro);
+		key.macro.swap (macro);
+	}
+	savings.bytes_after = encodedSize (key);
+	savings.time_after = playbackTime (key);
+	return savings;
+}
+
+void MacroOptimizer::optimize (FlatProfile &profile, std::vector<Savings> &savings) const
+{
+	// Items are written to a new buffer as the key spans are updated
+	std::vector<MacroItem> items;
+	items.reserve (profile.items.size ());
+	savings.resize (profile.size ());
+	for (std::size_t i = 0; i < profile.size (); ++i) {
+		KeySettings::BindType bind_type = profile.bind_types[i];
+		const MacroItem *begin = profile.macroBegin (i), *end = profile.macroEnd (i);
+		FlatProfile::Span &span = profile.macros[i];
+		savings[i].bytes_before = ::encodedSize (bind_type, span.length);
+		savings[i].time_before = ::playbackTime (bind_type, begin, end);
+		span.offset = items.size ();
+		if (bind_type == KeySettings::BindMacro)
+			optimize (profile.repeat_modes[i], profile.repeat_counts[i], begin, end, items);
+		else
+			items.insert (items.end (), begin, end);
+		span.length = items.size () - span.offset;
+		savings[i].bytes_after = ::encodedSize (bind_type, span.length);
+		savings[i].time_after = ::playbackTime (bind_type, items.data () + span.offset, items.data () + items.size ());
+	}
+	profile.items.swap (items);
+}
+
+void MacroOptimizer::optimize (KeySettings::RepeatMode repeat_mode, uint16_t repeat_count,
+			       const MacroItem *begin, const MacroItem *end,
+			       std::vector<MacroItem> &macro) const
+{
+	enum KeyState: uint8_t { Released, Pressed, Unknown };
+	KeyState state[256] = {};
+	// A repeated macro starts again with the keys it left pressed, so
+	// their state at the start is not known.
+	if (repeat_mode != KeySettings::RepeatFixed || repeat_count > 1) {
+		for (const MacroItem *item = begin; item != end; ++item)
+			if (item->type == MacroItem::Key)
+				state[item->key_event.usage] = item->key_event.pressed ? Pressed : Released;
+		for (KeyState &s: state)
+			if (s == Pressed)
+				s = Unknown;
+	}
+
+	uint64_t pending_delay = 0;
+	auto flushDelay = [this, &macro, &pending_delay] () {
+		if (pending_delay == 0)
+			return;
+		uint64_t delay = std::llround (pending_delay * _delay_scale);
+		if (delay < _min_delay)
+			delay = _min_delay;
+		while (delay > 0) {
+			MacroItem item = {};
+			item.type = MacroItem::Delay;
+			item.delay = delay > MaxDelay ? MaxDelay : delay;
+			macro.push_back (item);
+			delay -= item.delay;
+		}
+		pending_delay = 0;
+	};
+	for (const MacroItem *it = begin; it != end; ++it) {
+		const MacroItem &item = *it;
+		switch (item.type) {
+		case MacroItem::Delay:
+			pending_delay += item.delay;
+			break;
+
+		case MacroItem::Key: {
+			KeyState &s = state[item.key_event.usage];
+			KeyState next = item.key_event.pressed ? Pressed : Released;
+			if (s == next)
+				break;
+			s = next;
+			flushDelay ();
+			macro.push_back (item);
+			break;
+		}
+
+		default:
+			// Unknown items are kept as they are
+			flushDelay ();
+			macro.push_back (item);
+			break;
+		}
+	}
+	flushDelay ();
+}
@@ -0,0 +1,63 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef MACRO_OPTIMIZER_H
+#define MACRO_OPTIMIZER_H
+
+#include "CorsairDevice.h"
+#include "FlatProfile.h"
+
+/*
+ * Rewrites macros so they take less room on the device and play faster
+ * without changing what they type: consecutive delays are merged (split
+ * again at the 16 bits limit), zero delays are dropped and so are events
+ * that do not change the state of their key (pressing a key already held,
+ * releasing a key that is not). Delays may also be scaled, each resulting
+ * delay being at least the floor.
+ */
+class MacroOptimizer
+{
+public:
+	struct Savings {
+		std::size_t bytes_before, bytes_after;
+		// Sum of the delays for one play of the macro, in milliseconds
+		uint64_t time_before, time_after;
+	};
+
+	MacroOptimizer (double delay_scale = 1.0, unsigned int min_delay = 0);
+
+	// Keys that are not bound to a macro are left untouched
+	Savings optimize (CorsairDevice::KeySettings &key) const;
+	// Optimize every key of profile, savings gets one entry per key
+	void optimize (FlatProfile &profile, std::vector<Savings> &savings) const;
+
+	// Size of the macro data of key once encoded
+	static std::size_t encodedSize (const CorsairDevice::KeySettings &key);
+	static uint64_t playbackTime (const CorsairDevice::KeySettings &key);
+
+private:
+	// Append the optimized items of a macro to macro
+	void optimize (CorsairDevice::KeySettings::RepeatMode repeat_mode, uint16_t repeat_count,
+		       const CorsairDevice::MacroItem *begin, const CorsairDevice::MacroItem *end,
+		       std::vector<CorsairDevice::MacroItem> &macro) const;
+
+	double _delay_scale;
+	unsigned int _min_delay;
+};
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "ReliableTransport.h"
+
+#include "Trace.h"
+
+#include <algorithm>
+#include <climits>
+
+constexpr unsigned int MaxBackoff = 1000000;
+
+TransferPolicy &TransferPolicy::defaults ()
+{
+	static TransferPolicy policy = { 2000, 0, 2, 10000 };
+	return policy;
+}
+
+ReliableTransport::ReliableTransport (UsbTransport *transport,
+				      const TransferPolicy &policy,
+				      Cancellation &cancel):
+	_transport (transport),
+	_policy (policy),
+	_cancel (cancel),
+	_deadline (0),
+	_random (std::random_device () ())
+{
+}
+
+int ReliableTransport::controlTransfer (uint8_t request_type, uint8_t request,
+					uint16_t value, uint16_t index,
+					uint8_t *data, uint16_t length,
+					unsigned int timeout)
+{
+	for (unsigned int attempt = 0; ; ++attempt) {
+		int limit = transferTimeout (timeout);
+		if (limit < 0)
+			return limit;
+		int ret = _transport->controlTransfer (request_type, request, value, index,
+						       data, length, limit);
+		bool stalled = ret == LIBUSB_ERROR_PIPE;
+		if (ret >= 0 || !(transient (ret) || stalled) ||
+		    attempt == _policy.retries || _cancel.cancelled ())
+			return ret;
+
+		Trace::Span span ("retry", "usb");
+		span.arg ("error", libusb_error_name (ret));
+		unsigned int delay = backoff (attempt);
+		if (_deadline && clock ().now () + delay >= _deadline)
+			return ret;
+		clock ().sleep (delay);
+		if (stalled) {
+			Trace::Span span ("reset", "usb");
+			if (0 != _transport->reset ())
+				return ret;
+		}
+	}
+}
+
+Clock &ReliableTransport::clock ()
+{
+	return _transport->clock ();
+}
+
+libusb_device_handle *ReliableTransport::handle ()
+{
+	return _transport->handle ();
+}
+
+int ReliableTransport::reset ()
+{
+	return _transport->reset ();
+}
+
+void ReliableTransport::startDeadline ()
+{
+	if (_policy.deadline)
+		_deadline = clock ().now () + uint64_t (_policy.deadline) * 1000;
+}
+
+void ReliableTransport::clearDeadline ()
+{
+	_deadline = 0;
+}
+
+int ReliableTransport::transferTimeout (unsigned int timeout)
+{
+	if (_cancel.cancelled ())
+		return LIBUSB_ERROR_INTERRUPTED;
+	if (timeout == 0)
+		timeout = _policy.timeout;
+	if (_deadline) {
+		uint64_t now = clock ().now ();
+		if (now >= _deadline)
+			return LIBUSB_ERROR_TIMEOUT;
+		unsigned int left = (_deadline - now + 999) / 1000;
+		if (timeout == 0 || left < timeout)
+			timeout = left;
+	}
+	return std::min<unsigned int> (timeout, INT_MAX);
+}
+
+bool ReliableTransport::transient (int error)
+{
+	switch (error) {
+	case LIBUSB_ERROR_TIMEOUT:
+	case LIBUSB_ERROR_IO:
+	case LIBUSB_ERROR_BUSY:
+	case LIBUSB_ERROR_INTERRUPTED:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Random delay between half and all of the exponential backoff, so
+// devices failing together do not retry in step
+unsigned int ReliableTransport::backoff (unsigned int attempt)
+{
+	unsigned int delay = std::min<uint64_t> (MaxBackoff, uint64_t (_policy.backoff) << std::min (attempt, 20u));
+	std::uniform_int_distribution<unsigned int> jitter (delay / 2, delay);
+	return jitter (_random);
+}
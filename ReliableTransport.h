@@ -0,0 +1,85 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef RELIABLE_TRANSPORT_H
+#define RELIABLE_TRANSPORT_H
+
+#include "UsbTransport.h"
+
+#include <memory>
+#include <random>
+
+/*
+ * Bounds on the transfers made to a device. A transfer asked with no
+ * timeout gets timeout milliseconds, and no transfer goes past the
+ * deadline, in milliseconds from the last startDeadline (one per
+ * command). Zero means no limit for both.
+ *
+ * Transfers failing with a transient error are made again at most
+ * retries times, after a delay starting at backoff microseconds and
+ * doubling with each attempt.
+ */
+struct TransferPolicy
+{
+	unsigned int timeout;
+	unsigned int deadline;
+	unsigned int retries;
+	unsigned int backoff;
+
+	// Policy of the device transports, settable from the command line
+	static TransferPolicy &defaults ();
+};
+
+/*
+ * Transport applying a transfer policy to another one. Timeouts, I/O
+ * errors and busy devices are retried after a jittered delay, stalls
+ * after resetting the device. Transfers fail with LIBUSB_ERROR_TIMEOUT
+ * once the deadline passed and with LIBUSB_ERROR_INTERRUPTED once
+ * cancelled.
+ */
+class ReliableTransport: public UsbTransport
+{
+public:
+	ReliableTransport (UsbTransport *transport,
+			   const TransferPolicy &policy = TransferPolicy::defaults (),
+			   Cancellation &cancel = Cancellation::process ());
+
+	virtual int controlTransfer (uint8_t request_type, uint8_t request,
+				     uint16_t value, uint16_t index,
+				     uint8_t *data, uint16_t length,
+				     unsigned int timeout);
+
+	virtual Clock &clock ();
+	virtual libusb_device_handle *handle ();
+	virtual int reset ();
+	virtual void startDeadline ();
+	virtual void clearDeadline ();
+	virtual int transferTimeout (unsigned int timeout);
+
+private:
+	static bool transient (int error);
+	unsigned int backoff (unsigned int attempt);
+
+	std::unique_ptr<UsbTransport> _transport;
+	TransferPolicy _policy;
+	Cancellation &_cancel;
+	uint64_t _deadline;	// on the transport clock, 0 for none
+	std::minstd_rand _random;
+};
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "SimulatedTransport.h"
+
+#include "K40Device.h"
+#include "K90Device.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+static const SimulatedTransport::Latency K40Latency = { 1000, 8, 15000, 20 };
+static const SimulatedTransport::Latency K90Latency = { 1000, 8, 30000, 20 };
+
+// Second byte of the GetMode answer
+enum State: uint8_t {
+	StateBusy = 0x00,
+	StateReady = 0x01,
+	StateError = 0x02,
+};
+
+SimulatedTransport::SimulatedTransport (Model model):
+	_model (model),
+	_latency (model == K40 ? K40Latency : K90Latency),
+	_requests (0),
+	_mode (CorsairDevice::HardwareMode),
+	_error (false),
+	_busy_until (0),
+	_brightness (3),
+	_animation_mode (CorsairDevice::AnimOff),
+	_animation_rate (5),
+	_current_profile (1),
+	_colors { { 0xff, 0x00, 0x00 }, { 0x00, 0xff, 0x00 }, { 0x00, 0x00, 0xff } }
+{
+}
+
+int SimulatedTransport::controlTransfer (uint8_t request_type, uint8_t request,
+					 uint16_t value, uint16_t index,
+					 uint8_t *data, uint16_t length,
+					 unsigned int)
+{
+	++_requests;
+	_clock.sleep (_latency.request + _latency.per_byte * length);
+	if (request_type == CorsairDevice::RequestInType)
+		return controlIn (request, data, length);
+	else if (request_type == CorsairDevice::RequestOutType)
+		return controlOut (request, value, index, data, length);
+	else
+		return LIBUSB_ERROR_PIPE;
+}
+
+Clock &SimulatedTransport::clock ()
+{
+	return _clock;
+}
+
+SimulatedTransport::Model SimulatedTransport::model () const
+{
+	return _model;
+}
+
+const SimulatedTransport::Profile &SimulatedTransport::profile (unsigned int index) const
+{
+	if (index < 1 || index > 3)
+		throw std::invalid_argument ("Profile index must be between 1 and 3.");
+	return _profiles[index-1];
+}
+
+unsigned int SimulatedTransport::requestCount () const
+{
+	return _requests;
+}
+
+int SimulatedTransport::controlIn (uint8_t request, uint8_t *data, uint16_t length)
+{
+	std::vector<uint8_t> answer;
+	switch (request) {
+	case CorsairDevice::GetMode: {
+		uint8_t state;
+		if (_clock.now () < _busy_until)
+			state = StateBusy;
+		else if (_error)
+			state = StateError;
+		else
+			state = StateReady;
+		answer = { _mode, state };
+		break;
+	}
+
+	case CorsairDevice::Status:
+		answer = status ();
+		break;
+
+	default:
+		return LIBUSB_ERROR_PIPE;
+	}
+	std::size_t size = std::min<std::size_t> (length, answer.size ());
+	memcpy (data, answer.data (), size);
+	return size;
+}
+
+int SimulatedTransport::controlOut (uint8_t request, uint16_t value, uint16_t index,
+				    const uint8_t *data, uint16_t length)
+{
+	switch (request) {
+	case CorsairDevice::SetMode:
+		_mode = value;
+		return 0;
+
+	case CorsairDevice::SetCurrentProfile:
+		if (value < 1 || value > 3)
+			return LIBUSB_ERROR_PIPE;
+		_current_profile = value;
+		return 0;
+
+	case CorsairDevice::MacroBindings:
+	case CorsairDevice::MacroData:
+	case CorsairDevice::MacroKeys:
+		return macroPacket (request, index, data, length);
+	}
+
+	if (_model == K40) {
+		switch (request) {
+		case K40Device::SetBacklightBrightness:
+			_brightness = value >> 8;
+			return 0;
+
+		case K40Device::SetBacklightColor: {
+			unsigned int profile = index >> 8;
+			if (profile > 3)
+				return LIBUSB_ERROR_PIPE;
+			if (profile == 0)
+				profile = _current_profile;
+			_colors[profile-1] = {
+				static_cast<uint8_t> (value & 0xFF),
+				static_cast<uint8_t> (value >> 8),
+				static_cast<uint8_t> (index & 0xFF)
+			};
+			return 0;
+		}
+
+		case K40Device::SetBacklightAnimation:
+			_animation_mode = index;
+			return 0;
+
+		case K40Device::SetAnimationRate:
+			_animation_rate = value >> 8;
+			return 0;
+
+		case K40Device::SetBacklightColorMode:
+		case K40Device::DoCycleAnimation:
+			return 0;
+		}
+	}
+	else {
+		switch (request) {
+		case K90Device::SetBacklightBrightness:
+			_brightness = value;
+			return 0;
+		}
+	}
+	return LIBUSB_ERROR_PIPE;
+}
+
+int SimulatedTransport::macroPacket (uint8_t request, uint16_t index,
+				     const uint8_t *data, uint16_t length)
+{
+	if (index < 1 || index > 3)
+		return LIBUSB_ERROR_PIPE;
+	if (_clock.now () < _busy_until) {
+		// Still processing the previous packet
+		_error = true;
+		return length;
+	}
+	_error = false;
+	_busy_until = _clock.now () + _latency.macro_busy + _latency.macro_busy_per_byte * length;
+
+	Profile &profile = _profiles[index-1];
+	std::vector<uint8_t> *blob;
+	switch (request) {
+	case CorsairDevice::MacroBindings:
+		blob = &profile.bindings;
+		break;
+	case CorsairDevice::MacroData:
+		blob = &profile.data;
+		break;
+	default:
+		blob = &profile.keys;
+		break;
+	}
+	blob->assign (data, data + length);
+	return length;
+}
+
+std::vector<uint8_t> SimulatedTransport::status () const
+{
+	if (_model == K40) {
+		K40Device::K40Status status = {};
+		status.backlight_brightness = _brightness;
+		status.animation_rate = _animation_rate;
+		status.animation_mode = _animation_mode;
+		status.color = _colors[_current_profile-1];
+		status.current_profile = _current_profile;
+		const uint8_t *raw = reinterpret_cast<const uint8_t *> (&status);
+		return std::vector<uint8_t> (raw, raw + sizeof (status));
+	}
+	else {
+		K90Device::K90Status status = {};
+		status.backlight_brightness = _brightness;
+		status.current_profile = _current_profile;
+		const uint8_t *raw = reinterpret_cast<const uint8_t *> (&status);
+		return std::vector<uint8_t> (raw, raw + sizeof (status));
+	}
+}
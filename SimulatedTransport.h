@@ -0,0 +1,91 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SIMULATED_TRANSPORT_H
+#define SIMULATED_TRANSPORT_H
+
+#include "CorsairDevice.h"
+#include "UsbTransport.h"
+
+#include <vector>
+
+/*
+ * In-process model of the K40 and K90 firmwares answering the requests
+ * used by this tool. Every request takes a realistic time on a virtual
+ * clock, and macro packets keep the device busy for a while: a packet
+ * received while busy is rejected and sets the error state reported by
+ * GetMode until a packet is accepted.
+ */
+class SimulatedTransport: public UsbTransport
+{
+public:
+	enum Model {
+		K40,
+		K90,
+	};
+
+	// Times in microseconds
+	struct Latency {
+		unsigned int request;		// any control request
+		unsigned int per_byte;		// added for each data byte
+		unsigned int macro_busy;	// busy time after a macro packet
+		unsigned int macro_busy_per_byte;
+	};
+
+	struct Profile {
+		std::vector<uint8_t> bindings, data, keys;
+	};
+
+	SimulatedTransport (Model model);
+
+	virtual int controlTransfer (uint8_t request_type, uint8_t request,
+				     uint16_t value, uint16_t index,
+				     uint8_t *data, uint16_t length,
+				     unsigned int timeout);
+
+	virtual Clock &clock ();
+
+	Model model () const;
+	const Profile &profile (unsigned int index) const;
+	unsigned int requestCount () const;
+
+private:
+	int controlIn (uint8_t request, uint8_t *data, uint16_t length);
+	int controlOut (uint8_t request, uint16_t value, uint16_t index,
+			const uint8_t *data, uint16_t length);
+	int macroPacket (uint8_t request, uint16_t index,
+			 const uint8_t *data, uint16_t length);
+	std::vector<uint8_t> status () const;
+
+	Model _model;
+	Latency _latency;
+	VirtualClock _clock;
+	unsigned int _requests;
+
+	uint8_t _mode;
+	bool _error;
+	uint64_t _busy_until;
+
+	uint8_t _brightness;
+	uint8_t _animation_mode, _animation_rate;
+	uint8_t _current_profile;
+	Color _colors[3];
+	Profile _profiles[3];
+};
+
+#endif
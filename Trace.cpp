@@ -0,0 +1,273 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "Trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+extern "C" {
+#include <unistd.h>
+}
+
+bool Trace::_enabled = false;
+
+namespace
+{
+struct Event {
+	std::string name;
+	const char *category;
+	uint64_t start, duration;
+	unsigned int thread;
+	std::string args;
+};
+
+std::mutex events_mutex;
+std::vector<Event> events;
+std::chrono::steady_clock::time_point origin;
+
+// Small thread numbers, in the order threads record their first span
+unsigned int threadNumber ()
+{
+	static std::atomic<unsigned int> next (0);
+	thread_local unsigned int number = ++next;
+	return number;
+}
+
+void appendEscaped (std::string &out, const std::string &text)
+{
+	for (char c: text) {
+		switch (c) {
+		case '"':
+			out += "\\\"";
+			break;
+		case '\\':
+			out += "\\\\";
+			break;
+		case '\n':
+			out += "\\n";
+			break;
+		default:
+			if (static_cast<unsigned char> (c) < 0x20) {
+				char escaped[8];
+				snprintf (escaped, sizeof (escaped), "\\u%04x", c);
+				out += escaped;
+			}
+			else
+				out += c;
+		}
+	}
+}
+}
+
+void Trace::enable ()
+{
+	if (_enabled)
+		return;
+	origin = std::chrono::steady_clock::now ();
+	_enabled = true;
+}
+
+uint64_t Trace::now ()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds> (
+			std::chrono::steady_clock::now () - origin).count ();
+}
+
+void Trace::complete (const std::string &name, const char *category,
+		      uint64_t start, const std::string &args)
+{
+	uint64_t end = now ();
+	unsigned int thread = threadNumber ();
+	std::lock_guard<std::mutex> lock (events_mutex);
+	events.push_back ({ name, category, start, end - start, thread, args });
+}
+
+void Trace::write (const std::string &filename)
+{
+	std::string out = "{\"traceEvents\":[\n";
+	std::string pid = std::to_string (getpid ());
+	{
+		std::lock_guard<std::mutex> lock (events_mutex);
+		for (std::size_t i = 0; i < events.size (); ++i) {
+			const Event &event = events[i];
+			out += "{\"name\":\"";
+			appendEscaped (out, event.name);
+			out += "\",\"cat\":\"";
+			out += event.category;
+			out += "\",\"ph\":\"X\",\"ts\":" + std::to_string (event.start) +
+			       ",\"dur\":" + std::to_string (event.duration) +
+			       ",\"pid\":" + pid +
+			       ",\"tid\":" + std::to_string (event.thread) +
+			       ",\"args\":{" + event.args + "}}";
+			out += i + 1 < events.size () ? ",\n" : "\n";
+		}
+	}
+	out += "],\"displayTimeUnit\":\"ms\"}\n";
+
+	FILE *file = fopen (filename.c_str (), "w");
+	if (!file)
+		throw std::runtime_error (filename + ": " + strerror (errno));
+	bool ok = fwrite (out.data (), 1, out.size (), file) == out.size ();
+	if (fclose (file) != 0)
+		ok = false;
+	if (!ok)
+		throw std::runtime_error (filename + ": " + strerror (errno));
+}
+
+void Trace::printSummary (FILE *stream)
+{
+	struct Phase {
+		std::string name;
+		unsigned int count;
+		uint64_t total, longest;
+	};
+	// In the order phases first appear
+	std::vector<Phase> phases;
+	{
+		std::lock_guard<std::mutex> lock (events_mutex);
+		std::vector<const Event *> sorted;
+		for (const Event &event: events)
+			sorted.push_back (&event);
+		std::stable_sort (sorted.begin (), sorted.end (), [] (const Event *a, const Event *b) {
+			return a->start < b->start;
+		});
+		for (const Event *event: sorted) {
+			auto it = std::find_if (phases.begin (), phases.end (), [event] (const Phase &phase) {
+				return phase.name == event->name;
+			});
+			if (it == phases.end ())
+				phases.push_back ({ event->name, 1, event->duration, event->duration });
+			else {
+				++it->count;
+				it->total += event->duration;
+				it->longest = std::max (it->longest, event->duration);
+			}
+		}
+	}
+	fprintf (stream, "%-24s %6s %11s %11s\n", "phase", "count", "total ms", "max ms");
+	for (const Phase &phase: phases)
+		fprintf (stream, "%-24s %6u %11.3f %11.3f\n", phase.name.c_str (), phase.count,
+			 phase.total / 1e3, phase.longest / 1e3);
+	fprintf (stream, "%-24s %6s %11.3f\n", "wall", "", now () / 1e3);
+}
+
+void Trace::Span::begin (const char *name, const char *category)
+{
+	_name = name;
+	_category = category;
+	_start = now ();
+}
+
+void Trace::Span::end ()
+{
+	complete (_name, _category, _start, _args);
+}
+
+void Trace::Span::arg (const char *key, long long value)
+{
+	if (!_active)
+		return;
+	if (!_args.empty ())
+		_args += ",";
+	_args += "\"" + std::string (key) + "\":" + std::to_string (value);
+}
+
+void Trace::Span::arg (const char *key, const std::string &value)
+{
+	if (!_active)
+		return;
+	if (!_args.empty ())
+		_args += ",";
+	_args += "\"" + std::string (key) + "\":\"";
+	appendEscaped (_args, value);
+	_args += "\"";
+}
+
+TracingTransport::TracingTransport (UsbTransport *transport):
+	_transport (transport)
+{
+}
+
+TracingTransport::~TracingTransport ()
+{
+	delete _transport;
+}
+
+int TracingTransport::controlTransfer (uint8_t request_type, uint8_t request,
+				       uint16_t value, uint16_t index,
+				       uint8_t *data, uint16_t length,
+				       unsigned int timeout)
+{
+	uint64_t start = Trace::now ();
+	int ret = _transport->controlTransfer (request_type, request, value, index,
+					       data, length, timeout);
+	Trace::complete (spanName (request_type, request), "usb", start,
+			 spanArgs (request_type, request, value, index, length, ret));
+	return ret;
+}
+
+Clock &TracingTransport::clock ()
+{
+	return _transport->clock ();
+}
+
+libusb_device_handle *TracingTransport::handle ()
+{
+	return _transport->handle ();
+}
+
+void TracingTransport::startDeadline ()
+{
+	_transport->startDeadline ();
+}
+
+void TracingTransport::clearDeadline ()
+{
+	_transport->clearDeadline ();
+}
+
+int TracingTransport::transferTimeout (unsigned int timeout)
+{
+	return _transport->transferTimeout (timeout);
+}
+
+std::string TracingTransport::spanName (uint8_t request_type, uint8_t request)
+{
+	char name[32];
+	snprintf (name, sizeof (name), "transfer %s 0x%02hhx",
+		  (request_type & LIBUSB_ENDPOINT_IN) ? "in" : "out", request);
+	return name;
+}
+
+std::string TracingTransport::spanArgs (uint8_t request_type, uint8_t request,
+					uint16_t value, uint16_t index,
+					uint16_t length, int result)
+{
+	char args[160];
+	snprintf (args, sizeof (args),
+		  "\"request_type\":%u,\"request\":%u,\"value\":%u,\"index\":%u,\"length\":%u,\"result\":%d",
+		  request_type, request, value, index, length, result);
+	return args;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "UsbTransport.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+/*
+ * Spans of time spent in each phase of a run (libusb initialization,
+ * device lookup, parsing, transfers, sleeps...), written in the Chrome
+ * trace event format or summed per phase. Recording is off unless
+ * enabled, a span then costs a single test.
+ */
+class Trace
+{
+public:
+	static bool enabled ()
+	{
+		return _enabled;
+	}
+	static void enable ();
+
+	// Real time in microseconds since tracing was enabled
+	static uint64_t now ();
+
+	// Record a span from start (as returned by now) to now. args is
+	// the content of a JSON object, possibly empty.
+	static void complete (const std::string &name, const char *category,
+			      uint64_t start, const std::string &args = std::string ());
+
+	// Throws std::runtime_error if the file cannot be written
+	static void write (const std::string &filename);
+	// Count, total and longest duration of each span name
+	static void printSummary (FILE *stream);
+
+	class Span
+	{
+	public:
+		Span (const char *name, const char *category):
+			_active (_enabled)
+		{
+			if (_active)
+				begin (name, category);
+		}
+		~Span ()
+		{
+			if (_active)
+				end ();
+		}
+
+		bool active () const
+		{
+			return _active;
+		}
+		void arg (const char *key, long long value);
+		void arg (const char *key, const std::string &value);
+
+	private:
+		void begin (const char *name, const char *category);
+		void end ();
+
+		bool _active;
+		uint64_t _start;
+		std::string _name;
+		const char *_category;
+		std::string _args;
+	};
+
+private:
+	static bool _enabled;
+};
+
+/*
+ * Transport recording a span for every transfer made through another
+ * transport. It is only inserted while tracing.
+ */
+class TracingTransport: public UsbTransport
+{
+public:
+	TracingTransport (UsbTransport *transport);
+	virtual ~TracingTransport ();
+
+	virtual int controlTransfer (uint8_t request_type, uint8_t request,
+				     uint16_t value, uint16_t index,
+				     uint8_t *data, uint16_t length,
+				     unsigned int timeout);
+
+	virtual Clock &clock ();
+	virtual libusb_device_handle *handle ();
+	virtual void startDeadline ();
+	virtual void clearDeadline ();
+	virtual int transferTimeout (unsigned int timeout);
+
+	// "transfer in 0x04", as named in traces
+	static std::string spanName (uint8_t request_type, uint8_t request);
+	static std::string spanArgs (uint8_t request_type, uint8_t request,
+				     uint16_t value, uint16_t index,
+				     uint16_t length, int result);
+
+private:
+	UsbTransport *_transport;
+};
+
+#endif
@@ -0,0 +1,235 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "TransferLog.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <system_error>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+}
+
+static constexpr char Magic[3] = { 'C', 'U', 'L' };
+static constexpr std::size_t FlushSize = 64*1024;
+
+RecordingTransport::RecordingTransport (const std::string &filename, uint16_t product_id,
+					UsbTransport *transport):
+	_transport (transport)
+{
+	_fd = open (filename.c_str (), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+	if (_fd == -1)
+		throw std::system_error (errno, std::system_category (), filename);
+	_start = _transport->clock ().now ();
+	_buffer.reserve (FlushSize);
+
+	TransferLog::Session session = { TransferLog::SessionTag, {},
+					 TransferLog::Version, product_id };
+	memcpy (session.magic, Magic, sizeof (Magic));
+	append (&session, sizeof (session));
+}
+
+RecordingTransport::~RecordingTransport ()
+{
+	flush ();
+	close (_fd);
+}
+
+int RecordingTransport::controlTransfer (uint8_t request_type, uint8_t request,
+					 uint16_t value, uint16_t index,
+					 uint8_t *data, uint16_t length,
+					 unsigned int timeout)
+{
+	uint64_t start = _transport->clock ().now ();
+	int ret = _transport->controlTransfer (request_type, request, value, index,
+					       data, length, timeout);
+	uint64_t end = _transport->clock ().now ();
+
+	uint16_t payload_size;
+	if (request_type & LIBUSB_ENDPOINT_IN)
+		payload_size = ret > 0 ? ret : 0;
+	else
+		payload_size = length;
+	TransferLog::Transfer transfer = {
+		TransferLog::TransferTag, request_type, request, value, index, length,
+		ret, static_cast<uint32_t> (start - _start), static_cast<uint32_t> (end - start),
+		payload_size
+	};
+	append (&transfer, sizeof (transfer));
+	append (data, payload_size);
+	return ret;
+}
+
+Clock &RecordingTransport::clock ()
+{
+	return _transport->clock ();
+}
+
+void RecordingTransport::startDeadline ()
+{
+	_transport->startDeadline ();
+}
+
+void RecordingTransport::clearDeadline ()
+{
+	_transport->clearDeadline ();
+}
+
+void RecordingTransport::append (const void *data, std::size_t size)
+{
+	const uint8_t *bytes = static_cast<const uint8_t *> (data);
+	_buffer.insert (_buffer.end (), bytes, bytes + size);
+	if (_buffer.size () >= FlushSize)
+		flush ();
+}
+
+void RecordingTransport::flush ()
+{
+	std::size_t written = 0;
+	while (written < _buffer.size ()) {
+		ssize_t ret = write (_fd, _buffer.data () + written, _buffer.size () - written);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		written += ret;
+	}
+	_buffer.clear ();
+}
+
+ReplayTransport::ReplayTransport (const std::string &filename, unsigned int session_index):
+	_product_id (0),
+	_next (0),
+	_mismatches (0)
+{
+	std::ifstream file (filename, std::ifstream::in | std::ifstream::binary);
+	if (!file)
+		throw std::runtime_error ("Cannot open transfer log " + filename);
+	std::vector<uint8_t> log ((std::istreambuf_iterator<char> (file)),
+				  std::istreambuf_iterator<char> ());
+
+	unsigned int sessions = 0;
+	bool selected = false;
+	std::size_t pos = 0;
+	while (pos < log.size ()) {
+		switch (log[pos]) {
+		case TransferLog::SessionTag: {
+			TransferLog::Session session;
+			if (pos + sizeof (session) > log.size ())
+				throw std::runtime_error ("Truncated transfer log");
+			memcpy (&session, &log[pos], sizeof (session));
+			if (memcmp (session.magic, Magic, sizeof (Magic)) != 0 ||
+			    session.version != TransferLog::Version)
+				throw std::runtime_error ("Invalid transfer log");
+			++sessions;
+			selected = session_index == 0 || session_index == sessions;
+			if (selected) {
+				_product_id = session.product_id;
+				_entries.clear ();
+			}
+			pos += sizeof (session);
+			break;
+		}
+
+		case TransferLog::TransferTag: {
+			Entry entry;
+			if (pos + sizeof (entry.transfer) > log.size ())
+				throw std::runtime_error ("Truncated transfer log");
+			memcpy (&entry.transfer, &log[pos], sizeof (entry.transfer));
+			pos += sizeof (entry.transfer);
+			if (pos + entry.transfer.payload_size > log.size ())
+				throw std::runtime_error ("Truncated transfer log");
+			entry.payload.assign (&log[pos], &log[pos] + entry.transfer.payload_size);
+			pos += entry.transfer.payload_size;
+			if (sessions == 0)
+				throw std::runtime_error ("Invalid transfer log");
+			if (selected)
+				_entries.push_back (std::move (entry));
+			break;
+		}
+
+		default:
+			throw std::runtime_error ("Invalid transfer log");
+		}
+	}
+	if (sessions == 0)
+		throw std::runtime_error ("Empty transfer log");
+	if (session_index > sessions)
+		throw std::runtime_error ("Transfer log has " + std::to_string (sessions) + " sessions");
+}
+
+int ReplayTransport::controlTransfer (uint8_t request_type, uint8_t request,
+				      uint16_t value, uint16_t index,
+				      uint8_t *data, uint16_t length,
+				      unsigned int)
+{
+	if (_next >= _entries.size ()) {
+		fprintf (stderr, "Replay: unexpected transfer %u (request %d)\n",
+			 _next, request);
+		++_mismatches;
+		return LIBUSB_ERROR_OTHER;
+	}
+	const Entry &entry = _entries[_next];
+	const TransferLog::Transfer &t = entry.transfer;
+	bool out = !(request_type & LIBUSB_ENDPOINT_IN);
+	if (t.request_type != request_type || t.request != request ||
+	    t.value != value || t.index != index || t.length != length ||
+	    (out && memcmp (entry.payload.data (), data, length) != 0)) {
+		fprintf (stderr, "Replay: transfer %u differs: expected request %d (%04hx, %04hx, %hu bytes), got request %d (%04hx, %04hx, %hu bytes)\n",
+			 _next, t.request, t.value, t.index, t.length,
+			 request, value, index, length);
+		++_mismatches;
+		return LIBUSB_ERROR_OTHER;
+	}
+	++_next;
+	if (!out)
+		memcpy (data, entry.payload.data (), entry.payload.size ());
+	_clock.sleep (t.duration);
+	return t.result;
+}
+
+Clock &ReplayTransport::clock ()
+{
+	return _clock;
+}
+
+uint16_t ReplayTransport::productId () const
+{
+	return _product_id;
+}
+
+unsigned int ReplayTransport::transferCount () const
+{
+	return _entries.size ();
+}
+
+unsigned int ReplayTransport::replayedCount () const
+{
+	return _next;
+}
+
+unsigned int ReplayTransport::mismatchCount () const
+{
+	return _mismatches;
+}
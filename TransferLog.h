@@ -0,0 +1,128 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef TRANSFER_LOG_H
+#define TRANSFER_LOG_H
+
+#include "UsbTransport.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * Binary log of control transfers. A log is a sequence of sessions, one
+ * per recording run, each made of a session entry followed by transfer
+ * entries. Values are stored in host byte order.
+ */
+namespace TransferLog
+{
+enum Tag: uint8_t {
+	SessionTag = 'S',
+	TransferTag = 'T',
+};
+
+constexpr uint16_t Version = 1;
+
+struct Session {
+	uint8_t tag;
+	char magic[3];		// "CUL"
+	uint16_t version;
+	uint16_t product_id;
+} __attribute__ ((packed));
+
+struct Transfer {
+	uint8_t tag;
+	uint8_t request_type;
+	uint8_t request;
+	uint16_t value;
+	uint16_t index;
+	uint16_t length;
+	int32_t result;
+	uint32_t start;		// microseconds since the session started
+	uint32_t duration;	// microseconds
+	uint16_t payload_size;	// sent or received data following the entry
+} __attribute__ ((packed));
+}
+
+/*
+ * Transport logging every transfer made through another transport.
+ * Entries are buffered and appended to the file in large writes.
+ */
+class RecordingTransport: public UsbTransport
+{
+public:
+	RecordingTransport (const std::string &filename, uint16_t product_id,
+			    UsbTransport *transport);
+	virtual ~RecordingTransport ();
+
+	virtual int controlTransfer (uint8_t request_type, uint8_t request,
+				     uint16_t value, uint16_t index,
+				     uint8_t *data, uint16_t length,
+				     unsigned int timeout);
+
+	virtual Clock &clock ();
+	virtual void startDeadline ();
+	virtual void clearDeadline ();
+
+private:
+	void append (const void *data, std::size_t size);
+	void flush ();
+
+	std::unique_ptr<UsbTransport> _transport;
+	int _fd;
+	uint64_t _start;
+	std::vector<uint8_t> _buffer;
+};
+
+/*
+ * Transport answering from one session of a log, the last one unless
+ * session (counted from 1) is given. Requests are checked against the
+ * logged ones in order, and time only passes on a virtual clock.
+ */
+class ReplayTransport: public UsbTransport
+{
+public:
+	ReplayTransport (const std::string &filename, unsigned int session = 0);
+
+	virtual int controlTransfer (uint8_t request_type, uint8_t request,
+				     uint16_t value, uint16_t index,
+				     uint8_t *data, uint16_t length,
+				     unsigned int timeout);
+
+	virtual Clock &clock ();
+
+	uint16_t productId () const;
+	unsigned int transferCount () const;
+	unsigned int replayedCount () const;
+	unsigned int mismatchCount () const;
+
+private:
+	struct Entry {
+		TransferLog::Transfer transfer;
+		std::vector<uint8_t> payload;
+	};
+
+	VirtualClock _clock;
+	uint16_t _product_id;
+	std::vector<Entry> _entries;
+	unsigned int _next;
+	unsigned int _mismatches;
+};
+
+#endif
@@ -0,0 +1,378 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "UsbEventLoop.h"
+
+#include "ReliableTransport.h"
+#include "Trace.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <tuple>
+
+extern "C" {
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+}
+
+struct UsbEventLoop::Transfer
+{
+	UsbEventLoop *loop;
+	TransferCallback callback;
+	uint64_t trace_start;
+};
+
+UsbEventLoop::UsbEventLoop (libusb_context *context, Clock &clock):
+	_context (context),
+	_clock (clock),
+	_transfers (0)
+{
+	_timerfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (_timerfd == -1)
+		throw std::system_error (errno, std::system_category ());
+	_donefd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_donefd == -1) {
+		int error = errno;
+		close (_timerfd);
+		throw std::system_error (error, std::system_category ());
+	}
+}
+
+UsbEventLoop::~UsbEventLoop ()
+{
+	for (auto &done: _done) {
+		delete static_cast<Transfer *> (done.first->user_data);
+		libusb_free_transfer (done.first);
+	}
+	close (_timerfd);
+	close (_donefd);
+}
+
+void UsbEventLoop::controlTransfer (UsbTransport &transport,
+				    uint8_t request_type, uint8_t request,
+				    uint16_t value, uint16_t index,
+				    const uint8_t *data, uint16_t length,
+				    unsigned int timeout, TransferCallback callback)
+{
+	int ret;
+	libusb_device_handle *dev = transport.handle ();
+	if (!dev) {
+		std::shared_ptr<std::vector<uint8_t>> buffer (
+				new std::vector<uint8_t> (data, data + length));
+		ret = transport.controlTransfer (request_type, request, value, index,
+						 buffer->data (), length, timeout);
+		addTimer (0, [buffer, ret, callback] () { callback (ret, buffer->data ()); });
+		return;
+	}
+	// The transport policy is bypassed, keep its deadline and cancellation
+	int limit = transport.transferTimeout (timeout);
+	if (limit < 0) {
+		addTimer (0, [limit, callback] () { callback (limit, nullptr); });
+		return;
+	}
+	timeout = limit;
+	if (timeout == 0)
+		timeout = TransferPolicy::defaults ().timeout;
+	libusb_transfer *transfer = libusb_alloc_transfer (0);
+	if (!transfer)
+		throw std::bad_alloc ();
+	// Freed by libusb with the transfer (LIBUSB_TRANSFER_FREE_BUFFER)
+	uint8_t *buffer = static_cast<uint8_t *> (malloc (LIBUSB_CONTROL_SETUP_SIZE + length));
+	if (!buffer) {
+		libusb_free_transfer (transfer);
+		throw std::bad_alloc ();
+	}
+	libusb_fill_control_setup (buffer, request_type, request, value, index, length);
+	if (!(request_type & LIBUSB_ENDPOINT_IN) && length > 0)
+		memcpy (buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+	libusb_fill_control_transfer (transfer, dev, buffer, &UsbEventLoop::transferDone,
+				      new Transfer { this, callback, Trace::enabled () ? Trace::now () : 0 }, timeout);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	if (0 != (ret = libusb_submit_transfer (transfer))) {
+		delete static_cast<Transfer *> (transfer->user_data);
+		libusb_free_transfer (transfer);
+		throw std::runtime_error (libusb_error_name (ret));
+	}
+	++_transfers;
+}
+
+// Runs in the thread handling the libusb events, possibly not the one
+// of the loop
+void UsbEventLoop::transferDone (libusb_transfer *transfer)
+{
+	Transfer *t = static_cast<Transfer *> (transfer->user_data);
+	int result = LibusbTransport::result (transfer);
+	if (Trace::enabled ()) {
+		const libusb_control_setup *setup = libusb_control_transfer_get_setup (transfer);
+		Trace::complete (TracingTransport::spanName (setup->bmRequestType, setup->bRequest),
+				 "usb", t->trace_start,
+				 TracingTransport::spanArgs (setup->bmRequestType, setup->bRequest,
+							     libusb_le16_to_cpu (setup->wValue),
+							     libusb_le16_to_cpu (setup->wIndex),
+							     libusb_le16_to_cpu (setup->wLength),
+							     result));
+	}
+	UsbEventLoop *loop = t->loop;
+	{
+		std::lock_guard<std::mutex> lock (loop->_done_mutex);
+		loop->_done.emplace_back (transfer, result);
+	}
+	uint64_t one = 1;
+	while (write (loop->_donefd, &one, sizeof (one)) == -1 && errno == EINTR)
+		;
+}
+
+// Run the callbacks of the transfers queued by transferDone
+void UsbEventLoop::completeTransfers ()
+{
+	uint64_t count;
+	while (read (_donefd, &count, sizeof (count)) > 0)
+		;
+	for (;;) {
+		libusb_transfer *transfer;
+		int result;
+		{
+			std::lock_guard<std::mutex> lock (_done_mutex);
+			if (_done.empty ())
+				break;
+			std::tie (transfer, result) = _done.front ();
+			_done.pop_front ();
+		}
+		std::unique_ptr<Transfer> t (static_cast<Transfer *> (transfer->user_data));
+		--_transfers;
+		uint8_t *data = libusb_control_transfer_get_data (transfer);
+		try {
+			t->callback (result, data);
+		}
+		catch (...) {
+			libusb_free_transfer (transfer);
+			throw;
+		}
+		libusb_free_transfer (transfer);
+	}
+}
+
+void UsbEventLoop::addTimer (unsigned int delay, TimerCallback callback)
+{
+	_timers.emplace (_clock.now () + delay, callback);
+	armTimer ();
+}
+
+void UsbEventLoop::armTimer ()
+{
+	itimerspec spec = {};
+	if (!_timers.empty ()) {
+		uint64_t now = _clock.now ();
+		uint64_t deadline = _timers.begin ()->first;
+		uint64_t delay = deadline > now ? deadline - now : 0;
+		spec.it_value.tv_sec = delay / 1000000;
+		spec.it_value.tv_nsec = (delay % 1000000) * 1000;
+		// A zero value would disarm the timer
+		if (delay == 0)
+			spec.it_value.tv_nsec = 1;
+	}
+	timerfd_settime (_timerfd, 0, &spec, nullptr);
+}
+
+bool UsbEventLoop::pending () const
+{
+	return _transfers > 0 || !_timers.empty ();
+}
+
+void UsbEventLoop::run ()
+{
+	while (pending ()) {
+		if (_transfers == 0) {
+			// Only timers are left, let the clock wait for them
+			uint64_t now = _clock.now ();
+			uint64_t deadline = _timers.begin ()->first;
+			if (deadline > now)
+				_clock.sleep (deadline - now);
+			dispatch ();
+			continue;
+		}
+		std::vector<pollfd> fds = pollFds ();
+		if (-1 == poll (fds.data (), fds.size (), timeout ()) && errno != EINTR)
+			throw std::system_error (errno, std::system_category ());
+		dispatch ();
+	}
+}
+
+std::vector<pollfd> UsbEventLoop::pollFds () const
+{
+	std::vector<pollfd> fds;
+	fds.push_back ({ _timerfd, POLLIN, 0 });
+	fds.push_back ({ _donefd, POLLIN, 0 });
+	const libusb_pollfd **usb_fds = libusb_get_pollfds (_context);
+	if (usb_fds) {
+		for (const libusb_pollfd **fd = usb_fds; *fd; ++fd)
+			fds.push_back ({ (*fd)->fd, (*fd)->events, 0 });
+		libusb_free_pollfds (usb_fds);
+	}
+	return fds;
+}
+
+int UsbEventLoop::timeout () const
+{
+	int ms = -1;
+	if (!libusb_pollfds_handle_timeouts (_context)) {
+		timeval tv;
+		if (1 == libusb_get_next_timeout (_context, &tv))
+			ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+	}
+	return ms;
+}
+
+void UsbEventLoop::dispatch ()
+{
+	timeval zero = { 0, 0 };
+	int ret = libusb_handle_events_timeout_completed (_context, &zero, nullptr);
+	if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+		throw std::runtime_error (libusb_error_name (ret));
+	completeTransfers ();
+
+	uint64_t expirations;
+	while (read (_timerfd, &expirations, sizeof (expirations)) > 0)
+		;
+	uint64_t now = _clock.now ();
+	while (!_timers.empty () && _timers.begin ()->first <= now) {
+		TimerCallback callback = std::move (_timers.begin ()->second);
+		_timers.erase (_timers.begin ());
+		callback ();
+	}
+	armTimer ();
+}
+
+std::shared_ptr<CommandSequence> CommandSequence::create (UsbEventLoop &loop)
+{
+	return std::shared_ptr<CommandSequence> (new CommandSequence (loop));
+}
+
+CommandSequence::CommandSequence (UsbEventLoop &loop):
+	_loop (loop)
+{
+}
+
+CommandSequence &CommandSequence::control (UsbTransport &transport,
+					   uint8_t request_type, uint8_t request,
+					   uint16_t value, uint16_t index,
+					   std::vector<uint8_t> data,
+					   ResultCallback result)
+{
+	UsbEventLoop &loop = _loop;
+	_steps.push_back ([&loop, &transport, request_type, request, value, index, data, result]
+			  (std::function<void (std::exception_ptr)> resume) {
+		loop.controlTransfer (transport, request_type, request, value, index,
+				      data.data (), data.size (), 0,
+				      [data, result, resume] (int ret, uint8_t *buffer) {
+			if (ret < 0) {
+				resume (std::make_exception_ptr (std::runtime_error (libusb_error_name (ret))));
+				return;
+			}
+			try {
+				if (result) {
+					std::vector<uint8_t> received (buffer, buffer + ret);
+					result (received);
+				}
+			}
+			catch (...) {
+				resume (std::current_exception ());
+				return;
+			}
+			resume (nullptr);
+		});
+	});
+	return *this;
+}
+
+CommandSequence &CommandSequence::sleep (unsigned int delay)
+{
+	UsbEventLoop &loop = _loop;
+	_steps.push_back ([&loop, delay] (std::function<void (std::exception_ptr)> resume) {
+		if (!Trace::enabled ()) {
+			loop.addTimer (delay, [resume] () { resume (nullptr); });
+			return;
+		}
+		uint64_t start = Trace::now ();
+		loop.addTimer (delay, [resume, start, delay] () {
+			Trace::complete ("sleep", "sleep", start, "\"usec\":" + std::to_string (delay));
+			resume (nullptr);
+		});
+	});
+	return *this;
+}
+
+CommandSequence &CommandSequence::then (std::function<void ()> step)
+{
+	_steps.push_back ([step] (std::function<void (std::exception_ptr)> resume) {
+		try {
+			step ();
+		}
+		catch (...) {
+			resume (std::current_exception ());
+			return;
+		}
+		resume (nullptr);
+	});
+	return *this;
+}
+
+void CommandSequence::start (DoneCallback done)
+{
+	_done = done;
+	next ();
+}
+
+void CommandSequence::run ()
+{
+	std::exception_ptr error;
+	start ([&error] (std::exception_ptr e) { error = e; });
+	_loop.run ();
+	if (error)
+		std::rethrow_exception (error);
+}
+
+void CommandSequence::next ()
+{
+	if (_steps.empty ()) {
+		if (_done)
+			_done (nullptr);
+		return;
+	}
+	Step step = std::move (_steps.front ());
+	_steps.pop_front ();
+	auto self = shared_from_this ();
+	auto resume = [self] (std::exception_ptr error) {
+		if (error) {
+			self->_steps.clear ();
+			if (self->_done)
+				self->_done (error);
+			return;
+		}
+		self->next ();
+	};
+	try {
+		step (resume);
+	}
+	catch (...) {
+		resume (std::current_exception ());
+	}
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USB_EVENT_LOOP_H
+#define USB_EVENT_LOOP_H
+
+#include "Clock.h"
+#include "UsbTransport.h"
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+#include <poll.h>
+}
+
+/*
+ * Single threaded event loop driving asynchronous libusb control
+ * transfers and timers. It can run on its own (run) or be embedded in
+ * another loop by polling pollFds for at most timeout milliseconds and
+ * calling dispatch afterwards.
+ *
+ * Transports without a libusb handle complete their transfers
+ * synchronously. Transfers on a handle are not retried but follow the
+ * timeout, deadline and cancellation of the transport, a refused
+ * transfer completes with the error. Timers follow the given clock so a
+ * virtual clock makes them expire without waiting.
+ *
+ * Several loops may share a libusb context from different threads: the
+ * libusb callback, run by whichever thread handles the events, only
+ * queues the completion to the loop that submitted the transfer, and the
+ * transfer callbacks always run in dispatch.
+ */
+class UsbEventLoop
+{
+public:
+	// result is the transferred length or a libusb error code, data is
+	// nullptr for a transfer refused before being submitted
+	typedef std::function<void (int result, uint8_t *data)> TransferCallback;
+	typedef std::function<void ()> TimerCallback;
+
+	UsbEventLoop (libusb_context *context, Clock &clock = Clock::system ());
+	~UsbEventLoop ();
+
+	void controlTransfer (UsbTransport &transport,
+			      uint8_t request_type, uint8_t request,
+			      uint16_t value, uint16_t index,
+			      const uint8_t *data, uint16_t length,
+			      unsigned int timeout, TransferCallback callback);
+	void addTimer (unsigned int delay, TimerCallback callback);
+
+	bool pending () const;
+	void run ();
+
+	std::vector<pollfd> pollFds () const;
+	int timeout () const;
+	void dispatch ();
+
+private:
+	struct Transfer;
+	static void LIBUSB_CALL transferDone (libusb_transfer *transfer);
+	void armTimer ();
+	void completeTransfers ();
+
+	libusb_context *_context;
+	Clock &_clock;
+	int _timerfd;
+	int _donefd;	// eventfd, written when a transfer is queued to _done
+	std::multimap<uint64_t, TimerCallback> _timers;
+	std::atomic<unsigned int> _transfers;
+	std::mutex _done_mutex;
+	std::deque<std::pair<libusb_transfer *, int>> _done;	// with their result
+};
+
+/*
+ * Multi-step command written as a sequence of transfers, timers and
+ * plain steps. Each step starts when the previous one completed, the
+ * first failure skips the remaining steps and is passed to the done
+ * callback.
+ */
+class CommandSequence: public std::enable_shared_from_this<CommandSequence>
+{
+public:
+	typedef std::function<void (std::vector<uint8_t> &data)> ResultCallback;
+	typedef std::function<void (std::exception_ptr error)> DoneCallback;
+
+	static std::shared_ptr<CommandSequence> create (UsbEventLoop &loop);
+
+	CommandSequence &control (UsbTransport &transport,
+				  uint8_t request_type, uint8_t request,
+				  uint16_t value, uint16_t index,
+				  std::vector<uint8_t> data = std::vector<uint8_t> (),
+				  ResultCallback result = nullptr);
+	CommandSequence &sleep (unsigned int delay);
+	CommandSequence &then (std::function<void ()> step);
+
+	void start (DoneCallback done = nullptr);
+	// Start the sequence and run the loop until it is done
+	void run ();
+
+private:
+	CommandSequence (UsbEventLoop &loop);
+
+	typedef std::function<void (std::function<void (std::exception_ptr)>)> Step;
+
+	void next ();
+
+	UsbEventLoop &_loop;
+	std::deque<Step> _steps;
+	DoneCallback _done;
+};
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "UsbTransport.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+
+// Longest wait between two checks of the cancellation, in microseconds
+constexpr long CancelPollInterval = 50000;
+
+UsbTransport::~UsbTransport ()
+{
+}
+
+libusb_device_handle *UsbTransport::handle ()
+{
+	return nullptr;
+}
+
+int UsbTransport::reset ()
+{
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+void UsbTransport::startDeadline ()
+{
+}
+
+void UsbTransport::clearDeadline ()
+{
+}
+
+int UsbTransport::transferTimeout (unsigned int timeout)
+{
+	return std::min<unsigned int> (timeout, INT_MAX);
+}
+
+LibusbTransport::LibusbTransport (libusb_device *dev, libusb_context *context,
+				  Cancellation &cancel):
+	_context (context),
+	_cancel (cancel),
+	_bus (libusb_get_bus_number (dev)),
+	_ports (7)
+{
+	int err;
+	if (0 != (err = libusb_open (dev, &_dev))) {
+		throw std::runtime_error (libusb_error_name (err));
+	}
+	int depth = libusb_get_port_numbers (dev, _ports.data (), _ports.size ());
+	_ports.resize (depth > 0 ? depth : 0);
+	libusb_device_descriptor desc;
+	libusb_get_device_descriptor (dev, &desc);
+	_vendor_id = desc.idVendor;
+	_product_id = desc.idProduct;
+}
+
+LibusbTransport::~LibusbTransport ()
+{
+	libusb_close (_dev);
+}
+
+static void LIBUSB_CALL transferCompleted (libusb_transfer *transfer)
+{
+	*static_cast<int *> (transfer->user_data) = 1;
+}
+
+int LibusbTransport::controlTransfer (uint8_t request_type, uint8_t request,
+				      uint16_t value, uint16_t index,
+				      uint8_t *data, uint16_t length,
+				      unsigned int timeout)
+{
+	libusb_transfer *transfer = libusb_alloc_transfer (0);
+	if (!transfer)
+		return LIBUSB_ERROR_NO_MEM;
+	std::vector<uint8_t> buffer (LIBUSB_CONTROL_SETUP_SIZE + length);
+	libusb_fill_control_setup (buffer.data (), request_type, request, value, index, length);
+	if (!(request_type & LIBUSB_ENDPOINT_IN) && length > 0)
+		memcpy (buffer.data () + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+	int completed = 0;
+	libusb_fill_control_transfer (transfer, _dev, buffer.data (), &transferCompleted,
+				      &completed, timeout);
+	int ret;
+	if (0 != (ret = libusb_submit_transfer (transfer))) {
+		libusb_free_transfer (transfer);
+		return ret;
+	}
+	bool cancelling = false;
+	while (!completed) {
+		if (!cancelling && _cancel.cancelled ()) {
+			libusb_cancel_transfer (transfer);
+			cancelling = true;
+		}
+		timeval slice = { 0, CancelPollInterval };
+		ret = libusb_handle_events_timeout_completed (_context, &slice, &completed);
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+			// Same recovery as libusb synchronous transfers
+			libusb_cancel_transfer (transfer);
+			while (!completed)
+				if (libusb_handle_events_completed (_context, &completed) < 0)
+					break;
+			libusb_free_transfer (transfer);
+			return ret;
+		}
+	}
+	ret = result (transfer);
+	if (ret > 0 && (request_type & LIBUSB_ENDPOINT_IN))
+		memcpy (data, libusb_control_transfer_get_data (transfer), ret);
+	libusb_free_transfer (transfer);
+	return ret;
+}
+
+Clock &LibusbTransport::clock ()
+{
+	return Clock::system ();
+}
+
+libusb_device_handle *LibusbTransport::handle ()
+{
+	return _dev;
+}
+
+int LibusbTransport::reset ()
+{
+	int ret = libusb_reset_device (_dev);
+	if (ret != LIBUSB_ERROR_NOT_FOUND)
+		return ret;
+	// The device enumerated again, look for it on the same port
+	libusb_device **list;
+	ssize_t count = libusb_get_device_list (_context, &list);
+	if (count < 0)
+		return count;
+	ret = LIBUSB_ERROR_NO_DEVICE;
+	for (ssize_t i = 0; i < count; ++i) {
+		if (!samePort (list[i]))
+			continue;
+		libusb_device_handle *dev;
+		if (0 == (ret = libusb_open (list[i], &dev))) {
+			libusb_close (_dev);
+			_dev = dev;
+		}
+		break;
+	}
+	libusb_free_device_list (list, 1);
+	return ret;
+}
+
+int LibusbTransport::result (const libusb_transfer *transfer)
+{
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return transfer->actual_length;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_INTERRUPTED;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+bool LibusbTransport::samePort (libusb_device *dev) const
+{
+	uint8_t ports[7];
+	int depth = libusb_get_port_numbers (dev, ports, sizeof (ports));
+	if (libusb_get_bus_number (dev) != _bus || depth < 0 ||
+	    std::vector<uint8_t> (ports, ports + depth) != _ports)
+		return false;
+	libusb_device_descriptor desc;
+	libusb_get_device_descriptor (dev, &desc);
+	return desc.idVendor == _vendor_id && desc.idProduct == _product_id;
+}
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef USB_TRANSPORT_H
+#define USB_TRANSPORT_H
+
+#include "Cancellation.h"
+#include "Clock.h"
+
+#include <cstdint>
+#include <vector>
+
+extern "C" {
+#include <libusb.h>
+}
+
+/*
+ * Control transfers to a device. Return values follow
+ * libusb_control_transfer: the transferred length or a libusb error.
+ */
+class UsbTransport
+{
+public:
+	virtual ~UsbTransport ();
+
+	virtual int controlTransfer (uint8_t request_type, uint8_t request,
+				     uint16_t value, uint16_t index,
+				     uint8_t *data, uint16_t length,
+				     unsigned int timeout) = 0;
+
+	virtual Clock &clock () = 0;
+
+	// libusb handle for asynchronous transfers, nullptr if there is none
+	virtual libusb_device_handle *handle ();
+
+	// Reset the device after a stall, reopening it if it enumerated
+	// again. Returns 0 or a libusb error.
+	virtual int reset ();
+
+	// Start the deadline of the transfer policy from now, or remove it.
+	// Transports without a policy ignore both.
+	virtual void startDeadline ();
+	virtual void clearDeadline ();
+
+	// Timeout for a transfer submitted on the handle instead of through
+	// controlTransfer, from the one asked (0 for none), or a libusb
+	// error when no transfer may be made. Transports with a policy
+	// apply its timeout, deadline and cancellation.
+	virtual int transferTimeout (unsigned int timeout);
+};
+
+/*
+ * Transport to a libusb device. Transfers are submitted asynchronously
+ * and waited for in short slices, so a cancellation aborts them.
+ */
+class LibusbTransport: public UsbTransport
+{
+public:
+	LibusbTransport (libusb_device *dev, libusb_context *context = nullptr,
+			 Cancellation &cancel = Cancellation::process ());
+	virtual ~LibusbTransport ();
+
+	virtual int controlTransfer (uint8_t request_type, uint8_t request,
+				     uint16_t value, uint16_t index,
+				     uint8_t *data, uint16_t length,
+				     unsigned int timeout);
+
+	virtual Clock &clock ();
+	virtual libusb_device_handle *handle ();
+	virtual int reset ();
+
+	// Length or libusb error of a finished transfer
+	static int result (const libusb_transfer *transfer);
+
+private:
+	bool samePort (libusb_device *dev) const;
+
+	libusb_context *_context;
+	libusb_device_handle *_dev;
+	Cancellation &_cancel;
+	uint8_t _bus;
+	std::vector<uint8_t> _ports;
+	uint16_t _vendor_id;
+	uint16_t _product_id;
+};
+
+#endif
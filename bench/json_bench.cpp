@@ -0,0 +1,149 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Compares reading profiles through a jsoncpp document (JsonToMacros)
+ * with the streaming reader (ParseJsonMacros). Both must give the same
+ * encoded macros.
+ *
+ * Usage: json_bench [-n iterations] [profile.json...]
+ * Without files, a large synthetic profile is generated.
+ */
+
+#include "../JsonMacros.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <json/json.h>
+
+static std::string syntheticProfile (unsigned int keys, unsigned int events)
+{
+	static const char *letters[] = { "A", "B", "C", "D", "E", "F", "G", "H" };
+	std::ostringstream out;
+	out << "[\n";
+	for (unsigned int i = 0; i < keys; ++i) {
+		out << "\t{\n\t\t\"key\": \"G" << (i % 18) + 1 << "\",\n"
+		    << "\t\t\"repeat_mode\": \"" << (i % 2 ? "hold" : "fixed") << "\",\n"
+		    << "\t\t\"macro\": [\n";
+		for (unsigned int j = 0; j < events; ++j) {
+			const char *key = letters[(i + j) % 8];
+			out << "\t\t\t{ \"key\": \"" << key << "\", \"pressed\": true },\n"
+			    << "\t\t\t{ \"delay\": " << 10 + j % 50 << " },\n"
+			    << "\t\t\t{ \"key\": \"" << key << "\", \"pressed\": false }"
+			    << (j + 1 < events ? ",\n" : "\n");
+		}
+		out << "\t\t]\n\t}" << (i + 1 < keys ? ",\n" : "\n");
+	}
+	out << "]\n";
+	return out.str ();
+}
+
+static bool readWithDocument (const std::string &text, std::vector<CorsairDevice::KeySettings> &keys)
+{
+	Json::Value profile;
+	Json::Reader reader;
+	if (!reader.parse (text, profile)) {
+		fprintf (stderr, "%s", reader.getFormattedErrorMessages ().c_str ());
+		return false;
+	}
+	return JsonToMacros (profile, keys);
+}
+
+static bool readStreaming (const std::string &text, std::vector<CorsairDevice::KeySettings> &keys)
+{
+	std::string error;
+	if (!ParseJsonMacros (text.data (), text.size (), keys, std::string (), error)) {
+		fprintf (stderr, "%s", error.c_str ());
+		return false;
+	}
+	return true;
+}
+
+template<typename Function>
+static double timeIt (unsigned int iterations, Function f)
+{
+	auto start = std::chrono::steady_clock::now ();
+	for (unsigned int i = 0; i < iterations; ++i)
+		f ();
+	std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now () - start;
+	return elapsed.count () / iterations;
+}
+
+static bool bench (const char *name, const std::string &text, unsigned int iterations)
+{
+	std::vector<CorsairDevice::KeySettings> document_keys, streaming_keys;
+	bool document_ok = readWithDocument (text, document_keys);
+	bool streaming_ok = readStreaming (text, streaming_keys);
+	if (document_ok != streaming_ok) {
+		printf ("%s: readers disagree (jsoncpp %s, streaming %s)\n", name,
+			document_ok ? "ok" : "failed", streaming_ok ? "ok" : "failed");
+		return false;
+	}
+	if (!document_ok) {
+		printf ("%s: rejected by both readers\n", name);
+		return true;
+	}
+	CorsairDevice::MacroImage document_image = CorsairDevice::encodeKeys (document_keys);
+	CorsairDevice::MacroImage streaming_image = CorsairDevice::encodeKeys (streaming_keys);
+	if (!(document_image.view () == streaming_image.view ())) {
+		printf ("%s: encoded macros differ\n", name);
+		return false;
+	}
+
+	double document_us = timeIt (iterations, [&text] () {
+		std::vector<CorsairDevice::KeySettings> keys;
+		readWithDocument (text, keys);
+	});
+	double streaming_us = timeIt (iterations, [&text] () {
+		std::vector<CorsairDevice::KeySettings> keys;
+		readStreaming (text, keys);
+	});
+	printf ("%s: %zu bytes, %zu keys, jsoncpp %.1f us, streaming %.1f us (%.1fx)\n",
+		name, text.size (), document_keys.size (),
+		document_us, streaming_us, document_us / streaming_us);
+	return true;
+}
+
+int main (int argc, char *argv[])
+{
+	unsigned int iterations = 100;
+	int first = 1;
+	if (argc > 2 && strcmp (argv[1], "-n") == 0) {
+		iterations = strtoul (argv[2], nullptr, 10);
+		first = 3;
+	}
+	bool ok = true;
+	if (first == argc) {
+		ok &= bench ("small", syntheticProfile (18, 10), iterations);
+		ok &= bench ("large", syntheticProfile (18, 400), iterations / 10 + 1);
+	}
+	for (int i = first; i < argc; ++i) {
+		std::ifstream file (argv[i]);
+		std::string text ((std::istreambuf_iterator<char> (file)), std::istreambuf_iterator<char> ());
+		ok &= bench (argv[i], text, iterations);
+	}
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,203 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Checks the macro encoder and decoder against each other on a corpus of
+ * random profiles (and the given profile files), then measures their
+ * throughput.
+ *
+ * Usage: macro_bench [-n iterations] [profile.json...]
+ */
+
+#include "../CorsairDevice.h"
+#include "../JsonMacros.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+typedef CorsairDevice::KeySettings KeySettings;
+typedef CorsairDevice::MacroItem MacroItem;
+
+static std::vector<KeySettings> randomProfile (std::mt19937 &rng)
+{
+	std::uniform_int_distribution<unsigned int> key_count (1, 18), item_count (0, 200),
+						   byte (0, 255), delay (0, 65535), type (0, 9);
+	std::vector<KeySettings> keys (key_count (rng));
+	for (unsigned int i = 0; i < keys.size (); ++i) {
+		KeySettings &key = keys[i];
+		key.key_usage = 0x68 + i;
+		key.repeat_mode = static_cast<KeySettings::RepeatMode> (1 + byte (rng) % 3);
+		key.target_usage = 0;
+		key.repeat_count = 0;
+		unsigned int t = type (rng);
+		if (t == 0)
+			key.bind_type = KeySettings::BindNone;
+		else if (t == 1) {
+			key.bind_type = KeySettings::BindUsage;
+			key.target_usage = byte (rng);
+		}
+		else if (t == 2 && i > 0 && keys[i-1].bind_type == KeySettings::BindMacro) {
+			// The end of the previous macro, to be shared
+			key = keys[i-1];
+			key.key_usage = 0x68 + i;
+			key.macro.erase (key.macro.begin (), key.macro.begin () + key.macro.size () / 2);
+		}
+		else {
+			key.bind_type = KeySettings::BindMacro;
+			key.repeat_count = 1 + byte (rng) % 4;
+			unsigned int count = item_count (rng);
+			for (unsigned int j = 0; j < count; ++j) {
+				MacroItem item = {};
+				if (byte (rng) < 64) {
+					item.type = MacroItem::Delay;
+					item.delay = delay (rng);
+				}
+				else {
+					item.type = MacroItem::Key;
+					item.key_event.usage = byte (rng);
+					item.key_event.pressed = byte (rng) & 1;
+				}
+				key.macro.push_back (item);
+			}
+		}
+	}
+	return keys;
+}
+
+static bool sameKeys (const std::vector<KeySettings> &a, const std::vector<KeySettings> &b)
+{
+	if (a.size () != b.size ())
+		return false;
+	for (unsigned int i = 0; i < a.size (); ++i) {
+		if (a[i].key_usage != b[i].key_usage || a[i].repeat_mode != b[i].repeat_mode ||
+		    a[i].bind_type != b[i].bind_type)
+			return false;
+		if (a[i].bind_type == KeySettings::BindUsage && a[i].target_usage != b[i].target_usage)
+			return false;
+		if (a[i].bind_type != KeySettings::BindMacro)
+			continue;
+		if (a[i].repeat_count != b[i].repeat_count || a[i].macro.size () != b[i].macro.size ())
+			return false;
+		for (unsigned int j = 0; j < a[i].macro.size (); ++j) {
+			const MacroItem &x = a[i].macro[j], &y = b[i].macro[j];
+			if (x.type != y.type)
+				return false;
+			if (x.type == MacroItem::Key && (x.key_event.usage != y.key_event.usage ||
+							 x.key_event.pressed != y.key_event.pressed))
+				return false;
+			if (x.type == MacroItem::Delay && x.delay != y.delay)
+				return false;
+		}
+	}
+	return true;
+}
+
+// Encode, decode and encode again: both images and settings must match
+static bool roundTrip (const std::vector<KeySettings> &keys)
+{
+	CorsairDevice::MacroImage image = CorsairDevice::encodeKeys (keys);
+	std::vector<KeySettings> decoded = CorsairDevice::decodeKeys (image.view ());
+	if (!sameKeys (keys, decoded))
+		return false;
+	CorsairDevice::MacroImage again = CorsairDevice::encodeKeys (decoded);
+	return again.view () == image.view ();
+}
+
+template<typename Function>
+static double timeIt (unsigned int iterations, Function f)
+{
+	auto start = std::chrono::steady_clock::now ();
+	for (unsigned int i = 0; i < iterations; ++i)
+		f ();
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now () - start;
+	return elapsed.count ();
+}
+
+int main (int argc, char *argv[])
+{
+	unsigned int iterations = 200;
+	int first = 1;
+	if (argc > 2 && strcmp (argv[1], "-n") == 0) {
+		iterations = strtoul (argv[2], nullptr, 10);
+		first = 3;
+	}
+
+	std::vector<std::vector<KeySettings>> corpus;
+	std::mt19937 rng (42);
+	for (unsigned int i = 0; i < 500; ++i)
+		corpus.push_back (randomProfile (rng));
+	for (int i = first; i < argc; ++i) {
+		std::ifstream file (argv[i]);
+		std::string text ((std::istreambuf_iterator<char> (file)), std::istreambuf_iterator<char> ());
+		std::string error;
+		std::vector<KeySettings> keys;
+		if (!ParseJsonMacros (text.data (), text.size (), keys, std::string (), error)) {
+			fprintf (stderr, "%s: %s", argv[i], error.c_str ());
+			return EXIT_FAILURE;
+		}
+		corpus.push_back (keys);
+	}
+
+	unsigned int failures = 0;
+	std::size_t bytes = 0;
+	for (const auto &keys: corpus) {
+		if (!roundTrip (keys))
+			++failures;
+		CorsairDevice::MacroImageSize size = CorsairDevice::encodedSize (keys);
+		bytes += size.bindings + size.data + size.keys;
+	}
+	printf ("Round trip: %zu profiles, %u failures\n", corpus.size (), failures);
+
+	// Storage reused for every profile
+	std::vector<uint8_t> bindings, data, raw_keys;
+	for (const auto &keys: corpus) {
+		CorsairDevice::MacroImageSize size = CorsairDevice::encodedSize (keys);
+		bindings.resize (std::max (bindings.size (), size.bindings));
+		data.resize (std::max (data.size (), size.data));
+		raw_keys.resize (std::max (raw_keys.size (), size.keys));
+	}
+	CorsairDevice::MacroImageStorage storage = { bindings.data (), data.data (), raw_keys.data () };
+	std::vector<CorsairDevice::MacroImage> images;
+	for (const auto &keys: corpus)
+		images.push_back (CorsairDevice::encodeKeys (keys));
+
+	double in_storage = timeIt (iterations, [&corpus, &storage] () {
+		for (const auto &keys: corpus)
+			CorsairDevice::encodeKeys (keys, storage);
+	});
+	double in_vectors = timeIt (iterations, [&corpus] () {
+		for (const auto &keys: corpus)
+			CorsairDevice::encodeKeys (keys);
+	});
+	double decoding = timeIt (iterations, [&images] () {
+		for (const auto &image: images)
+			CorsairDevice::decodeKeys (image.view ());
+	});
+	double megabytes = double (bytes) * iterations / 1e6;
+	printf ("Encoding in storage: %.1f MB/s\n", megabytes / in_storage);
+	printf ("Encoding in new vectors: %.1f MB/s\n", megabytes / in_vectors);
+	printf ("Decoding: %.1f MB/s\n", megabytes / decoding);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,185 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * Compares the two profile representations, a vector of KeySettings
+ * (one macro vector per key) and FlatProfile (parallel arrays and one
+ * item buffer), on profiles with 18 G keys and long macros: allocations
+ * and peak heap while reading, then time to walk, optimize and encode.
+ *
+ * Usage: profile_bench [-n iterations] [items per key]
+ */
+
+#include "../FlatProfile.h"
+#include "../JsonMacros.h"
+#include "../MacroOptimizer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <malloc.h>
+}
+
+// Heap accounting, in usable bytes of each block
+static std::size_t allocations, heap_size, heap_peak;
+
+void *operator new (std::size_t size)
+{
+	void *ptr = malloc (size);
+	if (!ptr)
+		throw std::bad_alloc ();
+	++allocations;
+	heap_size += malloc_usable_size (ptr);
+	if (heap_size > heap_peak)
+		heap_peak = heap_size;
+	return ptr;
+}
+
+void operator delete (void *ptr) noexcept
+{
+	if (!ptr)
+		return;
+	heap_size -= malloc_usable_size (ptr);
+	free (ptr);
+}
+
+void operator delete (void *ptr, std::size_t) noexcept
+{
+	operator delete (ptr);
+}
+
+static void resetHeapPeak ()
+{
+	allocations = 0;
+	heap_peak = heap_size;
+}
+
+static std::string longProfile (unsigned int items)
+{
+	std::ostringstream out;
+	out << "[\n";
+	for (unsigned int i = 0; i < 18; ++i) {
+		out << "{ \"key\": \"G" << i + 1 << "\", \"macro\": [\n";
+		for (unsigned int j = 0; j < items / 3; ++j) {
+			char key = 'A' + (i + j) % 26;
+			out << "{ \"key\": \"" << key << "\", \"pressed\": true }, "
+			    << "{ \"delay\": " << 1 + j % 40 << " }, "
+			    << "{ \"key\": \"" << key << "\", \"pressed\": false }"
+			    << (j + 1 < items / 3 ? ",\n" : "\n");
+		}
+		out << "] }" << (i + 1 < 18 ? ",\n" : "\n");
+	}
+	out << "]\n";
+	return out.str ();
+}
+
+template<typename Function>
+static double timeIt (unsigned int iterations, Function f)
+{
+	auto start = std::chrono::steady_clock::now ();
+	for (unsigned int i = 0; i < iterations; ++i)
+		f ();
+	std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now () - start;
+	return elapsed.count () / iterations;
+}
+
+static volatile uint64_t sink;
+
+int main (int argc, char *argv[])
+{
+	// The most that fits in the 65535 bytes of macro data
+	unsigned int iterations = 100, items = 1200;
+	int arg = 1;
+	if (argc > 2 && strcmp (argv[1], "-n") == 0) {
+		iterations = strtoul (argv[2], nullptr, 10);
+		arg = 3;
+	}
+	if (arg < argc)
+		items = strtoul (argv[arg], nullptr, 10);
+
+	std::string text = longProfile (items);
+	std::string error;
+	printf ("Profile: 18 keys, %u items per key, %zu bytes of JSON\n", items / 3 * 3, text.size ());
+
+	std::vector<CorsairDevice::KeySettings> keys;
+	FlatProfile profile;
+	resetHeapPeak ();
+	std::size_t base = heap_size;
+	if (!ParseJsonMacros (text.data (), text.size (), keys, std::string (), error)) {
+		fprintf (stderr, "%s", error.c_str ());
+		return EXIT_FAILURE;
+	}
+	printf ("Reading KeySettings: %zu allocations, %zu bytes peak, %zu bytes kept\n",
+		allocations, heap_peak - base, heap_size - base);
+	resetHeapPeak ();
+	base = heap_size;
+	ParseJsonMacros (text.data (), text.size (), profile, std::string (), error);
+	printf ("Reading FlatProfile: %zu allocations, %zu bytes peak, %zu bytes kept\n",
+		allocations, heap_peak - base, heap_size - base);
+
+	double walk_keys = timeIt (iterations, [&keys] () {
+		uint64_t time = 0;
+		for (const auto &key: keys)
+			for (const auto &item: key.macro)
+				if (item.type == CorsairDevice::MacroItem::Delay)
+					time += item.delay;
+		sink = time;
+	});
+	double walk_flat = timeIt (iterations, [&profile] () {
+		uint64_t time = 0;
+		for (const auto &item: profile.items)
+			if (item.type == CorsairDevice::MacroItem::Delay)
+				time += item.delay;
+		sink = time;
+	});
+	printf ("Walking items: KeySettings %.1f us, FlatProfile %.1f us\n", walk_keys, walk_flat);
+
+	MacroOptimizer optimizer (0.5, 0);
+	resetHeapPeak ();
+	double optimize_keys = timeIt (iterations, [&keys, &optimizer] () {
+		std::vector<CorsairDevice::KeySettings> copy = keys;
+		for (auto &key: copy)
+			optimizer.optimize (key);
+	});
+	std::size_t optimize_keys_allocations = allocations / iterations;
+	resetHeapPeak ();
+	double optimize_flat = timeIt (iterations, [&profile, &optimizer] () {
+		FlatProfile copy = profile;
+		std::vector<MacroOptimizer::Savings> savings;
+		optimizer.optimize (copy, savings);
+	});
+	std::size_t optimize_flat_allocations = allocations / iterations;
+	printf ("Copying and optimizing: KeySettings %.1f us (%zu allocations), FlatProfile %.1f us (%zu allocations)\n",
+		optimize_keys, optimize_keys_allocations, optimize_flat, optimize_flat_allocations);
+
+	if (!(CorsairDevice::encodeKeys (keys).view () == CorsairDevice::encodeKeys (profile).view ())) {
+		printf ("Encoded images differ\n");
+		return EXIT_FAILURE;
+	}
+	double encode_keys = timeIt (iterations, [&keys] () { CorsairDevice::encodeKeys (keys); });
+	double encode_flat = timeIt (iterations, [&profile] () { CorsairDevice::encodeKeys (profile); });
+	printf ("Encoding: KeySettings %.1f us, FlatProfile %.1f us\n", encode_keys, encode_flat);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,323 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+
+/*
+ * Measures each host side stage of sending a profile on synthetic
+ * profiles of several shapes, with and without a layout: reading the
+ * JSON (document and streaming readers), key name lookup, encoding,
+ * decoding, sending to a simulated device and status decoding. Each
+ * stage reports its throughput, latency percentiles over the samples
+ * and allocations per operation.
+ *
+ * Usage: stage_bench [-n samples] [-l layout] [stage...]
+ */
+
+#include "../FlatProfile.h"
+#include "../JsonMacros.h"
+#include "../K40Device.h"
+#include "../K90Device.h"
+#include "../KeyUsage.h"
+#include "../SimulatedTransport.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Allocation count, read around each sample
+static std::size_t allocations;
+
+void *operator new (std::size_t size)
+{
+	void *ptr = malloc (size);
+	if (!ptr)
+		throw std::bad_alloc ();
+	++allocations;
+	return ptr;
+}
+
+void operator delete (void *ptr) noexcept
+{
+	free (ptr);
+}
+
+void operator delete (void *ptr, std::size_t) noexcept
+{
+	free (ptr);
+}
+
+struct Shape {
+	const char *name;
+	unsigned int keys;
+	unsigned int events;	// key press, delay and release per event
+};
+
+// The long shapes stay within the 65535 bytes of macro data
+static const Shape shapes[] = {
+	{ "2 keys x 4 events", 2, 4 },
+	{ "18 keys x 4 events", 18, 4 },
+	{ "1 key x 3000 events", 1, 3000 },
+	{ "18 keys x 400 events", 18, 400 },
+};
+
+// Names found in every layout
+static const char *key_names[] = {
+	"A", "Z", "E", "R", "T", "Y", "Q", "S", "D", "F", "W", "X",
+	"Space", "Enter", "LeftShift", "LeftControl", "Tab", "Backspace", "Up", "Down",
+};
+static constexpr std::size_t key_name_count = sizeof (key_names) / sizeof (key_names[0]);
+
+static std::string syntheticProfile (const Shape &shape)
+{
+	std::ostringstream out;
+	out << "[\n";
+	for (unsigned int i = 0; i < shape.keys; ++i) {
+		out << "{ \"key\": \"G" << i + 1 << "\", \"repeat_mode\": \""
+		    << (i % 2 ? "hold" : "fixed") << "\", \"macro\": [\n";
+		for (unsigned int j = 0; j < shape.events; ++j) {
+			const char *key = key_names[(i + j) % key_name_count];
+			out << "{ \"key\": \"" << key << "\", \"pressed\": true }, "
+			    << "{ \"delay\": " << 1 + j % 40 << " }, "
+			    << "{ \"key\": \"" << key << "\", \"pressed\": false }"
+			    << (j + 1 < shape.events ? ",\n" : "\n");
+		}
+		out << "] }" << (i + 1 < shape.keys ? ",\n" : "\n");
+	}
+	out << "]\n";
+	return out.str ();
+}
+
+/*
+ * Times samples of a stage one by one. Each sample runs the stage once
+ * and processes units (bytes, names or operations) of work.
+ */
+class Stage
+{
+public:
+	Stage (const char *name, const char *unit, double units, unsigned int samples):
+		_name (name), _unit (unit), _units (units), _samples (samples)
+	{
+	}
+
+	template<typename Function>
+	void run (Function f)
+	{
+		f ();	// warm up
+		_durations.clear ();
+		_durations.reserve (_samples);
+		std::size_t before = allocations;
+		for (unsigned int i = 0; i < _samples; ++i) {
+			auto start = std::chrono::steady_clock::now ();
+			f ();
+			std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now () - start;
+			_durations.push_back (elapsed.count ());
+		}
+		_allocations = double (allocations - before) / _samples;
+		report ();
+	}
+
+private:
+	double percentile (double p) const
+	{
+		std::size_t i = std::min (_durations.size () - 1, std::size_t (p * _durations.size ()));
+		return _durations[i];
+	}
+
+	void report ()
+	{
+		double total = 0;
+		for (double d: _durations)
+			total += d;
+		std::sort (_durations.begin (), _durations.end ());
+		double rate = _units * _samples / total * 1e6;
+		const char *scale = "";
+		if (rate >= 1e6) {
+			rate /= 1e6;
+			scale = "M";
+		}
+		else if (rate >= 1e3) {
+			rate /= 1e3;
+			scale = "k";
+		}
+		printf ("  %-18s %9.2f %s%s/s  p50 %9.2f  p90 %9.2f  p99 %9.2f  max %9.2f us  %8.1f allocs\n",
+			_name, rate, scale, _unit,
+			percentile (0.5), percentile (0.9), percentile (0.99), _durations.back (),
+			_allocations);
+	}
+
+	const char *_name, *_unit;
+	double _units;
+	unsigned int _samples;
+	std::vector<double> _durations;
+	double _allocations;
+};
+
+static bool selected (const std::vector<std::string> &stages, const char *stage)
+{
+	return stages.empty () || std::find (stages.begin (), stages.end (), stage) != stages.end ();
+}
+
+static volatile uint64_t sink;
+
+static bool benchShape (const Shape &shape, const std::string &layout,
+			const std::vector<std::string> &stages, unsigned int samples)
+{
+	std::string text = syntheticProfile (shape);
+	std::string error;
+	FlatProfile profile;
+	if (!ParseJsonMacros (text.data (), text.size (), profile, layout, error)) {
+		fprintf (stderr, "%s: %s", shape.name, error.c_str ());
+		return false;
+	}
+	std::vector<CorsairDevice::KeySettings> keys = profile.keySettings ();
+	CorsairDevice::MacroImage image = CorsairDevice::encodeKeys (profile);
+	CorsairDevice::MacroImageView view = image.view ();
+	std::size_t image_size = view.bindings.size + view.data.size + view.keys.size;
+	printf ("%s, %s: %zu bytes of JSON, %zu items, %zu bytes encoded\n",
+		shape.name, layout.empty () ? "no layout" : layout.c_str (),
+		text.size (), profile.items.size (), image_size);
+
+	if (selected (stages, "jsoncpp")) {
+		Stage ("jsoncpp", "B", text.size (), samples).run ([&] () {
+			Json::Value root;
+			Json::Reader reader;
+			std::vector<CorsairDevice::KeySettings> out;
+			reader.parse (text.data (), text.data () + text.size (), root);
+			JsonToMacros (root, out, layout);
+		});
+	}
+	if (selected (stages, "parse")) {
+		Stage ("parse", "B", text.size (), samples).run ([&] () {
+			FlatProfile out;
+			ParseJsonMacros (text.data (), text.size (), out, layout, error);
+		});
+	}
+	if (selected (stages, "encode")) {
+		CorsairDevice::MacroImageSize size = CorsairDevice::encodedSize (profile);
+		std::vector<uint8_t> bindings (size.bindings), data (size.data), raw_keys (size.keys);
+		CorsairDevice::MacroImageStorage storage = { bindings.data (), data.data (), raw_keys.data () };
+		Stage ("encode", "B", image_size, samples).run ([&] () {
+			CorsairDevice::encodeKeys (profile, storage);
+		});
+		Stage ("encode (vectors)", "B", image_size, samples).run ([&] () {
+			CorsairDevice::encodeKeys (profile);
+		});
+	}
+	if (selected (stages, "decode")) {
+		Stage ("decode", "B", image_size, samples).run ([&] () {
+			CorsairDevice::decodeKeys (view);
+		});
+	}
+	if (selected (stages, "send")) {
+		// Virtual clock: the packet gaps do not wait
+		std::unique_ptr<CorsairDevice> device (new K90Device (new SimulatedTransport (SimulatedTransport::K90)));
+		Stage ("send", "B", image_size, samples).run ([&] () {
+			device->sendKeys (1, view);
+		});
+	}
+	return true;
+}
+
+static void benchLookup (const std::string &layout, unsigned int samples)
+{
+	const KeyUsage::Layout *keymap = layout.empty () ? &KeyUsage::base : KeyUsage::findLayout (layout);
+	if (!keymap) {
+		fprintf (stderr, "Unknown layout: %s\n", layout.c_str ());
+		return;
+	}
+	// Every name of the layout, with as many unknown names
+	std::vector<std::string> names;
+	for (std::size_t i = 0; i < keymap->entry_count; ++i) {
+		names.push_back (keymap->entries[i].name);
+		names.push_back (std::string (keymap->entries[i].name) + "_");
+	}
+	printf ("Key lookup, %s: %zu names\n", layout.empty () ? "no layout" : layout.c_str (), names.size ());
+	Stage ("lookup", "names", names.size (), samples).run ([&] () {
+		uint64_t found = 0;
+		for (const auto &name: names)
+			found += keymap->find (name);
+		sink = found;
+	});
+	Stage ("name", "usages", 256, samples).run ([&] () {
+		uint64_t found = 0;
+		for (unsigned int usage = 0; usage < 256; ++usage)
+			found += keymap->keyName (usage) != nullptr;
+		sink = found;
+	});
+}
+
+static void benchStatus (unsigned int samples)
+{
+	static constexpr unsigned int batch = 1000;
+	std::unique_ptr<CorsairDevice> devices[] = {
+		std::unique_ptr<CorsairDevice> (new K40Device (new SimulatedTransport (SimulatedTransport::K40))),
+		std::unique_ptr<CorsairDevice> (new K90Device (new SimulatedTransport (SimulatedTransport::K90))),
+	};
+	for (auto &device: devices) {
+		std::vector<uint8_t> raw = device->getRawStatus ();
+		printf ("Status, %s: %zu bytes\n", device->modelName (), raw.size ());
+		Stage ("decode status", "status", batch, samples).run ([&] () {
+			uint64_t fields = 0;
+			for (unsigned int i = 0; i < batch; ++i)
+				fields += device->decodeStatus (raw).fields;
+			sink = fields;
+		});
+		Stage ("read status", "status", 1, samples).run ([&] () {
+			device->getRawStatus ();
+		});
+	}
+}
+
+int main (int argc, char *argv[])
+{
+	unsigned int samples = 200;
+	std::vector<std::string> layouts = { std::string (), "AZERTY-Fr" };
+	std::vector<std::string> stages;
+	int arg = 1;
+	while (arg < argc) {
+		if (strcmp (argv[arg], "-n") == 0 && arg + 1 < argc) {
+			samples = std::max (1ul, strtoul (argv[arg+1], nullptr, 10));
+			arg += 2;
+		}
+		else if (strcmp (argv[arg], "-l") == 0 && arg + 1 < argc) {
+			layouts = { std::string (), argv[arg+1] };
+			arg += 2;
+		}
+		else
+			stages.push_back (argv[arg++]);
+	}
+
+	for (const auto &layout: layouts) {
+		for (const auto &shape: shapes)
+			if (!benchShape (shape, layout, stages, samples))
+				return EXIT_FAILURE;
+		if (selected (stages, "lookup"))
+			benchLookup (layout, samples);
+	}
+	if (selected (stages, "status"))
+		benchStatus (samples);
+	return EXIT_SUCCESS;
+}
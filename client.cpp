@@ -0,0 +1,123 @@
+/*
+ * Copyright 2016 Clément Vuchener
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "DaemonProtocol.h"
+
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/un.h>
+#include <unistd.h>
+}
+
+static const char *usage = R"(Usage: %s [options] command
+
+Send a command to a running corsair-usb-config daemon.
+
+Options are:
+	-S socket	Use this socket instead of the default one.
+	-d address	Use this device instead of the daemon default.
+	-h		Print this help.
+)";
+
+int main (int argc, char *argv[])
+{
+	std::string socket_path = DaemonProtocol::defaultSocketPath ();
+	std::string address;
+
+	int opt;
+	while (-1 != (opt = getopt (argc, argv, "+S:d:h"))) {
+		switch (opt) {
+		case 'S':
+			socket_path = optarg;
+			break;
+
+		case 'd':
+			address = optarg;
+			break;
+
+		case 'h':
+			fprintf (stderr, usage, argv[0]);
+			return EXIT_SUCCESS;
+
+		default:
+			return EXIT_FAILURE;
+		}
+	}
+	if (optind >= argc) {
+		fprintf (stderr, "Missing command.\n");
+		fprintf (stderr, usage, argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	char cwd[PATH_MAX];
+	if (!getcwd (cwd, sizeof (cwd))) {
+		perror ("getcwd");
+		return EXIT_FAILURE;
+	}
+	std::vector<char> payload;
+	auto add = [&payload] (const char *str) {
+		payload.insert (payload.end (), str, str + strlen (str) + 1);
+	};
+	add (cwd);
+	add (address.c_str ());
+	for (int i = optind; i < argc; ++i)
+		add (argv[i]);
+	if (payload.size () > DaemonProtocol::MaxRequestSize) {
+		fprintf (stderr, "Command is too long.\n");
+		return EXIT_FAILURE;
+	}
+
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (socket_path.size () >= sizeof (addr.sun_path)) {
+		fprintf (stderr, "Socket path is too long.\n");
+		return EXIT_FAILURE;
+	}
+	strcpy (addr.sun_path, socket_path.c_str ());
+	int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1 || -1 == connect (fd, reinterpret_cast<sockaddr *> (&addr), sizeof (addr))) {
+		fprintf (stderr, "Cannot connect to %s: %s\n", socket_path.c_str (), strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	DaemonProtocol::RequestHeader request = { static_cast<uint32_t> (payload.size ()) };
+	DaemonProtocol::ResponseHeader response;
+	if (!DaemonProtocol::writeFull (fd, &request, sizeof (request)) ||
+	    !DaemonProtocol::writeFull (fd, payload.data (), payload.size ()) ||
+	    !DaemonProtocol::readFull (fd, &response, sizeof (response))) {
+		fprintf (stderr, "Connection to the daemon failed.\n");
+		return EXIT_FAILURE;
+	}
+	uint32_t out_size = response.out_size, err_size = response.err_size;
+	for (auto stream: { std::make_pair (out_size, stdout),
+			    std::make_pair (err_size, stderr) }) {
+		std::vector<char> data (stream.first);
+		if (!DaemonProtocol::readFull (fd, data.data (), data.size ())) {
+			fprintf (stderr, "Connection to the daemon failed.\n");
+			return EXIT_FAILURE;
+		}
+		fwrite (data.data (), 1, data.size (), stream.second);
+	}
+	close (fd);
+	return response.status == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -11,17 +11,14 @@ open (IN, "xscreensaver-command -watch |");
 while (<IN>) {
     if (m/^(BLANK|LOCK)/) {
         if (!$blanked) { 
-	    $profile=`$PATH/corsair-usb-config current-profile get`;
-            $color=`$PATH/corsair-usb-config profile-color get`;
-            chomp ($color);
-            chomp ($profile);
-            system "$PATH/corsair-usb-config profile-color set $profile $NEWCOLOR";
-            system "$PATH/corsair-usb-config animation set pulse";
+            my $status = `$PATH/corsair-usb-config status`;
+            ($profile) = $status =~ m/^Current profile: (\d+)$/m;
+            ($color) = $status =~ m/^Profile color: ([0-9a-f]+)$/m;
+            system "$PATH/corsair-usb-config profile-color set $profile $NEWCOLOR , animation set pulse";
             $blanked = 1;
         }
     } elsif (m/^UNBLANK/) {
-        system "$PATH/corsair-usb-config animation set off";
-        system "$PATH/corsair-usb-config profile-color set $profile $color";
+        system "$PATH/corsair-usb-config animation set off , profile-color set $profile $color";
         $blanked = 0;
     }
 }
@@ -20,20 +20,27 @@
 #include "K90Device.h"
 #include "K40Device.h"
 
+#include "Commands.h"
+#include "Daemon.h"
+#include "DaemonProtocol.h"
+#include "DeviceRegistry.h"
 #include "KeyUsage.h"
-#include "JsonMacros.h"
+#include "ReliableTransport.h"
+#include "SimulatedTransport.h"
+#include "Trace.h"
+#include "TransferLog.h"
+#include "UsbEventLoop.h"
 
 #include <set>
+#include <vector>
 #include <functional>
 #include <string>
+#include <climits>
 #include <cstring>
-#include <fstream>
 #include <iostream>
 
-#include <json/json.h>
-#include <json/reader.h>
-
 extern "C" {
+#include <getopt.h>
 #include <unistd.h>
 }
 
@@ -46,22 +53,42 @@ enum ProductID: uint16_t {
 
 struct DeviceInfo {
 	std::set<uint16_t> products;
-	std::function<CorsairDevice *(libusb_device *)> factory;
+	std::function<CorsairDevice *(UsbTransport *)> factory;
 } device_table[] = {
 	{
 		{ CORSAIR_K90_ID },
-		[] (libusb_device *dev) { return new K90Device (dev); }
+		[] (UsbTransport *transport) { return new K90Device (transport); }
 	},
 	{
 		{ CORSAIR_K40_ID },
-		[] (libusb_device *dev) { return new K40Device (dev); }
+		[] (UsbTransport *transport) { return new K40Device (transport); }
 	},
 };
 
-static const char *usage = R"(Usage: %s [options] command
+static const char *usage = R"(Usage: %s [options] command [, command...]
 
 Options are:
-	-d address	Use this device instead of first found.
+	-d address[,address...]
+		Use this device instead of first found. With several addresses,
+		the command is run on every device at once.
+	-a, --all	Run the command on every supported device at once.
+	-s k40|k90[,k40|k90...]
+		Use simulated devices instead of real ones.
+	--record file	Append every control transfer to the log file.
+	--replay file	Answer transfers from the log file instead of a device.
+	--session n	Replay the nth session of the log (the last one).
+	--verify	Check the shadow state against the device before running
+			the command.
+	--trace file	Write the time spent in each phase and transfer to file,
+			in Chrome trace event format.
+	--timing	Print the time spent in each phase on exit.
+	--coalesce ms	Queue the writes to the device for up to ms milliseconds,
+			only the last value of each setting is written.
+	--timeout ms	Give up a transfer after ms milliseconds (2000, 0 waits
+			forever).
+	--deadline s	Fail the transfers of a command made after s seconds
+			(each frame for animate and ingest).
+	--retries n	Try failed transfers again up to n times (2).
 	-l layout	Use layout for converting string to key codes (in send-macros command).
 	-h		Print this help.
 
@@ -78,6 +105,13 @@ animation get rate
 	Get the current animation rate.
 animation set off|pulse|cycle [rate]
 	Set the current animation mode and rate (from 1 to 10).
+animate hue|fade color color|breathe [color] [--fps n] [--period s]
+	[--duration s] [--profile index]
+	Play an effect from the host by writing the profile color (or the
+	brightness for breathe without a color) n times per second (30),
+	one cycle every s seconds (4), for --duration seconds (10, 0 plays
+	until interrupted). --profile selects the profile whose color is
+	animated (0, the current one).
 backlight get
 	Get the backlight brightness.
 backlight set value
@@ -90,44 +124,199 @@ profile-color get [index]
 	Get the color for the current profile or index.
 profile-color set index color
 	Set the color for profile index to color (24 bits hexadecimal code).
-send-macros profile_index [file]
-	Send macros read from file or stdin.
+send-macros [--patch] [--force] [optimizer options] profile_index [file]
+	Send macros read from file or stdin. The upload is skipped if the
+	profile already holds them, unless --force is given. With --patch,
+	only the keys in file are changed. file may be a compiled profile.
+compile k40|k90 [optimizer options] output [file]
+	Compile macros read from file or stdin to a binary profile for the
+	model, sent by send-macros without parsing.
+ingest [socket] [--duration s]
+	Apply the color and brightness frames sent to the datagram socket,
+	only the newest when frames come faster than the device takes them,
+	printing the frame counts every second. Runs for s seconds, or until
+	interrupted.
+status [json]
+	Print every field of the device status, read at once.
 raw-status
 	Print raw USB status data.
+batch [file]
+	Run the commands read line by line from file or stdin.
+daemon [socket]
+	Keep devices open and serve commands sent with corsair-usb-client.
+
+Optimizer options (macros are optimized if any is given):
+--optimize
+	Merge consecutive delays and drop zero delays and events that do
+	not change the state of their key.
+--scale factor
+	Multiply every delay by factor.
+--min-delay ms
+	Make every remaining delay at least ms long.
+
+Device commands separated by "," are run in order on the same device.
+When run on several devices, each output line is prefixed with the device
+address and --record appends the address to the log file name.
 )";
 
-libusb_device *findDevice (libusb_context *context, const char *address = nullptr);
-CorsairDevice *initDevice (libusb_device *dev);
-bool commandMode (CorsairDevice *cdev, const char * const *args);
-bool commandBacklight (CorsairDevice *cdev, const char * const *args);
-bool commandCurrentProfile (CorsairDevice *cdev, const char * const *args);
-bool commandProfileColor (CorsairDevice *cdev, const char * const *args);
-bool commandSendMacros (CorsairDevice *cdev, const char * const *args);
-bool commandAnimation (CorsairDevice *cdev, const char * const *args);
+std::set<uint16_t> supportedProducts ();
+CorsairDevice *initDevice (libusb_context *context, libusb_device *dev);
+CorsairDevice *initSimulatedDevice (const std::string &model, const std::string &label);
+CorsairDevice *initReplayDevice (ReplayTransport *transport);
+bool resolveDevice (DeviceRegistry &registry, const char *address,
+		    std::string &resolved, FILE *err);
+CorsairDevice *openDevice (DeviceRegistry &registry, const char *address,
+			   std::string &resolved, FILE *err);
+bool listDevices (DeviceRegistry &registry, FILE *out, FILE *err);
+bool verifyShadow (CorsairDevice *cdev, FILE *err);
+bool fanOut (libusb_context *context, bool all, const char *address, const char * const *args);
+void finishTrace ();
+
+const char *record_file = nullptr;
+bool verify_shadow = false;
+bool record_per_device = false;
+const char *simulated = nullptr;
+DeviceRegistry *registry = nullptr;
+const char *replay_file = nullptr;
+unsigned int replay_session = 0;
+ReplayTransport *replay = nullptr;
+const char *trace_file = nullptr;
+bool print_timing = false;
+unsigned int write_window = 0;
+
+enum LongOption {
+	OptRecord = 256,
+	OptReplay,
+	OptVerify,
+	OptTrace,
+	OptTiming,
+	OptCoalesce,
+	OptTimeout,
+	OptDeadline,
+	OptRetries,
+	OptSession,
+};
 
-std::string layout;
+static const struct option long_options[] = {
+	{ "all", no_argument, nullptr, 'a' },
+	{ "record", required_argument, nullptr, OptRecord },
+	{ "replay", required_argument, nullptr, OptReplay },
+	{ "verify", no_argument, nullptr, OptVerify },
+	{ "trace", required_argument, nullptr, OptTrace },
+	{ "timing", no_argument, nullptr, OptTiming },
+	{ "coalesce", required_argument, nullptr, OptCoalesce },
+	{ "timeout", required_argument, nullptr, OptTimeout },
+	{ "deadline", required_argument, nullptr, OptDeadline },
+	{ "retries", required_argument, nullptr, OptRetries },
+	{ "session", required_argument, nullptr, OptSession },
+	{ nullptr, 0, nullptr, 0 }
+};
 
 int main (int argc, char *argv[])
 {
 	const char *address = nullptr;
+	bool all = false;
 
 	int opt;
-	while (-1 != (opt = getopt (argc, argv, "d:l:h"))) {
+	while (-1 != (opt = getopt_long (argc, argv, "+d:as:l:h", long_options, nullptr))) {
 		switch (opt) {
 		case 'd':
 			address = optarg;
 			break;
 
+		case 'a':
+			all = true;
+			break;
+
+		case 's':
+			simulated = optarg;
+			break;
+
 		case 'l':
 			layout.assign (optarg);
 			break;
 
+		case OptRecord:
+			record_file = optarg;
+			break;
+
+		case OptReplay:
+			replay_file = optarg;
+			break;
+
+		case OptVerify:
+			verify_shadow = true;
+			break;
+
+		case OptTrace:
+			trace_file = optarg;
+			break;
+
+		case OptTiming:
+			print_timing = true;
+			break;
+
+		case OptCoalesce: {
+			char *end;
+			double ms = strtod (optarg, &end);
+			if (*end || end == optarg || !(ms > 0) || ms > 60000) {
+				fprintf (stderr, "Invalid coalescing window: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			write_window = ms * 1000;
+			break;
+		}
+
+		case OptTimeout: {
+			char *end;
+			unsigned long ms = strtoul (optarg, &end, 10);
+			if (*end || end == optarg || ms > 3600000) {
+				fprintf (stderr, "Invalid timeout: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			TransferPolicy::defaults ().timeout = ms;
+			break;
+		}
+
+		case OptDeadline: {
+			char *end;
+			double seconds = strtod (optarg, &end);
+			if (*end || end == optarg || !(seconds > 0) || seconds > 86400) {
+				fprintf (stderr, "Invalid deadline: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			TransferPolicy::defaults ().deadline = std::max (1.0, seconds * 1000);
+			break;
+		}
+
+		case OptRetries: {
+			char *end;
+			unsigned long retries = strtoul (optarg, &end, 10);
+			if (*end || end == optarg || retries > 100) {
+				fprintf (stderr, "Invalid retry count: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			TransferPolicy::defaults ().retries = retries;
+			break;
+		}
+
+		case OptSession: {
+			char *end;
+			unsigned long session = strtoul (optarg, &end, 10);
+			if (*end || end == optarg || session == 0 || session > UINT_MAX) {
+				fprintf (stderr, "Invalid session: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			replay_session = session;
+			break;
+		}
+
 		case 'h':
 			fprintf (stderr, usage, argv[0]);
 			std::cerr << std::endl;
 			std::cerr << "Available layouts are:" << std::endl;
-			for (const auto &pair: KeyUsage::layouts)
-				std::cerr << pair.first << std::endl;
+			for (const std::string &name: KeyUsage::layoutNames ())
+				std::cerr << name << std::endl;
 			return EXIT_SUCCESS;
 
 		default:
@@ -142,465 +331,447 @@ int main (int argc, char *argv[])
 	}
 	std::string command = argv[optind];
 
+	if (trace_file || print_timing) {
+		Trace::enable ();
+		atexit (finishTrace);
+	}
+
+	// Compiling needs no device
+	if (command == "compile") {
+		const char *model = argv[optind+1];
+		if (!model) {
+			fprintf (stderr, "Missing model.\n");
+			return EXIT_FAILURE;
+		}
+		if (std::string (model) != K40Device::ModelName &&
+		    std::string (model) != K90Device::ModelName) {
+			fprintf (stderr, "Unknown model: %s\n", model);
+			return EXIT_FAILURE;
+		}
+		return compileProfile (model, &argv[optind+2], &std::cin, stdout, stderr) ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	libusb_context *context;
 	bool failed = false;
 	int ret;
-	if (0 != (ret = libusb_init (&context))) {
+	{
+		Trace::Span span ("libusb_init", "usb");
+		ret = libusb_init (&context);
+	}
+	if (ret != 0) {
 		fprintf (stderr, "Failed to initialize libusb: %s\n", libusb_error_name (ret));
 		return EXIT_FAILURE;
 	}
 
+	{
+		Trace::Span span ("enumerate", "usb");
+		registry = new DeviceRegistry (context, CORSAIR_VENDOR_ID, supportedProducts ());
+	}
+
+	// Interrupting a device command cancels its transfers instead of
+	// leaving the device in the middle of one
+	if (isDeviceCommand (command))
+		Cancellation::catchSignals ();
+
 	if (command == "list") {
-		libusb_device **list;
-		int count;
-		if (0 > (count = libusb_get_device_list (context, &list))) {
-			fprintf (stderr, "Failed to get device list: %s\n", libusb_error_name (count));
+		if (!listDevices (*registry, stdout, stderr))
 			failed = true;
-			goto cleanup;
-		}
-		for (int i = 0; i < count; ++i) {
-			libusb_device *dev = list[i];
-			libusb_device_descriptor desc;
-			libusb_get_device_descriptor (dev, &desc);
-			if (desc.idVendor != CORSAIR_VENDOR_ID)
-				continue;
-			for (auto info: device_table) {
-				if (info.products.find (desc.idProduct) != info.products.end ()) {
-					uint8_t busnum = libusb_get_bus_number (dev);
-					uint8_t ports[7];
-					int port_count = libusb_get_port_numbers (dev, ports, sizeof (ports));
-					if (port_count == 0)
-						ports[0] = 0;
-					printf ("%d-%d", busnum, ports[0]);
-					for (int j = 1; j < port_count; ++j)
-						printf (".%d", ports[j]);
-					printf (": %04hx:%04hx", desc.idVendor, desc.idProduct);
-					libusb_device_handle *handle;
-					ret = libusb_open (dev, &handle);
-					if (ret == 0 ) {
-						unsigned char string[256];
-						if (desc.iManufacturer != 0) {
-							ret = libusb_get_string_descriptor_ascii (handle, desc.iManufacturer, string, sizeof (string));
-							printf (" %*s", ret, string);
-						}
-						if (desc.iProduct != 0) {
-							ret = libusb_get_string_descriptor_ascii (handle, desc.iProduct, string, sizeof (string));
-							printf (" %*s", ret, string);
-						}
-						libusb_close (handle);
-					}
-					printf ("\n");
-					break;
-				}
-			}
-		}
-		libusb_free_device_list (list, count);
 	}
-	else {
-		libusb_device *dev = findDevice (context, address);
-		if (!dev) {
-			fprintf (stderr, "Could not find device.\n");
+	else if (command == "daemon") {
+		DaemonHandlers handlers;
+		handlers.resolve = [address] (const std::string &addr, std::string &resolved, FILE *err) {
+			return resolveDevice (*registry, addr.empty () ? address : addr.c_str (), resolved, err);
+		};
+		handlers.open = [address] (const std::string &resolved, FILE *err) {
+			std::string opened;
+			return openDevice (*registry, resolved.empty () ? address : resolved.c_str (), opened, err);
+		};
+		handlers.other = [] (const char * const *args, FILE *out, FILE *err) {
+			if (std::string (args[0]) == "list")
+				return listDevices (*registry, out, err);
+			fprintf (err, "Unknown command: %s\n", args[0]);
+			return false;
+		};
+		std::string socket_path = argv[optind+1] ? argv[optind+1] : DaemonProtocol::defaultSocketPath ();
+		if (!runDaemon (context, *registry, socket_path, handlers))
 			failed = true;
-			goto cleanup;
-		}
-		CorsairDevice *cdev = initDevice (dev);
-		libusb_unref_device (dev);
+	}
+	else if (isDeviceCommand (command) &&
+		 (all || (address && strchr (address, ',')) || (simulated && strchr (simulated, ',')))) {
+		if (!fanOut (context, all, address, &argv[optind]))
+			failed = true;
+	}
+	else if (isDeviceCommand (command)) {
+		std::string resolved;
+		CorsairDevice *cdev = openDevice (*registry, address, resolved, stderr);
 		if (!cdev) {
-			fprintf (stderr, "Not a valid device.\n");
 			failed = true;
 			goto cleanup;
 		}
-
-		if (command == "mode") {
-			if (!commandMode (cdev, &argv[optind+1]))
-				failed = true;
-		}
-		else if (command == "animation") {
-			if (!commandAnimation (cdev, &argv[optind+1]))
-				failed = true;
-		}
-		else if (command == "backlight") {
-			if (!commandBacklight (cdev, &argv[optind+1]))
-				failed = true;
-		}
-		else if (command == "current-profile") {
-			if (!commandCurrentProfile (cdev, &argv[optind+1]))
-				failed = true;
-		}
-		else if (command == "profile-color") {
-			if (!commandProfileColor (cdev, &argv[optind+1]))
-				failed = true;
-		}
-		else if (command == "send-macros") {
-			if (!commandSendMacros (cdev, &argv[optind+1]))
-				failed = true;
-		}
-		else if (command == "raw-status") {
-			std::vector<uint8_t> status = cdev->getRawStatus ();
-			printf ("Status:");
-			for (uint8_t byte: status)
-				printf (" %02hhx", byte);
-			printf ("\n");
-		}
-		else {
-			fprintf (stderr, "Unknown command: %s\n", command.c_str ());
+		UsbEventLoop *event_loop = new UsbEventLoop (context, cdev->clock ());
+		CommandContext ctx = { cdev, event_loop, &std::cin, stdout, stderr, 0 };
+		if (!runCommand (ctx, &argv[optind]))
+			failed = true;
+		if (replay && (replay->mismatchCount () > 0 ||
+			       replay->replayedCount () != replay->transferCount ())) {
+			fprintf (stderr, "Replay: %u of %u transfers replayed, %u mismatches.\n",
+				 replay->replayedCount (), replay->transferCount (),
+				 replay->mismatchCount ());
 			failed = true;
-			goto cleanup;
 		}
+		delete event_loop;
 		delete cdev;
 	}
+	else {
+		fprintf (stderr, "Unknown command: %s\n", command.c_str ());
+		failed = true;
+	}
 cleanup:
+	delete registry;
 	libusb_exit (context);
 	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-libusb_device *findDevice (libusb_context *context, const char *address)
+// Write the trace file and print the timing summary, at exit
+void finishTrace ()
 {
-	libusb_device **list;
-	int count;
-	if (0 > (count = libusb_get_device_list (context, &list))) {
-		fprintf (stderr, "Failed to get device list: %s\n", libusb_error_name (count));
-		return nullptr;
-	}
-	for (int i = 0; i < count; ++i) {
-		libusb_device *dev = list[i];
-		libusb_device_descriptor desc;
-		libusb_get_device_descriptor (dev, &desc);
-		if (!address) {
-			if (desc.idVendor != CORSAIR_VENDOR_ID)
-				continue;
-			for (auto info: device_table) {
-				if (info.products.find (desc.idProduct) != info.products.end ()) {
-					dev = libusb_ref_device (dev);
-					libusb_free_device_list (list, count);
-					return dev;
-				}
-			}
+	if (print_timing)
+		Trace::printSummary (stderr);
+	if (trace_file) {
+		try {
+			Trace::write (trace_file);
 		}
-		else {
-			uint8_t dev_busnum = libusb_get_bus_number (dev);
-			uint8_t dev_ports[7];
-			int dev_port_count = libusb_get_port_numbers (dev, dev_ports, sizeof (dev_ports));
-
-			const char *del = strchr (address, '-');
-			if (!del) {
-				fprintf (stderr, "Invalid address.");
-				goto fail;
-			}
-			unsigned int addr_busnum = std::stoul (std::string (address, del));
-			if (addr_busnum != dev_busnum)
-				continue;
-			const char *begin = del+1;
-			int addr_port_count = 0;
-			unsigned int addr_ports[7];
-			do {
-				del = strchr (begin, '.');
-				const char *end;
-				if (del)
-					end = del;
-				else
-					end = strchr (begin, '\0');
-				addr_ports[addr_port_count] = std::stoul (std::string (begin, end));
-				++addr_port_count;
-				begin = end+1;
-			} while (del);
-
-			bool found = false;
-			if (dev_port_count == 0 && addr_port_count == 1 && addr_ports[0] == 0) {
-				found = true;
-			}
-			else if (dev_port_count == addr_port_count) {
-				found = true;
-				for (int j = 0; j < dev_port_count; ++j) {
-					if (dev_ports[j] != addr_ports[j]) {
-						found = false;
-						break;
-					}
-				}
-			}
-
-			if (found) {
-				dev = libusb_ref_device (dev);
-				libusb_free_device_list (list, count);
-				return dev;
-			}
+		catch (std::exception &e) {
+			fprintf (stderr, "Failed to write trace: %s\n", e.what ());
 		}
 	}
-fail:
-	libusb_free_device_list (list, count);
-	return nullptr;
 }
 
-CorsairDevice *initDevice (libusb_device *dev)
+static void rescan (DeviceRegistry &registry)
 {
-	libusb_device_descriptor desc;
-	libusb_get_device_descriptor (dev, &desc);
-	if (desc.idVendor != CORSAIR_VENDOR_ID)
-		return nullptr;
-	for (auto info: device_table) {
-		if (info.products.find (desc.idProduct) != info.products.end ()) {
-			return info.factory (dev);
-		}
-	}
-	return nullptr;
+	Trace::Span span ("enumerate", "usb");
+	registry.rescan ();
 }
 
-bool commandAnimation (CorsairDevice *cdev, const char * const *args)
+bool listDevices (DeviceRegistry &registry, FILE *out, FILE *)
 {
-	unsigned int rate = 0;
-	if (!args[0]) {
-		fprintf (stderr, "Missing operation.\n");
-		return false;
-	}
-	std::string op = args[0];
-	if (op == "get") {
-		if (!args[1]) {
-			unsigned int mode = cdev->getAnimationMode ();
-			switch (mode) {
-			case CorsairDevice::AnimOff:
-				printf ("Off\n");
-				break;
-
-			case CorsairDevice::AnimPulse:
-				printf ("Pulse\n");
-				break;
-
-			case CorsairDevice::AnimCycle:
-				printf ("Cycle\n");
-				break;
-		
-			default:
-				printf ("Unknown\n");
+	if (!registry.hotplug ())
+		rescan (registry);
+	for (const DeviceRegistry::Device *device: registry.devices ()) {
+		libusb_device_descriptor desc;
+		libusb_get_device_descriptor (device->device, &desc);
+		fprintf (out, "%s: %04hx:%04hx", device->address.c_str (), desc.idVendor, desc.idProduct);
+		libusb_device_handle *handle;
+		int ret = libusb_open (device->device, &handle);
+		if (ret == 0 ) {
+			unsigned char string[256];
+			if (desc.iManufacturer != 0) {
+				ret = libusb_get_string_descriptor_ascii (handle, desc.iManufacturer, string, sizeof (string));
+				fprintf (out, " %*s", ret, string);
 			}
+			if (desc.iProduct != 0) {
+				ret = libusb_get_string_descriptor_ascii (handle, desc.iProduct, string, sizeof (string));
+				fprintf (out, " %*s", ret, string);
+			}
+			libusb_close (handle);
 		}
-		else {
-			std::string op1 = args[1];
-			if (op1 == "rate")
-				{
-					rate = cdev->getAnimationRate();
-					printf ("%i\n", rate);
-				}
-			else printf("Unknown command.\n");
-		}
-	}
-	else if (op == "set") {
-		if (!args[1]) {
-			fprintf (stderr, "Missing animation mode.\n");
-			return false;
-		}
-		if (args[2]) {
-			rate = std::stoul(args[2]);
-			if (rate > 10)
-				{
-				fprintf (stderr, "Invalid animation rate. Must be between 1 and 10.\n");
-				return false;	
-				}
-			rate = rate << 8;
-		}
-			
-		std::string mode = args[1];
-		if (mode == "off")
-			cdev->setAnimationMode (CorsairDevice::AnimOff, rate);
-		else if (mode == "pulse")
-			cdev->setAnimationMode (CorsairDevice::AnimPulse, rate);
-		else if (mode == "cycle")
-			cdev->setAnimationMode (CorsairDevice::AnimCycle, rate);
-		else {
-			fprintf (stderr, "Unknown mode: %s.\n", mode.c_str ());
-			return false;
-		}
-	}
-	else {
-		fprintf (stderr, "Unknown operation: %s.\n", op.c_str ());
-		return false;
+		fprintf (out, "\n");
 	}
 	return true;
 }
 
-bool commandMode (CorsairDevice *cdev, const char * const *args)
+static const DeviceRegistry::Device *findDevice (DeviceRegistry &registry, const std::string &address)
 {
-	if (!args[0]) {
-		fprintf (stderr, "Missing operation.\n");
-		return false;
+	const DeviceRegistry::Device *device = address.empty () ? registry.first () : registry.find (address);
+	if (!device && !registry.hotplug ()) {
+		rescan (registry);
+		device = address.empty () ? registry.first () : registry.find (address);
 	}
-	std::string op = args[0];
-	if (op == "get") {
-		CorsairDevice::Mode mode = cdev->getMode ();
-		switch (mode) {
-		case CorsairDevice::HardwareMode:
-			printf ("HW\n");
-			break;
+	return device;
+}
 
-		case CorsairDevice::SoftwareMode:
-			printf ("SW\n");
-			break;
+static const DeviceRegistry::Device *lookupDevice (DeviceRegistry &registry, const char *address, FILE *err)
+{
+	std::string normalized;
+	if (address && (normalized = DeviceRegistry::normalizeAddress (address)).empty ()) {
+		fprintf (err, "Invalid address.\n");
+		return nullptr;
+	}
+	const DeviceRegistry::Device *device = findDevice (registry, normalized);
+	if (!device)
+		fprintf (err, "Could not find device.\n");
+	return device;
+}
 
-		case CorsairDevice::FirmwareUpdateMode:
-			printf ("FW\n");
-			break;
+bool resolveDevice (DeviceRegistry &registry, const char *address,
+		    std::string &resolved, FILE *err)
+{
+	resolved.clear ();
+	// There is a single simulated or replayed device
+	if (replay_file || simulated)
+		return true;
+	const DeviceRegistry::Device *device = lookupDevice (registry, address, err);
+	if (!device)
+		return false;
+	resolved = device->address;
+	return true;
+}
 
-		default:
-			printf ("Unknown\n");
+CorsairDevice *openDevice (DeviceRegistry &registry, const char *address,
+			   std::string &resolved, FILE *err)
+{
+	CorsairDevice *cdev;
+	resolved.clear ();
+	if (replay_file) {
+		try {
+			replay = new ReplayTransport (replay_file, replay_session);
 		}
-	}
-	else if (op == "set") {
-		if (!args[1]) {
-			fprintf (stderr, "Missing mode.\n");
-			return false;
+		catch (std::exception &e) {
+			fprintf (err, "%s\n", e.what ());
+			return nullptr;
 		}
-		std::string mode = args[1];
-		if (mode == "HW")
-			cdev->setMode (CorsairDevice::HardwareMode);
-		else if (mode == "SW")
-			cdev->setMode (CorsairDevice::SoftwareMode);
-		else {
-			fprintf (stderr, "Unknown mode: %s.\n", mode.c_str ());
-			return false;
+		if (!(cdev = initReplayDevice (replay))) {
+			fprintf (err, "Not a valid device.\n");
+			return nullptr;
+		}
+	}
+	else if (simulated) {
+		if (!(cdev = initSimulatedDevice (simulated, simulated))) {
+			fprintf (err, "Unknown simulated device: %s\n", simulated);
+			return nullptr;
 		}
 	}
 	else {
-		fprintf (stderr, "Unknown operation: %s.\n", op.c_str ());
-		return false;
+		const DeviceRegistry::Device *device = lookupDevice (registry, address, err);
+		if (!device)
+			return nullptr;
+		try {
+			Trace::Span span ("open", "usb");
+			cdev = initDevice (registry.context (), device->device);
+		}
+		catch (std::exception &e) {
+			fprintf (err, "Failed to open device: %s\n", e.what ());
+			return nullptr;
+		}
+		if (!cdev) {
+			fprintf (err, "Not a valid device.\n");
+			return nullptr;
+		}
+		resolved = device->address;
 	}
-	return true;
+	if (verify_shadow && !verifyShadow (cdev, err)) {
+		delete cdev;
+		return nullptr;
+	}
+	return cdev;
 }
 
-bool commandBacklight (CorsairDevice *cdev, const char * const *args)
+bool verifyShadow (CorsairDevice *cdev, FILE *err)
 {
-	if (!args[0]) {
-		fprintf (stderr, "Missing operation.\n");
+	typedef CorsairDevice::StatusSnapshot Snapshot;
+	static const struct {
+		Snapshot::Field field;
+		const char *name;
+	} fields[] = {
+		{ Snapshot::BacklightBrightness, "backlight" },
+		{ Snapshot::AnimationMode, "animation" },
+		{ Snapshot::AnimationRate, "animation rate" },
+		{ Snapshot::CurrentProfile, "current profile" },
+		{ Snapshot::ProfileColor, "profile color" },
+		{ Snapshot::ColorMode, "color mode" },
+	};
+	unsigned int wrong;
+	try {
+		wrong = cdev->verifyShadow ();
+	}
+	catch (std::exception &e) {
+		fprintf (err, "Failed to read status: %s\n", e.what ());
 		return false;
 	}
-	std::string op = args[0];
-	if (op == "get") {
-		printf ("%d\n", cdev->getBacklightBrightness ());
-	}
-	else if (op == "set") {
-		if (!args[1]) {
-			fprintf (stderr, "Missing backlight brightness.\n");
-			return false;
-		}
-		unsigned int brightness = std::stoul (args[1]);
-		cdev->setBacklightBrightness (brightness);
-	}
-	else {
-		fprintf (stderr, "Unknown operation: %s.\n", op.c_str ());
-		return false;
+	for (const auto &f: fields) {
+		if (wrong & f.field)
+			fprintf (err, "Shadow state corrected: %s.\n", f.name);
 	}
 	return true;
 }
 
-bool commandCurrentProfile (CorsairDevice *cdev, const char * const *args)
+static std::vector<std::string> splitList (const char *list)
 {
-	if (!args[0]) {
-		fprintf (stderr, "Missing operation.\n");
-		return false;
-	}
-	std::string op = args[0];
-	if (op == "get") {
-		printf ("%d\n", cdev->getCurrentProfile ());
-	}
-	else if (op == "set") {
-		if (!args[1]) {
-			fprintf (stderr, "Missing profile index.\n");
-			return false;
+	std::vector<std::string> items;
+	std::string item;
+	for (const char *c = list; *c; ++c) {
+		if (*c == ',') {
+			if (!item.empty ())
+				items.push_back (item);
+			item.clear ();
 		}
-		unsigned int profile_index = std::stoul (args[1]);
-		cdev->setCurrentProfile (profile_index);
-	}
-	else {
-		fprintf (stderr, "Unknown operation: %s.\n", op.c_str ());
-		return false;
+		else
+			item.push_back (*c);
 	}
-	return true;
+	if (!item.empty ())
+		items.push_back (item);
+	return items;
 }
 
-bool commandProfileColor (CorsairDevice *cdev, const char * const *args)
+bool fanOut (libusb_context *context, bool all, const char *address, const char * const *args)
 {
-	unsigned int profile_index;
-	if (!args[0]) {
-		fprintf (stderr, "Missing operation.\n");
+	if (replay_file) {
+		fprintf (stderr, "Cannot replay a log on several devices.\n");
 		return false;
 	}
-	unsigned int profile_current = cdev->getCurrentProfile();
-	std::string op = args[0];
-	if (!args[1]) {
-		//fprintf (stderr, "Missing profile index.\n");
-		//return false;
-		profile_index = profile_current;
+	if (all && address) {
+		fprintf (stderr, "-a and -d cannot be used together.\n");
+		return false;
 	}
-	else
-		profile_index = std::stoul (args[1]);
-	usleep (50000);
-	if (op == "get") {
-		if (profile_index != profile_current )
-			{
-			cdev->setCurrentProfile (profile_index);
-			usleep (50000);
-			}
-		Color color = cdev->getProfileColor(profile_index);
-		if (profile_index != profile_current )
-			{
-			usleep (50000);
-			cdev->setCurrentProfile (profile_current);
+	record_per_device = true;
+
+	// Devices that cannot be opened are reported, the command still
+	// runs on the others.
+	bool ok = true;
+	std::vector<CommandTarget> targets;
+	if (simulated) {
+		unsigned int index = 0;
+		for (const std::string &model: splitList (simulated)) {
+			std::string label = model + ":" + std::to_string (++index);
+			CorsairDevice *cdev = initSimulatedDevice (model, label);
+			if (!cdev) {
+				fprintf (stderr, "Unknown simulated device: %s\n", model.c_str ());
+				ok = false;
+				continue;
 			}
-		printf ("%02hhx%02hhx%02hhx\n",color.r, color.g, color.b);
-	}
-	else if (op == "set") {
-		if (!args[2]) {
-			fprintf (stderr, "Missing color.\n");
-			return false;
+			targets.push_back ({ label, cdev });
 		}
-		unsigned int c = std::stoul (args[2], nullptr, 16);
-		Color color = {
-			static_cast<uint8_t> ((c >> 16) & 0xFF),
-			static_cast<uint8_t> ((c >> 8) & 0xFF),
-			static_cast<uint8_t> (c & 0xFF)
-		};
-//		std::cout << "RGB Values:\n";
-//		printf("%02hhX %02hhX %02hhX\n",color.r, color.g, color.b);
-		cdev->setProfileColor (profile_index, color);
 	}
 	else {
-		fprintf (stderr, "Unknown operation: %s._n", op.c_str ());
-		return false;
+		std::vector<std::string> addresses;
+		if (all) {
+			if (!registry->hotplug ())
+				rescan (*registry);
+			for (const DeviceRegistry::Device *device: registry->devices ())
+				addresses.push_back (device->address);
+			if (addresses.empty ()) {
+				fprintf (stderr, "Could not find device.\n");
+				return false;
+			}
+		}
+		else
+			addresses = splitList (address);
+		std::set<std::string> opened;
+		for (const std::string &addr: addresses) {
+			std::string resolved;
+			CorsairDevice *cdev = openDevice (*registry, addr.c_str (), resolved, stderr);
+			if (!cdev) {
+				fprintf (stderr, "%s: failed\n", addr.c_str ());
+				ok = false;
+				continue;
+			}
+			if (!opened.insert (resolved).second) {
+				// The same device listed twice
+				delete cdev;
+				continue;
+			}
+			targets.push_back ({ resolved, cdev });
+		}
 	}
-	return true;
+
+	if (!targets.empty () && !runCommandOnDevices (context, targets, args, stdout, stderr))
+		ok = false;
+	for (const CommandTarget &target: targets)
+		delete target.device;
+	return ok;
 }
 
-bool commandSendMacros (CorsairDevice *cdev, const char * const *args)
+std::set<uint16_t> supportedProducts ()
 {
-	if (!args[0]) {
-		fprintf (stderr, "Missing profile index.\n");
-		return false;
-	}
-	unsigned int profile_index = std::stoul (args[0]);
+	std::set<uint16_t> products;
+	for (const auto &info: device_table)
+		products.insert (info.products.begin (), info.products.end ());
+	return products;
+}
 
-	Json::Value profile_json;
-	Json::Reader reader;
-	bool ok;
-	if (args[1]) {
-		std::ifstream file (args[1], std::ifstream::in);
-		ok = reader.parse (file, profile_json);
-	}
-	else {
-		ok = reader.parse (std::cin, profile_json);
-	}
-	if (!ok) {
-		fprintf (stderr, "Error while parsing JSON:\n"
-		                 "%s",
-		         reader.getFormattedErrorMessages ().c_str ());
-		return EXIT_FAILURE;
+static const DeviceInfo *findDeviceInfo (uint16_t product_id)
+{
+	for (const auto &info: device_table) {
+		if (info.products.find (product_id) != info.products.end ())
+			return &info;
 	}
+	return nullptr;
+}
 
-	std::vector<CorsairDevice::KeySettings> keys;
-	if (!JsonToMacros (profile_json, keys, layout)) {
-		fprintf (stderr, "Invalid profile structure\n");
-		return EXIT_FAILURE;
-	}
+static CorsairDevice *createDevice (const DeviceInfo *info, uint16_t product_id,
+				    UsbTransport *transport, const std::string &label)
+{
+	if (record_file) {
+		std::string path = record_file;
+		if (record_per_device)
+			path += "." + label;
+		transport = new RecordingTransport (path, product_id, transport);
+	}
+	if (Trace::enabled ())
+		transport = new TracingTransport (transport);
+	CorsairDevice *cdev = info->factory (transport);
+	if (write_window)
+		cdev->setWriteWindow (write_window);
+	return cdev;
+}
 
-	cdev->setKeys (profile_index, keys);
+// Serial number if the device has one, bus address otherwise
+static std::string deviceIdentity (libusb_device *dev, const libusb_device_descriptor &desc,
+				   libusb_device_handle *handle)
+{
+	char product[8];
+	snprintf (product, sizeof (product), "%04hx", desc.idProduct);
+	if (desc.iSerialNumber != 0) {
+		unsigned char serial[256];
+		int ret = libusb_get_string_descriptor_ascii (handle, desc.iSerialNumber,
+							      serial, sizeof (serial));
+		if (ret > 0)
+			return std::string (product) + "-" + std::string (reinterpret_cast<char *> (serial), ret);
+	}
+	return std::string (product) + "-" + DeviceRegistry::address (dev);
+}
 
-	return true;
+CorsairDevice *initDevice (libusb_context *context, libusb_device *dev)
+{
+	libusb_device_descriptor desc;
+	libusb_get_device_descriptor (dev, &desc);
+	if (desc.idVendor != CORSAIR_VENDOR_ID)
+		return nullptr;
+	const DeviceInfo *info = findDeviceInfo (desc.idProduct);
+	if (!info)
+		return nullptr;
+	LibusbTransport *transport = new LibusbTransport (dev, context);
+	std::string identity = deviceIdentity (dev, desc, transport->handle ());
+	CorsairDevice *cdev = createDevice (info, desc.idProduct, new ReliableTransport (transport),
+					    DeviceRegistry::address (dev));
+	cdev->setIdentity (identity);
+	return cdev;
+}
+
+CorsairDevice *initSimulatedDevice (const std::string &model, const std::string &label)
+{
+	SimulatedTransport::Model sim_model;
+	uint16_t product_id;
+	if (model == "k40") {
+		sim_model = SimulatedTransport::K40;
+		product_id = CORSAIR_K40_ID;
+	}
+	else if (model == "k90") {
+		sim_model = SimulatedTransport::K90;
+		product_id = CORSAIR_K90_ID;
+	}
+	else
+		return nullptr;
+	return createDevice (findDeviceInfo (product_id), product_id,
+			     new ReliableTransport (new SimulatedTransport (sim_model)), label);
 }
 
+CorsairDevice *initReplayDevice (ReplayTransport *transport)
+{
+	const DeviceInfo *info = findDeviceInfo (transport->productId ());
+	if (!info) {
+		delete transport;
+		return nullptr;
+	}
+	return createDevice (info, transport->productId (), transport, replay_file);
+}